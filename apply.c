@@ -0,0 +1,219 @@
+#include <event2/event.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "apply.h"
+
+struct apply {
+  sp_session *session;
+  sp_playlist *playlist;
+  struct playlist_ops ops;
+  int op_index;
+  int op_offset;  // Tracks of the current operation already applied
+  int chunk_size;
+  int *positions;  // chunk_size positions for removals
+  long done;
+  struct event *timer;
+  struct timeval sync_timeout;
+  bool waiting_for_sync;
+  apply_progress_fn progress;
+  apply_done_fn done_callback;
+  void *userdata;
+};
+
+static struct apply_stats stats;
+
+void playlist_ops_init(struct playlist_ops *ops) {
+  ops->ops = NULL;
+  ops->num_ops = 0;
+  ops->capacity = 0;
+  ops->num_tracks = 0;
+}
+
+bool playlist_ops_append(struct playlist_ops *ops,
+                         enum playlist_op_type type,
+                         int position,
+                         int count,
+                         sp_track *const *tracks) {
+  if (ops->num_ops == ops->capacity) {
+    int capacity = ops->capacity > 0 ? ops->capacity * 2 : 16;
+    struct playlist_op *grown = realloc(ops->ops,
+                                        capacity * sizeof(struct playlist_op));
+
+    if (grown == NULL)
+      return false;
+
+    ops->ops = grown;
+    ops->capacity = capacity;
+  }
+
+  struct playlist_op *op = &ops->ops[ops->num_ops++];
+  op->type = type;
+  op->position = position;
+  op->count = count;
+  op->tracks = tracks;
+  ops->num_tracks += count;
+  return true;
+}
+
+void playlist_ops_free(struct playlist_ops *ops) {
+  free(ops->ops);
+  playlist_ops_init(ops);
+}
+
+static void apply_update_in_progress(sp_playlist *playlist,
+                                     bool done,
+                                     void *userdata);
+
+static sp_playlist_callbacks apply_callbacks = {
+  .playlist_update_in_progress = &apply_update_in_progress
+};
+
+static void apply_finish(struct apply *apply, sp_error error) {
+  apply_done_fn done = apply->done_callback;
+  void *userdata = apply->userdata;
+  sp_playlist_remove_callbacks(apply->playlist, &apply_callbacks, apply);
+  sp_playlist_release(apply->playlist);
+  event_free(apply->timer);
+  playlist_ops_free(&apply->ops);
+  free(apply->positions);
+  free(apply);
+  stats.running--;
+  done(error, userdata);
+}
+
+// Runs the next chunk from the event loop
+static void apply_schedule(struct apply *apply) {
+  struct timeval now = {0, 0};
+  apply->waiting_for_sync = false;
+  evtimer_add(apply->timer, &now);
+}
+
+static void apply_next_chunk(struct apply *apply) {
+  if (apply->op_index == apply->ops.num_ops) {
+    apply_finish(apply, SP_ERROR_OK);
+    return;
+  }
+
+  struct playlist_op *op = &apply->ops.ops[apply->op_index];
+  int count = op->count - apply->op_offset;
+
+  if (count > apply->chunk_size)
+    count = apply->chunk_size;
+
+  sp_error error;
+
+  if (op->type == PLAYLIST_OP_REMOVE) {
+    // Later tracks move up as earlier ones are removed
+    for (int i = 0; i < count; i++)
+      apply->positions[i] = op->position + i;
+
+    error = sp_playlist_remove_tracks(apply->playlist, apply->positions,
+                                      count);
+  } else {
+    error = sp_playlist_add_tracks(apply->playlist,
+                                   op->tracks + apply->op_offset, count,
+                                   op->position + apply->op_offset,
+                                   apply->session);
+  }
+
+  if (error != SP_ERROR_OK) {
+    apply_finish(apply, error);
+    return;
+  }
+
+  apply->op_offset += count;
+  apply->done += count;
+  stats.chunks++;
+  stats.tracks += count;
+
+  if (apply->op_offset == op->count) {
+    apply->op_index++;
+    apply->op_offset = 0;
+  }
+
+  if (apply->progress != NULL)
+    apply->progress(apply->done, apply->ops.num_tracks, apply->userdata);
+
+  if (apply->op_index < apply->ops.num_ops &&
+      sp_playlist_has_pending_changes(apply->playlist)) {
+    apply->waiting_for_sync = true;
+    evtimer_add(apply->timer, &apply->sync_timeout);
+  } else {
+    apply_schedule(apply);
+  }
+}
+
+static void apply_timer_fired(evutil_socket_t socket,
+                              short what,
+                              void *userdata) {
+  struct apply *apply = userdata;
+
+  // Go on without the sync rather than stall forever, e.g. when offline
+  if (apply->waiting_for_sync)
+    stats.sync_timeouts++;
+
+  apply->waiting_for_sync = false;
+  apply_next_chunk(apply);
+}
+
+static void apply_update_in_progress(sp_playlist *playlist,
+                                     bool done,
+                                     void *userdata) {
+  struct apply *apply = userdata;
+
+  if (done && apply->waiting_for_sync)
+    apply_schedule(apply);
+}
+
+bool playlist_apply(struct event_base *event_base,
+                    sp_session *session,
+                    sp_playlist *playlist,
+                    struct playlist_ops *ops,
+                    int chunk_size,
+                    int sync_timeout,
+                    apply_progress_fn progress,
+                    apply_done_fn done,
+                    void *userdata) {
+  struct apply *apply = calloc(1, sizeof(struct apply));
+
+  if (chunk_size < 1)
+    chunk_size = 1;
+
+  if (apply != NULL) {
+    apply->positions = malloc(chunk_size * sizeof(int));
+    apply->timer = evtimer_new(event_base, &apply_timer_fired, apply);
+  }
+
+  if (apply == NULL || apply->positions == NULL || apply->timer == NULL) {
+    if (apply != NULL) {
+      free(apply->positions);
+
+      if (apply->timer != NULL)
+        event_free(apply->timer);
+    }
+
+    free(apply);
+    return false;
+  }
+
+  apply->session = session;
+  apply->playlist = playlist;
+  apply->ops = *ops;
+  playlist_ops_init(ops);
+  apply->chunk_size = chunk_size;
+  apply->sync_timeout.tv_sec = sync_timeout;
+  apply->progress = progress;
+  apply->done_callback = done;
+  apply->userdata = userdata;
+  sp_playlist_add_ref(playlist);
+  sp_playlist_add_callbacks(playlist, &apply_callbacks, apply);
+  stats.running++;
+  apply_schedule(apply);
+  return true;
+}
+
+void apply_get_stats(struct apply_stats *result) {
+  *result = stats;
+}
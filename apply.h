@@ -0,0 +1,71 @@
+#ifndef APPLY_H_
+#define APPLY_H_
+
+#include <event2/event.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+
+enum playlist_op_type {
+  PLAYLIST_OP_REMOVE,
+  PLAYLIST_OP_ADD
+};
+
+// Removes `count` tracks at `position`, or adds `tracks` there
+struct playlist_op {
+  enum playlist_op_type type;
+  int position;
+  int count;
+  sp_track *const *tracks;  // Not owned; must outlive the apply
+};
+
+// Operations to run on a playlist, in order
+struct playlist_ops {
+  struct playlist_op *ops;
+  int num_ops;
+  int capacity;
+  long num_tracks;  // Tracks added or removed in total
+};
+
+void playlist_ops_init(struct playlist_ops *ops);
+
+// Returns false if out of memory
+bool playlist_ops_append(struct playlist_ops *ops,
+                         enum playlist_op_type type,
+                         int position,
+                         int count,
+                         sp_track *const *tracks);
+
+void playlist_ops_free(struct playlist_ops *ops);
+
+typedef void (*apply_progress_fn)(long done, long total, void *userdata);
+
+// Called once all operations have been handed to libspotify, or on the first
+// one that fails
+typedef void (*apply_done_fn)(sp_error error, void *userdata);
+
+// Counters for all applies
+struct apply_stats {
+  unsigned long running;
+  unsigned long chunks;
+  unsigned long tracks;
+  unsigned long sync_timeouts;
+};
+
+// Runs operations on a playlist at most `chunk_size` tracks at a time. After
+// each chunk it waits for libspotify to sync it (or for `sync_timeout`
+// seconds) before the next one, so that huge changes neither flood sync nor
+// need buffers sized by the change. Takes over `ops`. `progress` may be NULL.
+// Callbacks are made from the event loop. Returns false if out of memory.
+bool playlist_apply(struct event_base *event_base,
+                    sp_session *session,
+                    sp_playlist *playlist,
+                    struct playlist_ops *ops,
+                    int chunk_size,
+                    int sync_timeout,
+                    apply_progress_fn progress,
+                    apply_done_fn done,
+                    void *userdata);
+
+void apply_get_stats(struct apply_stats *stats);
+
+#endif
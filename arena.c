@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// Usable bytes in a block; most requests fit in the first one
+#define BLOCK_SIZE 8192
+
+// Blocks kept on each thread's freelist
+#define MAX_FREE_BLOCKS 64
+
+// Every allocation is aligned for any type
+#define ALIGNMENT 16
+
+struct block {
+  struct block *next;
+  size_t used;
+  size_t size;
+  unsigned char data[] __attribute__((aligned(ALIGNMENT)));
+};
+
+struct arena {
+  struct block *blocks;  // Current block first
+  struct block *large;   // Allocations that got blocks of their own
+};
+
+static __thread struct block *free_blocks = NULL;
+static __thread int num_free_blocks = 0;
+static __thread struct arena_stats stats = {0};
+
+static struct block *block_get(void) {
+  struct block *block = free_blocks;
+
+  if (block != NULL) {
+    free_blocks = block->next;
+    num_free_blocks--;
+    stats.block_reuses++;
+  } else {
+    block = malloc(sizeof(struct block) + BLOCK_SIZE);
+
+    if (block == NULL)
+      return NULL;
+
+    block->size = BLOCK_SIZE;
+    stats.block_mallocs++;
+  }
+
+  block->next = NULL;
+  block->used = 0;
+  return block;
+}
+
+static void block_put(struct block *block) {
+  if (num_free_blocks >= MAX_FREE_BLOCKS) {
+    free(block);
+    return;
+  }
+
+  block->next = free_blocks;
+  free_blocks = block;
+  num_free_blocks++;
+}
+
+static size_t align(size_t size) {
+  return (size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+}
+
+struct arena *arena_new(void) {
+  struct block *block = block_get();
+
+  if (block == NULL)
+    return NULL;
+
+  // The arena lives at the start of its own first block
+  struct arena *arena = (struct arena *) block->data;
+  block->used = align(sizeof(struct arena));
+  arena->blocks = block;
+  arena->large = NULL;
+  stats.arenas++;
+  return arena;
+}
+
+void arena_free(struct arena *arena) {
+  struct block *block = arena->large;
+
+  while (block != NULL) {
+    struct block *next = block->next;
+    free(block);
+    block = next;
+  }
+
+  // Careful: the arena itself lives in the last block of the list
+  block = arena->blocks;
+
+  while (block != NULL) {
+    struct block *next = block->next;
+    block_put(block);
+    block = next;
+  }
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+  size = align(size > 0 ? size : 1);
+  stats.allocations++;
+
+  if (size > BLOCK_SIZE / 4) {
+    struct block *large = malloc(sizeof(struct block) + size);
+
+    if (large == NULL)
+      return NULL;
+
+    large->size = size;
+    large->used = size;
+    large->next = arena->large;
+    arena->large = large;
+    stats.large_mallocs++;
+    return large->data;
+  }
+
+  struct block *block = arena->blocks;
+
+  if (block->size - block->used < size) {
+    block = block_get();
+
+    if (block == NULL)
+      return NULL;
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  void *ptr = block->data + block->used;
+  block->used += size;
+  return ptr;
+}
+
+void *arena_calloc(struct arena *arena, size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size)
+    return NULL;
+
+  void *ptr = arena_alloc(arena, count * size);
+
+  if (ptr != NULL)
+    memset(ptr, 0, count * size);
+
+  return ptr;
+}
+
+void arena_get_stats(struct arena_stats *out) {
+  *out = stats;
+}
@@ -0,0 +1,34 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+// Bump allocator for memory that lives exactly as long as one request.
+// Nothing is freed individually: the whole arena is released at once and
+// its blocks go back to a per-thread freelist for the next request.
+struct arena;
+
+// Allocation counters for the calling thread
+struct arena_stats {
+  unsigned long arenas;          // Arenas handed out
+  unsigned long block_mallocs;   // Blocks that had to be malloc'd
+  unsigned long block_reuses;    // Blocks taken from the freelist
+  unsigned long large_mallocs;   // Allocations too large for a block
+  unsigned long allocations;     // Calls to arena_alloc
+};
+
+// Returns NULL if out of memory
+struct arena *arena_new(void);
+
+// Releases all memory allocated from the arena
+void arena_free(struct arena *arena);
+
+// Returns NULL if out of memory
+void *arena_alloc(struct arena *arena, size_t size);
+
+// Zeroed memory for `count` items of `size` bytes
+void *arena_calloc(struct arena *arena, size_t count, size_t size);
+
+void arena_get_stats(struct arena_stats *stats);
+
+#endif
@@ -0,0 +1,107 @@
+#define _GNU_SOURCE  // clock_gettime
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "availability.h"
+#include "track_id.h"
+
+static int64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static void entry_free(struct availability_cache *cache,
+                       struct availability_entry *entry) {
+  apr_hash_set(cache->entries, entry->track_id, TRACK_ID_SIZE, NULL);
+  TAILQ_REMOVE(&cache->lru, entry, lru_entries);
+  cache->num_entries--;
+  free(entry);
+}
+
+struct availability_cache *availability_cache_new(apr_pool_t *pool,
+                                                  int max_entries,
+                                                  int ttl) {
+  struct availability_cache *cache = malloc(
+      sizeof(struct availability_cache));
+
+  if (cache == NULL)
+    return NULL;
+
+  cache->entries = apr_hash_make(pool);
+  TAILQ_INIT(&cache->lru);
+  cache->num_entries = 0;
+  cache->max_entries = max_entries;
+  cache->ttl = ttl;
+  cache->hits = 0;
+  cache->misses = 0;
+  return cache;
+}
+
+void availability_cache_free(struct availability_cache *cache) {
+  while (!TAILQ_EMPTY(&cache->lru))
+    entry_free(cache, TAILQ_FIRST(&cache->lru));
+
+  free(cache);
+}
+
+const struct availability_entry *availability_cache_get(
+    struct availability_cache *cache,
+    const unsigned char *track_id) {
+  struct availability_entry *entry = apr_hash_get(cache->entries, track_id,
+                                                  TRACK_ID_SIZE);
+
+  if (entry != NULL && entry->expires <= now()) {
+    entry_free(cache, entry);
+    entry = NULL;
+  }
+
+  if (entry == NULL) {
+    cache->misses++;
+    return NULL;
+  }
+
+  // Most recently used entries live at the tail
+  TAILQ_REMOVE(&cache->lru, entry, lru_entries);
+  TAILQ_INSERT_TAIL(&cache->lru, entry, lru_entries);
+  cache->hits++;
+  return entry;
+}
+
+void availability_cache_put(struct availability_cache *cache,
+                            const unsigned char *track_id,
+                            sp_track_availability availability) {
+  if (cache->max_entries <= 0 || cache->ttl <= 0)
+    return;
+
+  struct availability_entry *entry = apr_hash_get(cache->entries, track_id,
+                                                  TRACK_ID_SIZE);
+
+  if (entry != NULL) {
+    TAILQ_REMOVE(&cache->lru, entry, lru_entries);
+  } else {
+    while (cache->num_entries >= cache->max_entries)
+      entry_free(cache, TAILQ_FIRST(&cache->lru));
+
+    entry = malloc(sizeof(struct availability_entry));
+
+    if (entry == NULL)
+      return;
+
+    memcpy(entry->track_id, track_id, TRACK_ID_SIZE);
+    apr_hash_set(cache->entries, entry->track_id, TRACK_ID_SIZE, entry);
+    cache->num_entries++;
+  }
+
+  entry->availability = availability;
+  entry->expires = now() + cache->ttl;
+  TAILQ_INSERT_TAIL(&cache->lru, entry, lru_entries);
+}
@@ -0,0 +1,50 @@
+#ifndef AVAILABILITY_H_
+#define AVAILABILITY_H_
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "track_id.h"
+
+// What sp_track_get_availability() said about a track
+struct availability_entry {
+  unsigned char track_id[TRACK_ID_SIZE];
+  sp_track_availability availability;
+  int64_t expires;  // Monotonic seconds
+  TAILQ_ENTRY(availability_entry) lru_entries;
+};
+
+TAILQ_HEAD(availability_entry_list, availability_entry);
+
+// Bounded cache of track availability by track ID. Entries are served for
+// `ttl` seconds, and dropped least recently used first when full.
+struct availability_cache {
+  apr_hash_t *entries;  // track ID -> struct availability_entry *
+  struct availability_entry_list lru;
+  int num_entries;
+  int max_entries;
+  int ttl;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+struct availability_cache *availability_cache_new(apr_pool_t *pool,
+                                                  int max_entries,
+                                                  int ttl);
+
+void availability_cache_free(struct availability_cache *cache);
+
+// Returns the unexpired entry of a track, or NULL
+const struct availability_entry *availability_cache_get(
+    struct availability_cache *cache,
+    const unsigned char *track_id);
+
+void availability_cache_put(struct availability_cache *cache,
+                            const unsigned char *track_id,
+                            sp_track_availability availability);
+
+#endif
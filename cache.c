@@ -0,0 +1,295 @@
+#define _GNU_SOURCE  // strdup, clock_gettime
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "cache.h"
+
+// All cached variants of a playlist. Holds a reference to the playlist and
+// listens for changes for as long as there is at least one entry.
+struct cache_watch {
+  struct cache *cache;
+  sp_playlist *playlist;
+  struct cache_entry_list entries;
+};
+
+static void watch_free(struct cache_watch *watch);
+
+static int64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static void entry_free(struct cache_entry *entry) {
+  struct cache_watch *watch = entry->watch;
+  struct cache *cache = watch->cache;
+  TAILQ_REMOVE(&watch->entries, entry, watch_entries);
+  TAILQ_REMOVE(&cache->lru, entry, lru_entries);
+  cache->num_entries--;
+
+  free(entry->key);
+  free(entry->body);
+
+  for (int i = 0; i < NUM_CONTENT_ENCODINGS; i++)
+    free(entry->encoded_body[i]);
+
+  free(entry);
+
+  if (TAILQ_EMPTY(&watch->entries))
+    watch_free(watch);
+}
+
+static void playlist_changed(sp_playlist *playlist, void *userdata) {
+  struct cache_watch *watch = userdata;
+  struct cache *cache = watch->cache;
+  cache_invalidate(cache, playlist);
+
+  if (cache->changed != NULL)
+    cache->changed(playlist, cache->changed_userdata);
+}
+
+static void playlist_tracks_added(sp_playlist *playlist,
+                                  sp_track *const *tracks,
+                                  int num_tracks,
+                                  int position,
+                                  void *userdata) {
+  playlist_changed(playlist, userdata);
+}
+
+static void playlist_tracks_removed(sp_playlist *playlist,
+                                    const int *tracks,
+                                    int num_tracks,
+                                    void *userdata) {
+  playlist_changed(playlist, userdata);
+}
+
+static void playlist_tracks_moved(sp_playlist *playlist,
+                                  const int *tracks,
+                                  int num_tracks,
+                                  int new_position,
+                                  void *userdata) {
+  playlist_changed(playlist, userdata);
+}
+
+static void playlist_description_changed(sp_playlist *playlist,
+                                         const char *description,
+                                         void *userdata) {
+  playlist_changed(playlist, userdata);
+}
+
+// Anything that can change a rendered playlist
+static sp_playlist_callbacks watch_callbacks = {
+  .tracks_added = &playlist_tracks_added,
+  .tracks_removed = &playlist_tracks_removed,
+  .tracks_moved = &playlist_tracks_moved,
+  .playlist_renamed = &playlist_changed,
+  .playlist_state_changed = &playlist_changed,
+  .description_changed = &playlist_description_changed,
+  .subscribers_changed = &playlist_changed
+};
+
+static struct cache_watch *watch_get(struct cache *cache,
+                                     sp_playlist *playlist) {
+  return apr_hash_get(cache->watches, &playlist, sizeof(playlist));
+}
+
+static struct cache_watch *watch_new(struct cache *cache,
+                                     sp_playlist *playlist) {
+  struct cache_watch *watch = malloc(sizeof(struct cache_watch));
+
+  if (watch == NULL)
+    return NULL;
+
+  watch->cache = cache;
+  watch->playlist = playlist;
+  TAILQ_INIT(&watch->entries);
+  sp_playlist_add_ref(playlist);
+  sp_playlist_add_callbacks(playlist, &watch_callbacks, watch);
+  apr_hash_set(cache->watches, &watch->playlist, sizeof(watch->playlist),
+               watch);
+  return watch;
+}
+
+static void watch_free(struct cache_watch *watch) {
+  apr_hash_set(watch->cache->watches, &watch->playlist,
+               sizeof(watch->playlist), NULL);
+  sp_playlist_remove_callbacks(watch->playlist, &watch_callbacks, watch);
+  sp_playlist_release(watch->playlist);
+  free(watch);
+}
+
+struct cache *cache_new(apr_pool_t *pool, int max_entries) {
+  struct cache *cache = malloc(sizeof(struct cache));
+
+  if (cache == NULL)
+    return NULL;
+
+  cache->watches = apr_hash_make(pool);
+  TAILQ_INIT(&cache->lru);
+  cache->num_entries = 0;
+  cache->max_entries = max_entries;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->changed = NULL;
+  cache->changed_userdata = NULL;
+  return cache;
+}
+
+void cache_free(struct cache *cache) {
+  while (!TAILQ_EMPTY(&cache->lru))
+    entry_free(TAILQ_FIRST(&cache->lru));
+
+  free(cache);
+}
+
+static struct cache_entry *entry_find(struct cache *cache,
+                                      sp_playlist *playlist,
+                                      const char *key) {
+  struct cache_watch *watch = watch_get(cache, playlist);
+
+  if (watch == NULL)
+    return NULL;
+
+  struct cache_entry *entry;
+
+  TAILQ_FOREACH(entry, &watch->entries, watch_entries) {
+    if (strcmp(entry->key, key) == 0)
+      return entry;
+  }
+
+  return NULL;
+}
+
+struct cache_entry *cache_get(struct cache *cache,
+                              sp_playlist *playlist,
+                              const char *key) {
+  struct cache_entry *entry = entry_find(cache, playlist, key);
+
+  if (entry != NULL && entry->expires != 0 && entry->expires <= now()) {
+    entry_free(entry);
+    entry = NULL;
+  }
+
+  if (entry == NULL) {
+    cache->misses++;
+    return NULL;
+  }
+
+  // Most recently used entries live at the tail
+  TAILQ_REMOVE(&cache->lru, entry, lru_entries);
+  TAILQ_INSERT_TAIL(&cache->lru, entry, lru_entries);
+  cache->hits++;
+  return entry;
+}
+
+struct cache_entry *cache_put(struct cache *cache,
+                              sp_playlist *playlist,
+                              const char *key,
+                              const char *body,
+                              size_t body_len) {
+  if (cache->max_entries <= 0)
+    return NULL;
+
+  struct cache_entry *entry = entry_find(cache, playlist, key);
+
+  if (entry != NULL)
+    entry_free(entry);
+
+  while (cache->num_entries >= cache->max_entries)
+    entry_free(TAILQ_FIRST(&cache->lru));
+
+  // Look the watch up after evicting: it's freed along with its last entry
+  struct cache_watch *watch = watch_get(cache, playlist);
+
+  if (watch == NULL)
+    watch = watch_new(cache, playlist);
+
+  if (watch == NULL)
+    return NULL;
+
+  entry = malloc(sizeof(struct cache_entry));
+
+  if (entry == NULL)
+    goto fail;
+
+  entry->key = strdup(key);
+  entry->body = malloc(body_len);
+
+  if (entry->key == NULL || entry->body == NULL) {
+    free(entry->key);
+    free(entry->body);
+    free(entry);
+    goto fail;
+  }
+
+  memcpy(entry->body, body, body_len);
+  entry->body_len = body_len;
+  entry->expires = 0;
+
+  for (int i = 0; i < NUM_CONTENT_ENCODINGS; i++) {
+    entry->encoded_body[i] = NULL;
+    entry->encoded_len[i] = 0;
+  }
+
+  entry->watch = watch;
+  TAILQ_INSERT_TAIL(&watch->entries, entry, watch_entries);
+  TAILQ_INSERT_TAIL(&cache->lru, entry, lru_entries);
+  cache->num_entries++;
+  return entry;
+
+fail:
+  if (TAILQ_EMPTY(&watch->entries))
+    watch_free(watch);
+
+  return NULL;
+}
+
+void cache_entry_set_ttl(struct cache_entry *entry, int ttl) {
+  entry->expires = now() + ttl;
+}
+
+bool cache_entry_set_encoded(struct cache_entry *entry,
+                             enum content_encoding encoding,
+                             const char *body,
+                             size_t body_len) {
+  char *copy = malloc(body_len > 0 ? body_len : 1);
+
+  if (copy == NULL)
+    return false;
+
+  memcpy(copy, body, body_len);
+  free(entry->encoded_body[encoding]);
+  entry->encoded_body[encoding] = copy;
+  entry->encoded_len[encoding] = body_len;
+  return true;
+}
+
+void cache_resize(struct cache *cache, int max_entries) {
+  cache->max_entries = max_entries;
+
+  while (cache->num_entries > (max_entries > 0 ? max_entries : 0))
+    entry_free(TAILQ_FIRST(&cache->lru));
+}
+
+void cache_invalidate(struct cache *cache, sp_playlist *playlist) {
+  struct cache_watch *watch = watch_get(cache, playlist);
+
+  if (watch == NULL)
+    return;
+
+  // Freeing the last entry frees the watch as well
+  struct cache_entry *entry, *next;
+
+  for (entry = TAILQ_FIRST(&watch->entries); entry != NULL; entry = next) {
+    next = TAILQ_NEXT(entry, watch_entries);
+    entry_free(entry);
+  }
+}
@@ -0,0 +1,84 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include "compress.h"
+
+struct cache_watch;
+
+// A rendered response body. Each playlist can have several (pages, field
+// projections...), told apart by a variant key.
+struct cache_entry {
+  struct cache_watch *watch;
+  char *key;
+  char *body;
+  size_t body_len;
+  // Monotonic seconds after which the entry is dropped, or 0 to keep it
+  // until the playlist changes
+  int64_t expires;
+  // Compressed forms of the body, made the first time they're asked for
+  char *encoded_body[NUM_CONTENT_ENCODINGS];
+  size_t encoded_len[NUM_CONTENT_ENCODINGS];
+  TAILQ_ENTRY(cache_entry) watch_entries;
+  TAILQ_ENTRY(cache_entry) lru_entries;
+};
+
+TAILQ_HEAD(cache_entry_list, cache_entry);
+
+// Called when libspotify reports that a cached playlist has changed
+typedef void (*cache_changed_fn)(sp_playlist *playlist, void *userdata);
+
+// Bounded LRU cache of rendered playlist bodies. Entries are dropped as soon
+// as libspotify reports that their playlist has changed.
+struct cache {
+  apr_hash_t *watches;  // sp_playlist * -> struct cache_watch *
+  struct cache_entry_list lru;
+  int num_entries;
+  int max_entries;
+  unsigned long hits;
+  unsigned long misses;
+  cache_changed_fn changed;  // Optional
+  void *changed_userdata;
+};
+
+struct cache *cache_new(apr_pool_t *pool, int max_entries);
+
+void cache_free(struct cache *cache);
+
+// Returns the unexpired cached body of a playlist variant, or NULL
+struct cache_entry *cache_get(struct cache *cache,
+                              sp_playlist *playlist,
+                              const char *key);
+
+// Stores a copy of a rendered body. Returns NULL if out of memory.
+struct cache_entry *cache_put(struct cache *cache,
+                              sp_playlist *playlist,
+                              const char *key,
+                              const char *body,
+                              size_t body_len);
+
+// Drops an entry after `ttl` seconds even if its playlist hasn't changed,
+// e.g. because it shows track metadata, which changes on its own
+void cache_entry_set_ttl(struct cache_entry *entry, int ttl);
+
+// Stores a copy of the body in a compressed encoding
+bool cache_entry_set_encoded(struct cache_entry *entry,
+                             enum content_encoding encoding,
+                             const char *body,
+                             size_t body_len);
+
+// Changes how many bodies are kept, dropping the least recently used ones
+// that no longer fit
+void cache_resize(struct cache *cache, int max_entries);
+
+// Drops every variant of a playlist
+void cache_invalidate(struct cache *cache, sp_playlist *playlist);
+
+#endif
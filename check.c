@@ -0,0 +1,461 @@
+// Checks of the modules that can be tested on their own. The little of
+// libspotify they use is faked below, so the checks need only libevent and
+// jansson. Prints the checks that fail and exits with their number.
+//
+//   make check
+
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "hash_ring.h"
+#include "msgpack.h"
+#include "track_batch.h"
+#include "track_id.h"
+#include "track_id_impl.h"
+
+#ifdef HAVE_APR
+#include <apr_general.h>
+#include <apr_pools.h>
+
+#include "idempotency.h"
+#endif
+
+static int num_checks = 0;
+static int num_failed = 0;
+
+#define CHECK(condition)                                                 \
+  do {                                                                   \
+    num_checks++;                                                        \
+    if (!(condition)) {                                                  \
+      num_failed++;                                                      \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition);    \
+    }                                                                    \
+  } while (0)
+
+// xorshift64*, so that runs are repeatable
+static uint64_t random_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t random_next(void) {
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return random_state * 0x2545f4914f6cdd1dull;
+}
+
+static void random_track_uri(char *uri) {
+  unsigned char id[TRACK_ID_SIZE];
+
+  for (int i = 0; i < TRACK_ID_SIZE; i++)
+    id[i] = random_next();
+
+  track_id_to_uri(id, uri);
+}
+
+// Just enough of libspotify for track batches. Every track URI resolves to
+// the same track, except kUnknownTrackUri, which has none behind it.
+struct sp_link {
+  int refs;
+  bool unknown;
+};
+
+struct sp_track {
+  int refs;
+};
+
+static const char kUnknownTrackUri[] = "spotify:track:0000000000000000000000";
+static struct sp_link fake_link;
+static struct sp_track fake_track;
+
+sp_link *sp_link_create_from_string(const char *link) {
+  if (strncmp(link, TRACK_URI_PREFIX, TRACK_URI_PREFIX_LENGTH) != 0)
+    return NULL;
+
+  fake_link.refs++;
+  fake_link.unknown = strcmp(link, kUnknownTrackUri) == 0;
+  return &fake_link;
+}
+
+sp_linktype sp_link_type(sp_link *link) {
+  return SP_LINKTYPE_TRACK;
+}
+
+sp_track *sp_link_as_track(sp_link *link) {
+  return link->unknown ? NULL : &fake_track;
+}
+
+sp_error sp_link_release(sp_link *link) {
+  link->refs--;
+  return SP_ERROR_OK;
+}
+
+sp_error sp_track_add_ref(sp_track *track) {
+  track->refs++;
+  return SP_ERROR_OK;
+}
+
+sp_error sp_track_release(sp_track *track) {
+  track->refs--;
+  return SP_ERROR_OK;
+}
+
+static json_t *msgpack_round_trip(json_t *json, int flags) {
+  struct evbuffer *buf = evbuffer_new();
+  json_t *result = NULL;
+  const char *error = NULL;
+
+  if (msgpack_pack_json(json, buf, flags) == 0) {
+    size_t len = evbuffer_get_length(buf);
+    result = msgpack_unpack_json(evbuffer_pullup(buf, len), len, &error);
+  }
+
+  evbuffer_free(buf);
+  return result;
+}
+
+static void check_msgpack(void) {
+  char long_string[70000];
+  memset(long_string, 'x', sizeof(long_string) - 1);
+  long_string[sizeof(long_string) - 1] = '\0';
+
+  json_t *json = json_pack(
+      "{s:s, s:b, s:b, s:n, s:i, s:I, s:I, s:I, s:f, s:[iii], s:{s:s}, s:s,"
+      " s:s, s:[]}",
+      "title", "Playlist", "collaborative", 1, "public", 0, "description",
+      "small", 5, "negative", (json_int_t) -40000, "large",
+      (json_int_t) 1 << 40, "min", (json_int_t) INT64_MIN, "real", 0.25,
+      "array", 1, 2, 3, "object", "key", "value", "medium",
+      "a string longer than thirty-one bytes", "long", long_string, "empty");
+  CHECK(json != NULL);
+
+  json_t *result = msgpack_round_trip(json, 0);
+  CHECK(result != NULL && json_equal(json, result));
+  json_decref(result);
+  json_decref(json);
+
+  // Track URIs packed as IDs come back as the same URIs
+  char uri[TRACK_URI_LENGTH + 1];
+  json_t *tracks = json_array();
+
+  for (int i = 0; i < 100; i++) {
+    random_track_uri(uri);
+    json_array_append_new(tracks, json_string(uri));
+  }
+
+  json = json_pack("{s:o}", "tracks", tracks);
+  result = msgpack_round_trip(json, MSGPACK_COMPACT_TRACKS);
+  CHECK(result != NULL && json_equal(json, result));
+  json_decref(result);
+  json_decref(json);
+
+  const char *error = NULL;
+  const unsigned char truncated[] = {0x92, 0x01};
+  CHECK(msgpack_unpack_json(truncated, sizeof(truncated), &error) == NULL);
+  CHECK(error != NULL);
+}
+
+static void check_arena(void) {
+  struct arena_stats before, after;
+  arena_get_stats(&before);
+  struct arena *arena = arena_new();
+  CHECK(arena != NULL);
+
+  if (arena == NULL)
+    return;
+
+  for (size_t size = 1; size < 3000; size += 7) {
+    unsigned char *p = arena_alloc(arena, size);
+    CHECK(p != NULL && (uintptr_t) p % 16 == 0);
+
+    if (p != NULL)
+      memset(p, 0xab, size);
+  }
+
+  unsigned char *large = arena_alloc(arena, 100000);
+  CHECK(large != NULL);
+
+  if (large != NULL)
+    memset(large, 0xab, 100000);
+
+  int *zeroed = arena_calloc(arena, 1000, sizeof(int));
+  bool all_zero = zeroed != NULL;
+
+  for (int i = 0; zeroed != NULL && i < 1000; i++)
+    all_zero = all_zero && zeroed[i] == 0;
+
+  CHECK(all_zero);
+  CHECK(arena_calloc(arena, SIZE_MAX / 2, 4) == NULL);
+  arena_free(arena);
+
+  // The next arena reuses the blocks of the last one
+  arena = arena_new();
+  CHECK(arena != NULL && arena_alloc(arena, 100) != NULL);
+  arena_free(arena);
+  arena_get_stats(&after);
+  CHECK(after.arenas == before.arenas + 2);
+  CHECK(after.block_reuses > before.block_reuses);
+  CHECK(after.large_mallocs > before.large_mallocs);
+}
+
+// Every implementation the CPU has must agree with the scalar one
+static void check_track_uri_impls(const char *uri) {
+  bool expected = track_uri_is_valid_scalar(uri);
+  CHECK(track_uri_is_valid(uri, TRACK_URI_LENGTH) == expected);
+
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2"))
+    CHECK(track_uri_is_valid_sse2(uri) == expected);
+
+  if (__builtin_cpu_supports("avx2"))
+    CHECK(track_uri_is_valid_avx2(uri) == expected);
+#endif
+}
+
+static void check_track_id(void) {
+  char uri[TRACK_URI_LENGTH + 1];
+  char copy[TRACK_URI_LENGTH + 1];
+  unsigned char id[TRACK_ID_SIZE];
+  unsigned char decoded[TRACK_ID_SIZE];
+
+  CHECK(track_id_from_uri("spotify:track:58PipbkYEkKFzOowRPHF3m", id));
+  track_id_to_uri(id, uri);
+  CHECK(strcmp(uri, "spotify:track:58PipbkYEkKFzOowRPHF3m") == 0);
+
+  // The largest ID fits in 22 digits, but not every 22 digits fit in an ID
+  memset(id, 0xff, TRACK_ID_SIZE);
+  track_id_to_uri(id, uri);
+  CHECK(track_id_from_uri(uri, decoded));
+  CHECK(memcmp(id, decoded, TRACK_ID_SIZE) == 0);
+  CHECK(!track_id_from_base62("ZZZZZZZZZZZZZZZZZZZZZZ", decoded));
+
+  CHECK(!track_uri_is_valid("spotify:track:", 14));
+  CHECK(!track_id_from_uri("spotify:album:58PipbkYEkKFzOowRPHF3m", id));
+  CHECK(!track_id_from_uri("spotify:track:58PipbkYEkKFzOowRPHF3", id));
+
+  for (int i = 0; i < 1000; i++) {
+    random_track_uri(uri);
+    CHECK(track_id_from_uri(uri, id));
+    track_id_to_uri(id, copy);
+    CHECK(strcmp(uri, copy) == 0);
+  }
+
+  // Every byte value in every position, prefix included
+  random_track_uri(uri);
+
+  for (size_t i = 0; i < TRACK_URI_LENGTH; i++) {
+    for (int c = 1; c < 256; c++) {
+      memcpy(copy, uri, sizeof(copy));
+      copy[i] = c;
+      check_track_uri_impls(copy);
+    }
+  }
+
+  for (int i = 0; i < 100000; i++) {
+    for (size_t j = 0; j < TRACK_URI_LENGTH; j++)
+      copy[j] = random_next() % 255 + 1;
+
+    copy[TRACK_URI_LENGTH] = '\0';
+    check_track_uri_impls(copy);
+  }
+
+  const char *uris[] = {
+    "spotify:track:58PipbkYEkKFzOowRPHF3m",
+    NULL,
+    "spotify:track:nope",
+    "spotify:track:6JEK0CvvjDjjMUBFoXShNZ"
+  };
+  unsigned char ids[4 * TRACK_ID_SIZE];
+  bool valid[4];
+  CHECK(track_ids_from_uris(uris, 4, ids, valid) == 2);
+  CHECK(valid[0] && !valid[1] && !valid[2] && valid[3]);
+}
+
+static void check_track_batch(void) {
+  struct arena *arena = arena_new();
+  CHECK(arena != NULL);
+
+  if (arena == NULL)
+    return;
+
+  struct track_batch batch;
+  json_t *json = json_pack("[s, i, s, s, s, s]",
+                           "spotify:track:58PipbkYEkKFzOowRPHF3m", 1,
+                           "spotify:album:58PipbkYEkKFzOowRPHF3m",
+                           "spotify:track:6JEK0CvvjDjjMUBFoXShNZ",
+                           "spotify:track:58PipbkYEkKFzOowRPHF3",
+                           kUnknownTrackUri);
+  CHECK(track_batch_from_json(&batch, json, arena));
+  CHECK(batch.num_tracks == 2 && batch.num_rejected == 4);
+  CHECK(batch.rejected[0] == 1 && batch.rejected[1] == 2 &&
+        batch.rejected[2] == 4 && batch.rejected[3] == 5);
+  CHECK(fake_track.refs == 2 && fake_link.refs == 0);
+
+  // IDs are packed next to the tracks they belong to
+  unsigned char id[TRACK_ID_SIZE];
+  CHECK(track_id_from_uri("spotify:track:6JEK0CvvjDjjMUBFoXShNZ", id));
+  CHECK(memcmp(batch.track_ids + TRACK_ID_SIZE, id, TRACK_ID_SIZE) == 0);
+  track_batch_release(&batch);
+  CHECK(fake_track.refs == 0 && batch.num_tracks == 0);
+  json_decref(json);
+
+  json = json_object();
+  CHECK(!track_batch_from_json(&batch, json, arena));
+  json_decref(json);
+  json = json_array();
+  CHECK(track_batch_from_json(&batch, json, arena));
+  CHECK(batch.num_tracks == 0 && batch.num_rejected == 0);
+  json_decref(json);
+
+  // Comments and blank lines are skipped and don't count as positions.
+  // Trailing whitespace isn't part of the URI, and the last line needs no
+  // newline.
+  struct evbuffer *buf = evbuffer_new();
+  evbuffer_add_printf(buf,
+                      "# Tracks\r\n"
+                      "spotify:track:58PipbkYEkKFzOowRPHF3m\r\n"
+                      "\n"
+                      "spotify:track:nope\n"
+                      "spotify:track:6JEK0CvvjDjjMUBFoXShNZ \t\n"
+                      "spotify:track:58PipbkYEkKFzOowRPHF3m");
+  CHECK(track_batch_from_evbuffer(&batch, buf, arena));
+  CHECK(batch.num_tracks == 3 && batch.num_rejected == 1);
+  CHECK(batch.rejected[0] == 1);
+  CHECK(memcmp(batch.track_ids + TRACK_ID_SIZE, id, TRACK_ID_SIZE) == 0);
+  CHECK(evbuffer_get_length(buf) == 0);
+  track_batch_release(&batch);
+  CHECK(fake_track.refs == 0);
+
+  CHECK(track_batch_from_evbuffer(&batch, buf, arena));
+  CHECK(batch.num_tracks == 0 && batch.num_rejected == 0);
+  evbuffer_free(buf);
+  arena_free(arena);
+}
+
+static void check_hash_ring(void) {
+  const char *names[] = {"a", "b", "c", "d"};
+  bool included[] = {true, true, true, true};
+  struct hash_ring ring;
+  hash_ring_init(&ring);
+  CHECK(hash_ring_lookup(&ring, "key", 3) == -1);
+  CHECK(hash_ring_build(&ring, names, included, 4, 100));
+  CHECK(ring.num_points == 400);
+
+  int nodes[1000];
+  int counts[4] = {0};
+
+  for (int i = 0; i < 1000; i++) {
+    char key[32];
+    int len = snprintf(key, sizeof(key), "spotify:user:%d", i);
+    nodes[i] = hash_ring_lookup(&ring, key, len);
+    CHECK(nodes[i] >= 0 && nodes[i] < 4);
+
+    if (nodes[i] >= 0 && nodes[i] < 4)
+      counts[nodes[i]]++;
+
+    CHECK(hash_ring_lookup(&ring, key, len) == nodes[i]);
+  }
+
+  for (int i = 0; i < 4; i++)
+    CHECK(counts[i] > 100);
+
+  // Only the keys of the node taken out move
+  included[2] = false;
+  CHECK(hash_ring_build(&ring, names, included, 4, 100));
+
+  for (int i = 0; i < 1000; i++) {
+    char key[32];
+    int len = snprintf(key, sizeof(key), "spotify:user:%d", i);
+    int node = hash_ring_lookup(&ring, key, len);
+    CHECK(node != 2);
+
+    if (nodes[i] != 2)
+      CHECK(node == nodes[i]);
+  }
+
+  hash_ring_free(&ring);
+}
+
+#ifdef HAVE_APR
+static void count_reply(const struct idempotency_reply *reply,
+                        void *userdata) {
+  int *replies = userdata;
+  (*replies) += reply != NULL ? 1 : 100;
+}
+
+static void check_idempotency(void) {
+  apr_pool_t *pool;
+  apr_pool_create(&pool, NULL);
+  struct idempotency_table *table = idempotency_table_new(pool, 2);
+  CHECK(table != NULL);
+
+  struct idempotency_entry *a = idempotency_begin(table, "a");
+  CHECK(a != NULL && idempotency_get(table, "a") == a);
+  CHECK(idempotency_get(table, "b") == NULL);
+
+  // A retry waits for the original and gets its reply
+  int replies = 0;
+  struct idempotency_waiter waiter;
+  idempotency_wait(a, &waiter, &count_reply, &replies);
+  idempotency_complete(table, a, 200, "OK", "application/json", "{}", 2);
+  CHECK(replies == 1);
+  CHECK(a->complete && a->reply.code == 200 && a->reply.body_len == 2);
+
+  // Server errors are passed on but not kept
+  struct idempotency_entry *b = idempotency_begin(table, "b");
+  idempotency_wait(b, &waiter, &count_reply, &replies);
+  idempotency_complete(table, b, 500, "Oops", NULL, "", 0);
+  CHECK(replies == 2);
+  CHECK(idempotency_get(table, "b") == NULL);
+
+  // Abandoned requests call their waiters back with nothing
+  struct idempotency_entry *c = idempotency_begin(table, "c");
+  idempotency_wait(c, &waiter, &count_reply, &replies);
+  idempotency_abandon(table, c);
+  CHECK(replies == 102);
+
+  // Full: the least recently used completed entry makes room; entries in
+  // flight stay
+  struct idempotency_entry *d = idempotency_begin(table, "d");
+  struct idempotency_entry *e = idempotency_begin(table, "e");
+  CHECK(d != NULL && e != NULL);
+  CHECK(idempotency_get(table, "a") == NULL);
+  CHECK(table->num_entries == 2);
+  struct idempotency_entry *f = idempotency_begin(table, "f");
+  CHECK(f != NULL && table->num_entries == 3);
+
+  idempotency_complete(table, d, 201, "Created", NULL, "", 0);
+  idempotency_table_resize(table, 1);
+  CHECK(idempotency_get(table, "d") == NULL);
+  CHECK(idempotency_get(table, "e") == e && idempotency_get(table, "f") == f);
+
+  idempotency_table_free(table);
+  apr_pool_destroy(pool);
+}
+#endif
+
+int main(void) {
+  check_msgpack();
+  check_arena();
+  check_track_id();
+  check_track_batch();
+  check_hash_ring();
+
+#ifdef HAVE_APR
+  apr_initialize();
+  check_idempotency();
+  apr_terminate();
+#else
+  fprintf(stderr, "Skipping the idempotency table: built without APR\n");
+#endif
+
+  printf("%d of %d checks passed\n", num_checks - num_failed, num_checks);
+  return num_failed;
+}
@@ -0,0 +1,160 @@
+#include <event2/buffer.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+// Size of each chunk of output reserved in the evbuffer
+#define OUTPUT_CHUNK_SIZE 16384
+
+enum content_encoding content_encoding_negotiate(const char *accept_encoding) {
+  if (accept_encoding == NULL)
+    return CONTENT_ENCODING_IDENTITY;
+
+  bool gzip = false, deflate = false;
+  const char *coding = accept_encoding;
+
+  while (*coding != '\0') {
+    coding += strspn(coding, " \t,");
+    size_t len = strcspn(coding, " \t;,");
+    const char *params = coding + len;
+    size_t params_len = strcspn(params, ",");
+
+    // Codings with q=0 are not acceptable
+    bool acceptable = true;
+    const char *q = params;
+
+    while ((q = strchr(q, 'q')) != NULL && q < params + params_len) {
+      if (q[1] == '=') {
+        acceptable = strtod(q + 2, NULL) > 0;
+        break;
+      }
+
+      q++;
+    }
+
+    if (len == 4 && strncasecmp(coding, "gzip", len) == 0)
+      gzip = acceptable;
+    else if (len == 7 && strncasecmp(coding, "deflate", len) == 0)
+      deflate = acceptable;
+    else if (len == 1 && *coding == '*')
+      gzip = gzip || acceptable;
+
+    coding = params + params_len;
+  }
+
+  if (gzip)
+    return CONTENT_ENCODING_GZIP;
+
+  if (deflate)
+    return CONTENT_ENCODING_DEFLATE;
+
+  return CONTENT_ENCODING_IDENTITY;
+}
+
+const char *content_encoding_name(enum content_encoding encoding) {
+  switch (encoding) {
+    case CONTENT_ENCODING_GZIP:
+      return "gzip";
+
+    case CONTENT_ENCODING_DEFLATE:
+      return "deflate";
+
+    default:
+      return "identity";
+  }
+}
+
+static int compress_begin(z_stream *stream,
+                          enum content_encoding encoding,
+                          int level) {
+  memset(stream, 0, sizeof(z_stream));
+
+  // 16 added to the window bits asks zlib for a gzip wrapper; HTTP's
+  // "deflate" is the zlib format
+  int window_bits = encoding == CONTENT_ENCODING_GZIP ? 15 + 16 : 15;
+  return deflateInit2(stream, level, Z_DEFLATED, window_bits, 8,
+                      Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+}
+
+// Feeds one chunk of input, committing output to `out` chunk by chunk
+static int compress_chunk(z_stream *stream,
+                          const void *data,
+                          size_t len,
+                          int flush,
+                          struct evbuffer *out) {
+  stream->next_in = (Bytef *) data;
+  stream->avail_in = len;
+
+  for (;;) {
+    struct evbuffer_iovec vec;
+
+    if (evbuffer_reserve_space(out, OUTPUT_CHUNK_SIZE, &vec, 1) < 1)
+      return -1;
+
+    stream->next_out = vec.iov_base;
+    stream->avail_out = vec.iov_len;
+    int result = deflate(stream, flush);
+
+    if (result == Z_STREAM_ERROR)
+      return -1;
+
+    vec.iov_len -= stream->avail_out;
+    evbuffer_commit_space(out, &vec, 1);
+
+    if (flush == Z_FINISH ? result == Z_STREAM_END : stream->avail_in == 0 &&
+                                                     stream->avail_out != 0)
+      return 0;
+  }
+}
+
+int compress_bytes(const void *data,
+                   size_t len,
+                   enum content_encoding encoding,
+                   int level,
+                   struct evbuffer *out) {
+  z_stream stream;
+
+  if (compress_begin(&stream, encoding, level) != 0)
+    return -1;
+
+  int result = compress_chunk(&stream, data, len, Z_FINISH, out);
+  deflateEnd(&stream);
+  return result;
+}
+
+int compress_evbuffer(struct evbuffer *in,
+                      enum content_encoding encoding,
+                      int level,
+                      struct evbuffer *out) {
+  z_stream stream;
+
+  if (compress_begin(&stream, encoding, level) != 0)
+    return -1;
+
+  // Walk the input's chunks without making it contiguous
+  int num_vecs = evbuffer_peek(in, -1, NULL, NULL, 0);
+  struct evbuffer_iovec *vecs = calloc(num_vecs > 0 ? num_vecs : 1,
+                                       sizeof(struct evbuffer_iovec));
+  int result = -1;
+
+  if (vecs != NULL) {
+    evbuffer_peek(in, -1, NULL, vecs, num_vecs);
+    result = 0;
+
+    for (int i = 0; i < num_vecs && result == 0; i++)
+      result = compress_chunk(&stream, vecs[i].iov_base, vecs[i].iov_len,
+                              Z_NO_FLUSH, out);
+
+    if (result == 0)
+      result = compress_chunk(&stream, NULL, 0, Z_FINISH, out);
+
+    free(vecs);
+  }
+
+  deflateEnd(&stream);
+  return result;
+}
@@ -0,0 +1,35 @@
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <event2/buffer.h>
+#include <stddef.h>
+
+enum content_encoding {
+  CONTENT_ENCODING_IDENTITY,
+  CONTENT_ENCODING_GZIP,
+  CONTENT_ENCODING_DEFLATE,
+  NUM_CONTENT_ENCODINGS
+};
+
+// Picks the preferred encoding from an Accept-Encoding header (which may be
+// NULL). gzip wins over deflate when both are acceptable.
+enum content_encoding content_encoding_negotiate(const char *accept_encoding);
+
+// Name used in the Content-Encoding header
+const char *content_encoding_name(enum content_encoding encoding);
+
+// Compresses `len` bytes, appending to `out` as it goes. Returns 0 on
+// success, -1 on error (`out` may have been partially written).
+int compress_bytes(const void *data,
+                   size_t len,
+                   enum content_encoding encoding,
+                   int level,
+                   struct evbuffer *out);
+
+// Compresses the whole of `in` (which is left untouched) into `out`
+int compress_evbuffer(struct evbuffer *in,
+                      enum content_encoding encoding,
+                      int level,
+                      struct evbuffer *out);
+
+#endif
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE  // strdup
+
+#include <jansson.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "config.h"
+
+// Where a setting goes in struct config
+struct setting {
+  const char *name;
+  size_t offset;
+};
+
+static const struct setting kIntSettings[] = {
+  {"cacheEntries", offsetof(struct config, cache_entries)},
+  {"compressionLevel", offsetof(struct config, compression_level)},
+  {"idempotencyKeys", offsetof(struct config, idempotency_keys)},
+  {"chunkSize", offsetof(struct config, chunk_size)},
+  {"jobsPerPlaylist", offsetof(struct config, jobs_per_playlist)},
+  {"finishedJobs", offsetof(struct config, finished_jobs)},
+  {"spotifyCacheSize", offsetof(struct config, spotify_cache_size)},
+  {"drainTimeout", offsetof(struct config, drain_timeout)},
+  {"offlineQueueTimeout", offsetof(struct config, offline_queue_timeout)},
+  {"port", offsetof(struct config, port)},
+  {"workers", offsetof(struct config, workers)},
+};
+
+static const struct setting kStringSettings[] = {
+  {"host", offsetof(struct config, host)},
+  {"cacheLocation", offsetof(struct config, cache_location)},
+  {"settingsLocation", offsetof(struct config, settings_location)},
+  {"preload", offsetof(struct config, preload)},
+  {"hotPlaylists", offsetof(struct config, hot_playlists)},
+};
+
+static const struct setting kBoolSettings[] = {
+  {"compressPlaylists", offsetof(struct config, compress_playlists)},
+  {"initiallyUnloadPlaylists",
+   offsetof(struct config, initially_unload_playlists)},
+};
+
+static const struct {
+  const char *name;
+  int level;
+} kLogLevels[] = {
+  {"error", LOG_ERR},
+  {"warning", LOG_WARNING},
+  {"notice", LOG_NOTICE},
+  {"info", LOG_INFO},
+  {"debug", LOG_DEBUG},
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static void config_init(struct config *config) {
+  memset(config, 0, sizeof(struct config));
+
+  for (size_t i = 0; i < ARRAY_SIZE(kIntSettings); i++)
+    *(int *) ((char *) config + kIntSettings[i].offset) = -1;
+
+  for (size_t i = 0; i < ARRAY_SIZE(kBoolSettings); i++)
+    *(int *) ((char *) config + kBoolSettings[i].offset) = -1;
+
+  config->log_level = -1;
+}
+
+static bool read_log_level(const char *path,
+                           json_t *value,
+                           struct config *config) {
+  const char *name = json_string_value(value);
+
+  for (size_t i = 0; name != NULL && i < ARRAY_SIZE(kLogLevels); i++) {
+    if (strcmp(name, kLogLevels[i].name) == 0) {
+      config->log_level = kLogLevels[i].level;
+      return true;
+    }
+  }
+
+  syslog(LOG_WARNING, "%s: logLevel is not one of error, warning, notice, "
+         "info or debug", path);
+  return false;
+}
+
+bool config_read(const char *path, struct config *config) {
+  config_init(config);
+  json_error_t error;
+  json_t *json = json_load_file(path, 0, &error);
+
+  if (json == NULL) {
+    syslog(LOG_WARNING, "%s:%d: %s", path, error.line, error.text);
+    return false;
+  }
+
+  bool ok = json_is_object(json);
+
+  if (!ok)
+    syslog(LOG_WARNING, "%s: not a JSON object", path);
+
+  for (size_t i = 0; ok && i < ARRAY_SIZE(kIntSettings); i++) {
+    json_t *value = json_object_get(json, kIntSettings[i].name);
+
+    if (value == NULL)
+      continue;
+
+    if (!json_is_integer(value) || json_integer_value(value) < 0) {
+      syslog(LOG_WARNING, "%s: %s is not a number of at least 0", path,
+             kIntSettings[i].name);
+      ok = false;
+      break;
+    }
+
+    *(int *) ((char *) config + kIntSettings[i].offset) =
+        json_integer_value(value);
+  }
+
+  for (size_t i = 0; ok && i < ARRAY_SIZE(kStringSettings); i++) {
+    json_t *value = json_object_get(json, kStringSettings[i].name);
+
+    if (value == NULL)
+      continue;
+
+    if (!json_is_string(value)) {
+      syslog(LOG_WARNING, "%s: %s is not a string", path,
+             kStringSettings[i].name);
+      ok = false;
+      break;
+    }
+
+    *(char **) ((char *) config + kStringSettings[i].offset) =
+        strdup(json_string_value(value));
+  }
+
+  for (size_t i = 0; ok && i < ARRAY_SIZE(kBoolSettings); i++) {
+    json_t *value = json_object_get(json, kBoolSettings[i].name);
+
+    if (value == NULL)
+      continue;
+
+    if (!json_is_boolean(value)) {
+      syslog(LOG_WARNING, "%s: %s is not true or false", path,
+             kBoolSettings[i].name);
+      ok = false;
+      break;
+    }
+
+    *(int *) ((char *) config + kBoolSettings[i].offset) = json_is_true(value);
+  }
+
+  json_t *log_level = json_object_get(json, "logLevel");
+
+  if (ok && log_level != NULL)
+    ok = read_log_level(path, log_level, config);
+
+  json_decref(json);
+
+  if (!ok)
+    config_free(config);
+
+  return ok;
+}
+
+void config_free(struct config *config) {
+  for (size_t i = 0; i < ARRAY_SIZE(kStringSettings); i++) {
+    char **value = (char **) ((char *) config + kStringSettings[i].offset);
+    free(*value);
+    *value = NULL;
+  }
+}
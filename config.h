@@ -0,0 +1,42 @@
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <stdbool.h>
+
+// Settings read from a JSON configuration file (--config), e.g.
+//
+//   {"cacheEntries": 1024, "logLevel": "info", "spotifyCacheSize": 512}
+//
+// Numbers are -1 and strings NULL where the file doesn't give them.
+struct config {
+  // Applied again on SIGHUP
+  int cache_entries;
+  int compression_level;
+  int idempotency_keys;
+  int chunk_size;
+  int jobs_per_playlist;
+  int finished_jobs;
+  int spotify_cache_size;  // MB; 0 lets libspotify decide
+  int log_level;           // LOG_ERR ... LOG_DEBUG
+  int drain_timeout;
+  int offline_queue_timeout;
+
+  // Only read at startup
+  char *host;
+  int port;
+  int workers;
+  char *cache_location;
+  char *settings_location;
+  char *preload;
+  char *hot_playlists;
+  int compress_playlists;  // 0 or 1
+  int initially_unload_playlists;
+};
+
+// Reads a configuration file. Logs what's wrong with it and returns false
+// if it can't be read, isn't a JSON object or has a value of the wrong type.
+bool config_read(const char *path, struct config *config);
+
+void config_free(struct config *config);
+
+#endif
@@ -4,7 +4,96 @@
 // Length of track uri
 static const int kTrackLinkLength = sizeof("spotify:track:58PipbkYEkKFzOowRPHF3m");
 
+// Room for a playlist uri: spotify:user:<username>:playlist:<id>
+static const int kMaxPlaylistLinkLength = 256;
+
 // Maximum number of characters in a playlist title
 static const int kMaxPlaylistTitleLength = 256;
 
+// Default number of rendered playlist bodies to keep in the cache
+static const int kDefaultCacheEntries = 256;
+
+// Seconds a playlist body with expanded tracks is cached for at most
+static const int kExpandedCacheTtl = 60;
+
+// Number of rendered shallow container listings to keep in the cache
+static const int kListingCacheEntries = 64;
+
+// Tracks whose availability is cached, and seconds it's cached for
+static const int kAvailabilityEntries = 16384;
+static const int kAvailabilityTtl = 600;
+
+// Number of rendered tracks to keep in the cache
+static const int kTrackCacheEntries = 4096;
+
+// Seconds to wait for track metadata before responding with what's loaded
+static const int kMetadataTimeout = 5;
+
+// zlib compression level used for response bodies by default
+static const int kDefaultCompressionLevel = 6;
+
+// Bodies smaller than this are not worth compressing
+static const size_t kMinCompressedBodySize = 1024;
+
+// Default number of Idempotency-Keys to remember replies for
+static const int kDefaultIdempotencyKeys = 1024;
+
+// Longest Idempotency-Key header accepted
+static const size_t kMaxIdempotencyKeyLength = 255;
+
+// Background jobs that may run at once on the same playlist
+static const int kJobsPerPlaylist = 1;
+
+// Number of finished background jobs to remember results of
+static const int kFinishedJobs = 1024;
+
+// Default number of tracks added or removed at a time by large changes
+static const int kDefaultChunkSize = 500;
+
+// Seconds to wait for a chunk to sync before applying the next one anyway
+static const int kChunkSyncTimeout = 30;
+
+// Connections kept open to each shard when routing
+static const int kShardConnections = 8;
+
+// Points each shard gets on the consistent hash ring
+static const int kShardReplicas = 160;
+
+// Seconds between shard health checks, and to wait for one to answer
+static const int kShardHealthInterval = 5;
+static const int kShardHealthTimeout = 2;
+
+// Slots in the cache shared by --workers, and the largest body a slot holds
+static const int kSharedCacheSlots = 256;
+static const size_t kSharedCacheSlotSize = 512 * 1024;
+
+// Seconds a body in the shared cache is served for at most
+static const int kSharedCacheMaxAge = 60;
+
+// Requests held while logging in, and seconds they're held for at most
+static const int kStartupQueueLength = 1024;
+static const int kStartupQueueTimeout = 10;
+
+// Requests held while Spotify is unreachable, and seconds they're held for
+// at most
+static const int kOfflineQueueLength = 1024;
+static const int kOfflineQueueTimeout = 30;
+
+// Seconds between attempts to reconnect to Spotify, doubling up to the most
+static const int kReconnectMinDelay = 1;
+static const int kReconnectMaxDelay = 60;
+
+// Playlists preloaded at once after logging in, and seconds to wait for each
+static const int kPreloadConcurrency = 8;
+static const int kPreloadTimeout = 30;
+
+// Most requested playlists written on shutdown, out of how many counted
+static const int kHotPlaylists = 100;
+static const int kHotPlaylistsTracked = 4096;
+
+// Seconds to wait for requests in flight when stopping, and milliseconds
+// between checks
+static const int kDrainTimeout = 30;
+static const int kDrainCheckInterval = 100;
+
 #endif
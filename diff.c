@@ -1,46 +1,102 @@
+#include <stdbool.h>
+#include <string.h>
+
 #include <libspotify/api.h>
 #include <apr.h>
+#include <apr_strings.h>
 #include <svn_diff.h>
 #include <svn_pools.h>
 
+#include "apply.h"
 #include "constants.h"
+#include "track_id.h"
+
 
+// Tracks are compared by their 128-bit ID. Tracks without one (local
+// tracks) fall back to comparing URIs.
+struct track_token_t {
+  sp_track *track;
+  apr_uint32_t hash;
+  bool has_id;
+  unsigned char id[TRACK_ID_SIZE];
+  const char *uri;
+};
 
 struct track_tokens_t {
-  sp_track **tracks;
+  struct track_token_t *tokens;
   int num_tracks;
   int index;
 };
 
+static apr_uint32_t hash_bytes(const unsigned char *bytes, size_t len) {
+  apr_uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ bytes[i]) * 16777619u;
+
+  return hash;
+}
+
+static void init_track_token(struct track_token_t *token,
+                             sp_track *track,
+                             const unsigned char *id,
+                             apr_pool_t *pool) {
+  sp_track_add_ref(track);
+  token->track = track;
+  token->uri = NULL;
+  token->has_id = true;
+
+  if (id != NULL) {
+    memcpy(token->id, id, TRACK_ID_SIZE);
+  } else {
+    sp_link *link = sp_link_create_from_track(track, 0);
+    char uri[kTrackLinkLength];
+    sp_link_as_string(link, uri, kTrackLinkLength);
+    sp_link_release(link);
+
+    if (!track_id_from_uri(uri, token->id)) {
+      token->has_id = false;
+      token->uri = apr_pstrdup(pool, uri);
+    }
+  }
+
+  // IDs are uniformly distributed, so any four bytes make a good hash
+  if (token->has_id)
+    memcpy(&token->hash, token->id, sizeof(token->hash));
+  else
+    token->hash = hash_bytes((const unsigned char *) token->uri,
+                             strlen(token->uri));
+}
+
 static void init_track_tokens(struct track_tokens_t *src,
-                              int num_tracks) {
-  src->tracks = calloc(num_tracks, sizeof(sp_track *));
+                              int num_tracks,
+                              apr_pool_t *pool) {
+  src->tokens = apr_pcalloc(pool, num_tracks * sizeof(struct track_token_t));
   src->num_tracks = num_tracks;
   src->index = 0;
 }
 
 static void fill_track_tokens_from_playlist(struct track_tokens_t *src,
-                                            sp_playlist *playlist) {
+                                            sp_playlist *playlist,
+                                            apr_pool_t *pool) {
   int num_tracks = sp_playlist_num_tracks(playlist);
-  init_track_tokens(src, num_tracks);
+  init_track_tokens(src, num_tracks, pool);
 
-  for (int i = 0; i < num_tracks; i++) {
-    sp_track *track = sp_playlist_track(playlist, i);
-    sp_track_add_ref(track);
-    src->tracks[i] = track;
-  }
+  for (int i = 0; i < num_tracks; i++)
+    init_track_token(&src->tokens[i], sp_playlist_track(playlist, i), NULL,
+                     pool);
 }
 
 static void fill_track_tokens_from_tracks(struct track_tokens_t *src,
                                           sp_track **tracks,
-                                          int num_tracks) {
-  init_track_tokens(src, num_tracks);
+                                          const unsigned char *track_ids,
+                                          int num_tracks,
+                                          apr_pool_t *pool) {
+  init_track_tokens(src, num_tracks, pool);
 
-  for (int i = 0; i < num_tracks; i++) {
-    sp_track *track = tracks[i]; 
-    sp_track_add_ref(track);
-    src->tracks[i] = track;
-  }
+  for (int i = 0; i < num_tracks; i++)
+    init_track_token(&src->tokens[i], tracks[i],
+                     track_ids ? track_ids + i * TRACK_ID_SIZE : NULL, pool);
 }
 
 static int datasource_to_index(svn_diff_datasource_e datasource) {
@@ -79,8 +135,11 @@ static svn_error_t* datasource_get_next_token(apr_uint32_t *hash,
   struct track_tokens_t *src = &srcs[datasource_to_index(datasource)];
   *token = NULL;
 
-  if (src->index < src->num_tracks)
-    *token = src->tracks[src->index++];
+  if (src->index < src->num_tracks) {
+    struct track_token_t *next = &src->tokens[src->index++];
+    *hash = next->hash;
+    *token = next;
+  }
 
   return SVN_NO_ERROR;
 }
@@ -89,15 +148,16 @@ static svn_error_t *token_compare(void *baton,
                                   void *ltoken,
                                   void *rtoken,
                                   int *result) {
-  sp_track *ltrack = (sp_track *) ltoken,
-           *rtrack = (sp_track *) rtoken;
-  sp_link *llink = sp_link_create_from_track(ltrack, 0), 
-          *rlink = sp_link_create_from_track(rtrack, 0);
-  char lbuf[kTrackLinkLength],
-       rbuf[kTrackLinkLength];
-  sp_link_as_string(llink, lbuf, kTrackLinkLength);
-  sp_link_as_string(rlink, rbuf, kTrackLinkLength);
-  *result = strcmp(lbuf, rbuf);
+  struct track_token_t *ltrack = ltoken,
+                       *rtrack = rtoken;
+
+  if (ltrack->has_id && rtrack->has_id)
+    *result = memcmp(ltrack->id, rtrack->id, TRACK_ID_SIZE);
+  else if (ltrack->has_id != rtrack->has_id)
+    *result = ltrack->has_id ? -1 : 1;
+  else
+    *result = strcmp(ltrack->uri, rtrack->uri);
+
   return SVN_NO_ERROR;
 }
 
@@ -107,7 +167,7 @@ static void token_discard(void *baton, void *token) {
 
 static void discard_track_tokens(struct track_tokens_t *src) {
   for (int i = 0; i < src->num_tracks; i++)
-    sp_track_release(src->tracks[i]);
+    sp_track_release(src->tokens[i].track);
 }
 
 static void token_discard_all(void *baton) {
@@ -128,33 +188,29 @@ static const svn_diff_fns_t diff_playlist_search_vtable = {
 svn_error_t *diff_playlist_tracks(svn_diff_t **diff,
                                   sp_playlist *playlist,
                                   sp_track **tracks,
+                                  const unsigned char *track_ids,
                                   int num_tracks,
                                   apr_pool_t *pool) {
   sp_playlist_add_ref(playlist);
   struct track_tokens_t sources[2];
-  fill_track_tokens_from_playlist(&sources[0], playlist);
-  fill_track_tokens_from_tracks(&sources[1], tracks, num_tracks);
-
-  // Run through SVN diff
-  apr_pool_t *local_pool = svn_pool_create(pool);
-  svn_error_t *result = svn_diff_diff(diff, &sources, 
-                                      &diff_playlist_search_vtable, local_pool);
-  svn_pool_destroy(local_pool);
+  fill_track_tokens_from_playlist(&sources[0], playlist, pool);
+  fill_track_tokens_from_tracks(&sources[1], tracks, track_ids, num_tracks,
+                                pool);
+
+  // Run through SVN diff. The diff is allocated in `pool`, which the caller
+  // keeps alive until the diff has been applied.
+  svn_error_t *result = svn_diff_diff(diff, &sources,
+                                      &diff_playlist_search_vtable, pool);
   sp_playlist_release(playlist);
   return result;
 }
 
 struct output_baton_t {
-  sp_session *session;
-  sp_playlist *playlist;
+  struct playlist_ops *ops;
   sp_track **tracks;
   int num_tracks;
 };
 
-static svn_error_t *wrap_spotify_error(sp_error error) {
-  return svn_error_quick_wrap(NULL, sp_error_message(error));
-}
-
 svn_error_t *output_diff_modified(void *output_baton,
                                   apr_off_t original_start,
                                   apr_off_t original_length,
@@ -164,35 +220,18 @@ svn_error_t *output_diff_modified(void *output_baton,
                                   apr_off_t latest_length) {
   struct output_baton_t *baton = (struct output_baton_t *) output_baton;
 
-  if (original_length > 0) {
-    int tracks[original_length];
-
-    for (int i = 0; i < original_length; i++)
-      tracks[i] = modified_start + i;
-
-    sp_error remove_tracks_error = sp_playlist_remove_tracks(baton->playlist,
-                                                             tracks,
-                                                             original_length);
-
-    if (remove_tracks_error != SP_ERROR_OK)
-      return wrap_spotify_error(remove_tracks_error);
-  }
-
-  if (modified_length > 0) {
-    sp_track *tracks[modified_length];
+  // Earlier hunks have been applied by the time a hunk runs, so its tracks
+  // sit at their position in the modified sequence
+  if (original_length > 0 &&
+      !playlist_ops_append(baton->ops, PLAYLIST_OP_REMOVE, modified_start,
+                           original_length, NULL))
+    return svn_error_create(APR_ENOMEM, NULL, "Out of memory");
 
-    for (int i = 0; i < modified_length; i++)
-      tracks[i] = baton->tracks[modified_start + i];
-
-    sp_error add_tracks_error = sp_playlist_add_tracks(baton->playlist,
-                                                       (sp_track *const *) tracks,
-                                                       modified_length,
-                                                       modified_start,
-                                                       baton->session);
-
-    if (add_tracks_error != SP_ERROR_OK)
-      return wrap_spotify_error(add_tracks_error);
-  }
+  if (modified_length > 0 &&
+      !playlist_ops_append(baton->ops, PLAYLIST_OP_ADD, modified_start,
+                           modified_length,
+                           baton->tracks + modified_start))
+    return svn_error_create(APR_ENOMEM, NULL, "Out of memory");
 
   return SVN_NO_ERROR;
 }
@@ -201,24 +240,17 @@ static const svn_diff_output_fns_t output_fns_vtable = {
   .output_diff_modified = &output_diff_modified
 };
 
-svn_error_t *diff_playlist_tracks_apply(svn_diff_t *diff,
-                                        sp_playlist *playlist,
-                                        sp_track **tracks,
-                                        int num_tracks,
-                                        sp_session *session) {
-  sp_playlist_add_ref(playlist);
-
-  struct output_baton_t *baton = malloc(sizeof (struct output_baton_t));
-  baton->playlist = playlist;
-  baton->tracks = tracks;
-  baton->num_tracks = num_tracks;
-  baton->session = session;
-
-  svn_error_t *result = svn_diff_output(diff, baton, &output_fns_vtable);
-  
-  free(baton);
-  sp_playlist_release(playlist);
-  return result;
+svn_error_t *diff_playlist_tracks_ops(svn_diff_t *diff,
+                                      sp_track **tracks,
+                                      int num_tracks,
+                                      struct playlist_ops *ops) {
+  struct output_baton_t baton = {
+    .ops = ops,
+    .tracks = tracks,
+    .num_tracks = num_tracks
+  };
+
+  return svn_diff_output(diff, &baton, &output_fns_vtable);
 }
 
 
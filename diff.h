@@ -1,17 +1,23 @@
 #ifndef DIFF_H_
 #define DIFF_H_
 
+#include "apply.h"
+
+// `track_ids` holds the TRACK_ID_SIZE byte ID of each track, or is NULL if
+// the IDs should be looked up from the tracks
 svn_error_t *diff_playlist_tracks(svn_diff_t **,
                                   sp_playlist *,
                                   sp_track **tracks,
+                                  const unsigned char *track_ids,
                                   int num_tracks,
                                   apr_pool_t *);
 
-svn_error_t *diff_playlist_tracks_apply(svn_diff_t *,
-                                        sp_playlist *,
-                                        sp_track **tracks,
-                                        int num_tracks,
-                                        sp_session *);
+// Turns a diff into the removes and adds that make the playlist's tracks
+// equal `tracks`. Added tracks point into `tracks`.
+svn_error_t *diff_playlist_tracks_ops(svn_diff_t *,
+                                      sp_track **tracks,
+                                      int num_tracks,
+                                      struct playlist_ops *ops);
 
 svn_error_t *diff_output_stdout(svn_stream_t *stream_output,
                                 svn_diff_t *diff,
@@ -0,0 +1,230 @@
+#define _GNU_SOURCE  // accept4, MSG_CMSG_CLOEXEC
+
+#include <errno.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "handoff.h"
+
+// Sent along with the socket, and back once the successor is ready
+static const char kHandoffSocket = 'S';
+static const char kHandoffReady = 'R';
+
+// Seconds to wait for the old server to hand over its socket
+static const int kHandoffTimeout = 5;
+
+struct handoff {
+  int fd;
+  int listen_fd;
+  int successor;  // Connection to a successor that isn't ready yet, or -1
+  struct event *accept;
+  struct event *successor_event;
+  handoff_ready_fn ready;
+  void *userdata;
+};
+
+static bool unix_address(const char *path, struct sockaddr_un *address) {
+  if (strlen(path) >= sizeof(address->sun_path))
+    return false;
+
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  strcpy(address->sun_path, path);
+  return true;
+}
+
+int handoff_receive(const char *path, int *control) {
+  struct sockaddr_un address;
+
+  if (!unix_address(path, &address))
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd == -1)
+    return -1;
+
+  struct timeval timeout = {kHandoffTimeout, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  char tag;
+  struct iovec iov = {&tag, 1};
+  char control_buffer[CMSG_SPACE(sizeof(int))];
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control_buffer;
+  message.msg_controllen = sizeof(control_buffer);
+
+  if (recvmsg(fd, &message, MSG_CMSG_CLOEXEC) != 1 || tag != kHandoffSocket) {
+    close(fd);
+    return -1;
+  }
+
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+
+  if (header == NULL || header->cmsg_level != SOL_SOCKET ||
+      header->cmsg_type != SCM_RIGHTS) {
+    close(fd);
+    return -1;
+  }
+
+  int listen_fd;
+  memcpy(&listen_fd, CMSG_DATA(header), sizeof(int));
+  *control = fd;
+  return listen_fd;
+}
+
+void handoff_send_ready(int control) {
+  if (write(control, &kHandoffReady, 1) != 1)
+    syslog(LOG_WARNING, "Could not tell the old server we're ready: %m");
+
+  close(control);
+}
+
+static void successor_close(struct handoff *handoff) {
+  if (handoff->successor_event != NULL)
+    event_free(handoff->successor_event);
+
+  if (handoff->successor != -1)
+    close(handoff->successor);
+
+  handoff->successor_event = NULL;
+  handoff->successor = -1;
+}
+
+static void successor_readable(evutil_socket_t fd, short what, void *userdata) {
+  (void) what;  // Only ever EV_READ
+  struct handoff *handoff = userdata;
+  char tag;
+  ssize_t n = read(fd, &tag, 1);
+
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+
+  successor_close(handoff);
+
+  // The successor went away before it was ready: keep serving
+  if (n != 1 || tag != kHandoffReady) {
+    syslog(LOG_WARNING, "Successor gave up before it was ready");
+    return;
+  }
+
+  handoff->ready(handoff->userdata);
+}
+
+static void successor_connected(evutil_socket_t fd, short what, void *userdata) {
+  (void) what;  // Only ever EV_READ
+  struct handoff *handoff = userdata;
+  int successor = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+
+  if (successor == -1)
+    return;
+
+  // One successor at a time
+  if (handoff->successor != -1) {
+    close(successor);
+    return;
+  }
+
+  char control_buffer[CMSG_SPACE(sizeof(int))];
+  memset(control_buffer, 0, sizeof(control_buffer));
+  struct iovec iov = {(void *) &kHandoffSocket, 1};
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control_buffer;
+  message.msg_controllen = sizeof(control_buffer);
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(header), &handoff->listen_fd, sizeof(int));
+
+  if (sendmsg(successor, &message, MSG_NOSIGNAL) != 1) {
+    close(successor);
+    return;
+  }
+
+  syslog(LOG_INFO, "Handed the listening socket to a successor");
+  evutil_make_socket_nonblocking(successor);
+  handoff->successor = successor;
+  handoff->successor_event = event_new(event_get_base(handoff->accept),
+                                       successor, EV_READ | EV_PERSIST,
+                                       &successor_readable, handoff);
+
+  if (handoff->successor_event == NULL)
+    successor_close(handoff);
+  else
+    event_add(handoff->successor_event, NULL);
+}
+
+struct handoff *handoff_serve(struct event_base *event_base,
+                              const char *path,
+                              int listen_fd,
+                              handoff_ready_fn ready,
+                              void *userdata) {
+  struct sockaddr_un address;
+
+  if (!unix_address(path, &address))
+    return NULL;
+
+  struct handoff *handoff = calloc(1, sizeof(struct handoff));
+
+  if (handoff == NULL)
+    return NULL;
+
+  handoff->listen_fd = listen_fd;
+  handoff->successor = -1;
+  handoff->ready = ready;
+  handoff->userdata = userdata;
+  handoff->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+  // Whoever had the path before us has handed over already
+  unlink(path);
+
+  if (handoff->fd == -1 ||
+      bind(handoff->fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+      listen(handoff->fd, 1) != 0) {
+    if (handoff->fd != -1)
+      close(handoff->fd);
+
+    free(handoff);
+    return NULL;
+  }
+
+  handoff->accept = event_new(event_base, handoff->fd, EV_READ | EV_PERSIST,
+                              &successor_connected, handoff);
+
+  if (handoff->accept == NULL) {
+    close(handoff->fd);
+    free(handoff);
+    return NULL;
+  }
+
+  event_add(handoff->accept, NULL);
+  return handoff;
+}
+
+// Leaves the path alone: by now it may belong to the successor
+void handoff_free(struct handoff *handoff) {
+  successor_close(handoff);
+  event_free(handoff->accept);
+  close(handoff->fd);
+  free(handoff);
+}
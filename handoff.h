@@ -0,0 +1,34 @@
+#ifndef HANDOFF_H_
+#define HANDOFF_H_
+
+#include <event2/event.h>
+#include <stdbool.h>
+
+// Restarts without refusing connections: a running server listens on a Unix
+// socket for its successor and passes it the HTTP listening socket
+// (SCM_RIGHTS). The successor serves from the same socket once it's ready
+// and says so, and the old server then stops accepting and drains.
+struct handoff;
+
+// Called in the old server once its successor is ready
+typedef void (*handoff_ready_fn)(void *userdata);
+
+// Asks a server running at `path` for its listening socket. Returns the
+// socket, with the connection to tell the old server we're ready in
+// `*control`, or -1 if no server is running there.
+int handoff_receive(const char *path, int *control);
+
+// Tells the old server that we're serving, and closes the connection
+void handoff_send_ready(int control);
+
+// Hands `listen_fd` to any successor that connects to `path`. Returns NULL
+// if the socket can't be created.
+struct handoff *handoff_serve(struct event_base *event_base,
+                              const char *path,
+                              int listen_fd,
+                              handoff_ready_fn ready,
+                              void *userdata);
+
+void handoff_free(struct handoff *handoff);
+
+#endif
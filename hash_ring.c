@@ -0,0 +1,109 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash_ring.h"
+
+// FNV-1a, with MurmurHash3's finalizer so that names differing only in
+// their last characters spread over the whole ring
+static uint64_t hash_key(const char *key, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) key[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static int compare_points(const void *a, const void *b) {
+  const struct hash_ring_point *x = a, *y = b;
+  return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+void hash_ring_init(struct hash_ring *ring) {
+  ring->points = NULL;
+  ring->num_points = 0;
+}
+
+bool hash_ring_build(struct hash_ring *ring,
+                     const char *const *names,
+                     const bool *included,
+                     int num_nodes,
+                     int replicas) {
+  int num_included = 0;
+
+  for (int i = 0; i < num_nodes; i++)
+    num_included += included[i];
+
+  struct hash_ring_point *points = NULL;
+  int num_points = num_included * replicas;
+
+  if (num_points > 0) {
+    points = malloc(num_points * sizeof(struct hash_ring_point));
+
+    if (points == NULL)
+      return false;
+  }
+
+  int n = 0;
+
+  for (int i = 0; i < num_nodes; i++) {
+    if (!included[i])
+      continue;
+
+    for (int replica = 0; replica < replicas; replica++) {
+      char point_name[512];
+      int len = snprintf(point_name, sizeof(point_name), "%s#%d", names[i],
+                         replica);
+      // snprintf() returns what it would have written had there been room
+      size_t point_len = len < 0 ? 0
+          : len < (int) sizeof(point_name) ? (size_t) len
+          : sizeof(point_name) - 1;
+      points[n].hash = hash_key(point_name, point_len);
+      points[n].node = i;
+      n++;
+    }
+  }
+
+  if (num_points > 0)
+    qsort(points, num_points, sizeof(struct hash_ring_point), &compare_points);
+
+  free(ring->points);
+  ring->points = points;
+  ring->num_points = num_points;
+  return true;
+}
+
+int hash_ring_lookup(const struct hash_ring *ring, const char *key, size_t len) {
+  if (ring->num_points == 0)
+    return -1;
+
+  uint64_t hash = hash_key(key, len);
+  int low = 0, high = ring->num_points;
+
+  // First point at or after the hash, wrapping around to the first one
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+
+    if (ring->points[mid].hash < hash)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return ring->points[low == ring->num_points ? 0 : low].node;
+}
+
+void hash_ring_free(struct hash_ring *ring) {
+  free(ring->points);
+  hash_ring_init(ring);
+}
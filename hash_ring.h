@@ -0,0 +1,38 @@
+#ifndef HASH_RING_H_
+#define HASH_RING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A point on the ring owned by node `node`
+struct hash_ring_point {
+  uint64_t hash;
+  int node;
+};
+
+// Consistent hashing: every node is placed on a ring of 64 bit hashes many
+// times over, and a key belongs to the first node at or after its hash.
+// Taking a node out only moves the keys it had.
+struct hash_ring {
+  struct hash_ring_point *points;  // Sorted by hash
+  int num_points;
+};
+
+void hash_ring_init(struct hash_ring *ring);
+
+// Places the nodes for which `included[i]` is true `replicas` times each.
+// Node names must be unique and stay the same between builds for keys to
+// keep their nodes. Returns false if out of memory, keeping the old ring.
+bool hash_ring_build(struct hash_ring *ring,
+                     const char *const *names,
+                     const bool *included,
+                     int num_nodes,
+                     int replicas);
+
+// Returns the node a key belongs to, or -1 if the ring is empty
+int hash_ring_lookup(const struct hash_ring *ring, const char *key, size_t len);
+
+void hash_ring_free(struct hash_ring *ring);
+
+#endif
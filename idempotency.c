@@ -0,0 +1,170 @@
+#define _GNU_SOURCE  // strdup
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#include "idempotency.h"
+
+static void entry_free(struct idempotency_table *table,
+                       struct idempotency_entry *entry) {
+  apr_hash_set(table->entries, entry->key, APR_HASH_KEY_STRING, NULL);
+
+  if (entry->complete)
+    TAILQ_REMOVE(&table->lru, entry, lru_entries);
+
+  table->num_entries--;
+  free(entry->key);
+  free(entry->reply.message);
+  free(entry->reply.content_type);
+  free(entry->reply.body);
+  free(entry);
+}
+
+// Calls back and detaches every waiter of an entry
+static void entry_notify(struct idempotency_entry *entry,
+                         const struct idempotency_reply *reply) {
+  while (!TAILQ_EMPTY(&entry->waiters)) {
+    struct idempotency_waiter *waiter = TAILQ_FIRST(&entry->waiters);
+    TAILQ_REMOVE(&entry->waiters, waiter, entries);
+    waiter->entry = NULL;
+    waiter->callback(reply, waiter->userdata);
+  }
+}
+
+struct idempotency_table *idempotency_table_new(apr_pool_t *pool,
+                                                int max_entries) {
+  struct idempotency_table *table = malloc(sizeof(struct idempotency_table));
+
+  if (table == NULL)
+    return NULL;
+
+  table->entries = apr_hash_make(pool);
+  TAILQ_INIT(&table->lru);
+  table->num_entries = 0;
+  table->max_entries = max_entries;
+  table->replays = 0;
+  table->attached = 0;
+  return table;
+}
+
+void idempotency_table_free(struct idempotency_table *table) {
+  for (apr_hash_index_t *index = apr_hash_first(NULL, table->entries);
+       index != NULL;
+       index = apr_hash_next(index)) {
+    void *entry;
+    apr_hash_this(index, NULL, NULL, &entry);
+    entry_free(table, entry);
+  }
+
+  free(table);
+}
+
+struct idempotency_entry *idempotency_get(struct idempotency_table *table,
+                                          const char *key) {
+  struct idempotency_entry *entry = apr_hash_get(table->entries, key,
+                                                 APR_HASH_KEY_STRING);
+
+  if (entry != NULL && entry->complete) {
+    TAILQ_REMOVE(&table->lru, entry, lru_entries);
+    TAILQ_INSERT_TAIL(&table->lru, entry, lru_entries);
+  }
+
+  return entry;
+}
+
+void idempotency_table_resize(struct idempotency_table *table,
+                              int max_entries) {
+  table->max_entries = max_entries;
+
+  while (table->num_entries > (max_entries > 0 ? max_entries : 0) &&
+         !TAILQ_EMPTY(&table->lru))
+    entry_free(table, TAILQ_FIRST(&table->lru));
+}
+
+struct idempotency_entry *idempotency_begin(struct idempotency_table *table,
+                                            const char *key) {
+  if (table->max_entries <= 0)
+    return NULL;
+
+  while (table->num_entries >= table->max_entries &&
+         !TAILQ_EMPTY(&table->lru))
+    entry_free(table, TAILQ_FIRST(&table->lru));
+
+  struct idempotency_entry *entry = calloc(1, sizeof(struct idempotency_entry));
+
+  if (entry == NULL)
+    return NULL;
+
+  entry->key = strdup(key);
+
+  if (entry->key == NULL) {
+    free(entry);
+    return NULL;
+  }
+
+  TAILQ_INIT(&entry->waiters);
+  apr_hash_set(table->entries, entry->key, APR_HASH_KEY_STRING, entry);
+  table->num_entries++;
+  return entry;
+}
+
+void idempotency_wait(struct idempotency_entry *entry,
+                      struct idempotency_waiter *waiter,
+                      idempotency_reply_fn callback,
+                      void *userdata) {
+  waiter->entry = entry;
+  waiter->callback = callback;
+  waiter->userdata = userdata;
+  TAILQ_INSERT_TAIL(&entry->waiters, waiter, entries);
+}
+
+void idempotency_waiter_cancel(struct idempotency_waiter *waiter) {
+  if (waiter->entry == NULL)
+    return;
+
+  TAILQ_REMOVE(&waiter->entry->waiters, waiter, entries);
+  waiter->entry = NULL;
+}
+
+void idempotency_complete(struct idempotency_table *table,
+                          struct idempotency_entry *entry,
+                          int code,
+                          const char *message,
+                          const char *content_type,
+                          const char *body,
+                          size_t body_len) {
+  struct idempotency_reply *reply = &entry->reply;
+  reply->code = code;
+  reply->message = strdup(message != NULL ? message : "");
+  reply->content_type = content_type != NULL ? strdup(content_type) : NULL;
+  reply->body = malloc(body_len > 0 ? body_len : 1);
+  reply->body_len = body_len;
+
+  bool copied = reply->message != NULL &&
+                (content_type == NULL || reply->content_type != NULL) &&
+                reply->body != NULL;
+
+  if (copied)
+    memcpy(reply->body, body, body_len);
+
+  // Waiters get the reply even if it isn't kept
+  entry_notify(entry, copied ? reply : NULL);
+
+  if (!copied || code >= 500) {
+    entry_free(table, entry);
+    return;
+  }
+
+  entry->complete = true;
+  TAILQ_INSERT_TAIL(&table->lru, entry, lru_entries);
+}
+
+void idempotency_abandon(struct idempotency_table *table,
+                         struct idempotency_entry *entry) {
+  entry_notify(entry, NULL);
+  entry_free(table, entry);
+}
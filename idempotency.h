@@ -0,0 +1,98 @@
+#ifndef IDEMPOTENCY_H_
+#define IDEMPOTENCY_H_
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/queue.h>
+
+// Final response to a request, kept to answer its retries
+struct idempotency_reply {
+  int code;
+  char *message;
+  char *content_type;
+  char *body;
+  size_t body_len;
+};
+
+// Called with the reply of the original request, or NULL if it finished
+// without one that can be replayed
+typedef void (*idempotency_reply_fn)(const struct idempotency_reply *reply,
+                                     void *userdata);
+
+// A retry waiting for the original request to finish. Owned by the caller,
+// which must cancel it if it goes away first.
+struct idempotency_waiter {
+  struct idempotency_entry *entry;
+  idempotency_reply_fn callback;
+  void *userdata;
+  TAILQ_ENTRY(idempotency_waiter) entries;
+};
+
+TAILQ_HEAD(idempotency_waiter_list, idempotency_waiter);
+
+struct idempotency_entry {
+  char *key;
+  bool complete;
+  struct idempotency_reply reply;         // Set once complete
+  struct idempotency_waiter_list waiters;  // Retries while in flight
+  TAILQ_ENTRY(idempotency_entry) lru_entries;
+};
+
+TAILQ_HEAD(idempotency_entry_list, idempotency_entry);
+
+// Bounded table of idempotency keys. Entries for requests still in flight are
+// never evicted; completed ones are dropped least recently used first.
+struct idempotency_table {
+  apr_hash_t *entries;  // key -> struct idempotency_entry *
+  struct idempotency_entry_list lru;  // Completed entries
+  int num_entries;
+  int max_entries;
+  unsigned long replays;
+  unsigned long attached;
+};
+
+struct idempotency_table *idempotency_table_new(apr_pool_t *pool,
+                                                int max_entries);
+
+void idempotency_table_free(struct idempotency_table *table);
+
+// Changes how many keys are kept, dropping completed entries that no longer
+// fit
+void idempotency_table_resize(struct idempotency_table *table,
+                              int max_entries);
+
+// Returns the entry of a key, or NULL if the key hasn't been seen
+struct idempotency_entry *idempotency_get(struct idempotency_table *table,
+                                          const char *key);
+
+// Starts tracking a new request. Returns NULL if the table is disabled or out
+// of memory.
+struct idempotency_entry *idempotency_begin(struct idempotency_table *table,
+                                            const char *key);
+
+// Attaches a retry to an entry that is still in flight
+void idempotency_wait(struct idempotency_entry *entry,
+                      struct idempotency_waiter *waiter,
+                      idempotency_reply_fn callback,
+                      void *userdata);
+
+void idempotency_waiter_cancel(struct idempotency_waiter *waiter);
+
+// Records the reply of the original request and passes it to all waiters.
+// Server errors (5xx) aren't kept so that the request can be retried.
+void idempotency_complete(struct idempotency_table *table,
+                          struct idempotency_entry *entry,
+                          int code,
+                          const char *message,
+                          const char *content_type,
+                          const char *body,
+                          size_t body_len);
+
+// Forgets a request that finished without a reply. Waiters are called back
+// with NULL.
+void idempotency_abandon(struct idempotency_table *table,
+                         struct idempotency_entry *entry);
+
+#endif
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE  // strdup
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <event2/event.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "jobs.h"
+
+static void job_free(struct jobs *jobs, struct job *job) {
+  apr_hash_set(jobs->by_id, &job->id, sizeof(job->id), NULL);
+  free(job->message);
+  free(job->content_type);
+  free(job->body);
+  free(job);
+}
+
+static void queue_free(struct jobs *jobs, struct job_queue *queue) {
+  apr_hash_set(jobs->queues, queue->key, APR_HASH_KEY_STRING, NULL);
+
+  if (queue->ready)
+    TAILQ_REMOVE(&jobs->ready, queue, ready_entries);
+
+  free(queue->key);
+  free(queue);
+}
+
+// Makes the event loop look at a queue on its next iteration
+static void queue_schedule(struct jobs *jobs, struct job_queue *queue) {
+  if (!queue->ready) {
+    queue->ready = true;
+    TAILQ_INSERT_TAIL(&jobs->ready, queue, ready_entries);
+  }
+
+  struct timeval now = {0, 0};
+  evtimer_add(jobs->kick, &now);
+}
+
+// Starting jobs from the event loop rather than from jobs_submit() or
+// jobs_finish() keeps job work out of the caller's stack
+static void start_ready_jobs(evutil_socket_t socket,
+                             short what,
+                             void *userdata) {
+  struct jobs *jobs = userdata;
+
+  while (!TAILQ_EMPTY(&jobs->ready)) {
+    struct job_queue *queue = TAILQ_FIRST(&jobs->ready);
+    TAILQ_REMOVE(&jobs->ready, queue, ready_entries);
+    queue->ready = false;
+
+    while (!TAILQ_EMPTY(&queue->waiting) &&
+           queue->num_running < jobs->max_running_per_queue) {
+      struct job *job = TAILQ_FIRST(&queue->waiting);
+      TAILQ_REMOVE(&queue->waiting, job, entries);
+      job->state = JOB_RUNNING;
+      queue->num_running++;
+      jobs->num_queued--;
+      jobs->num_running++;
+      job->start(job, job->userdata);
+    }
+
+    if (queue->num_running == 0 && TAILQ_EMPTY(&queue->waiting))
+      queue_free(jobs, queue);
+  }
+}
+
+struct jobs *jobs_new(struct event_base *event_base,
+                      apr_pool_t *pool,
+                      int max_running_per_queue,
+                      int max_done) {
+  struct jobs *jobs = malloc(sizeof(struct jobs));
+
+  if (jobs == NULL)
+    return NULL;
+
+  jobs->kick = evtimer_new(event_base, &start_ready_jobs, jobs);
+  jobs->queues = apr_hash_make(pool);
+  jobs->by_id = apr_hash_make(pool);
+  TAILQ_INIT(&jobs->ready);
+  TAILQ_INIT(&jobs->done);
+  jobs->num_done = 0;
+  jobs->max_done = max_done;
+  jobs->max_running_per_queue = max_running_per_queue > 0
+      ? max_running_per_queue : 1;
+  jobs->num_queued = 0;
+  jobs->num_running = 0;
+
+  // Don't hand out the IDs of a previous run again
+  jobs->next_id = (unsigned int) time(NULL) * 1000u;
+  return jobs;
+}
+
+void jobs_free(struct jobs *jobs) {
+  for (apr_hash_index_t *index = apr_hash_first(NULL, jobs->by_id);
+       index != NULL;
+       index = apr_hash_next(index)) {
+    void *job;
+    apr_hash_this(index, NULL, NULL, &job);
+    job_free(jobs, job);
+  }
+
+  for (apr_hash_index_t *index = apr_hash_first(NULL, jobs->queues);
+       index != NULL;
+       index = apr_hash_next(index)) {
+    void *queue;
+    apr_hash_this(index, NULL, NULL, &queue);
+    queue_free(jobs, queue);
+  }
+
+  event_free(jobs->kick);
+  free(jobs);
+}
+
+struct job *jobs_submit(struct jobs *jobs,
+                        const char *key,
+                        job_start_fn start,
+                        void *userdata) {
+  struct job_queue *queue = apr_hash_get(jobs->queues, key,
+                                         APR_HASH_KEY_STRING);
+
+  if (queue == NULL) {
+    queue = calloc(1, sizeof(struct job_queue));
+
+    if (queue == NULL)
+      return NULL;
+
+    queue->key = strdup(key);
+
+    if (queue->key == NULL) {
+      free(queue);
+      return NULL;
+    }
+
+    TAILQ_INIT(&queue->waiting);
+    apr_hash_set(jobs->queues, queue->key, APR_HASH_KEY_STRING, queue);
+  }
+
+  struct job *job = calloc(1, sizeof(struct job));
+
+  if (job == NULL) {
+    if (queue->num_running == 0 && TAILQ_EMPTY(&queue->waiting))
+      queue_free(jobs, queue);
+
+    return NULL;
+  }
+
+  job->id = jobs->next_id++;
+  job->state = JOB_QUEUED;
+  job->queue = queue;
+  job->start = start;
+  job->userdata = userdata;
+  TAILQ_INSERT_TAIL(&queue->waiting, job, entries);
+  apr_hash_set(jobs->by_id, &job->id, sizeof(job->id), job);
+  jobs->num_queued++;
+  queue_schedule(jobs, queue);
+  return job;
+}
+
+struct job *jobs_get(struct jobs *jobs, unsigned int id) {
+  return apr_hash_get(jobs->by_id, &id, sizeof(id));
+}
+
+void jobs_finish(struct jobs *jobs,
+                 struct job *job,
+                 int code,
+                 const char *message,
+                 const char *content_type,
+                 const char *body,
+                 size_t body_len) {
+  job->state = JOB_DONE;
+  job->code = code;
+  job->message = strdup(message != NULL ? message : "");
+  job->content_type = content_type != NULL ? strdup(content_type) : NULL;
+  job->body = malloc(body_len > 0 ? body_len : 1);
+
+  if (job->body != NULL) {
+    memcpy(job->body, body, body_len);
+    job->body_len = body_len;
+  }
+
+  struct job_queue *queue = job->queue;
+  job->queue = NULL;
+  queue->num_running--;
+  jobs->num_running--;
+  queue_schedule(jobs, queue);
+
+  // Finished jobs are remembered until `max_done` newer ones have finished
+  TAILQ_INSERT_TAIL(&jobs->done, job, entries);
+  jobs->num_done++;
+
+  while (jobs->num_done > jobs->max_done) {
+    struct job *oldest = TAILQ_FIRST(&jobs->done);
+    TAILQ_REMOVE(&jobs->done, oldest, entries);
+    jobs->num_done--;
+    job_free(jobs, oldest);
+  }
+}
+
+const char *job_state_name(enum job_state state) {
+  switch (state) {
+    case JOB_QUEUED:
+      return "queued";
+
+    case JOB_RUNNING:
+      return "running";
+
+    case JOB_DONE:
+      return "done";
+  }
+
+  return NULL;
+}
@@ -0,0 +1,101 @@
+#ifndef JOBS_H_
+#define JOBS_H_
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <event2/event.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/queue.h>
+
+enum job_state {
+  JOB_QUEUED,
+  JOB_RUNNING,
+  JOB_DONE
+};
+
+struct job;
+
+// Starts the work of a job, which calls jobs_finish() when it's done
+typedef void (*job_start_fn)(struct job *job, void *userdata);
+
+// Jobs with the same key (e.g. the same playlist) run one after the other
+struct job_queue {
+  char *key;
+  int num_running;
+  TAILQ_HEAD(, job) waiting;
+  TAILQ_ENTRY(job_queue) ready_entries;
+  bool ready;
+};
+
+struct job {
+  unsigned int id;
+  enum job_state state;
+  struct job_queue *queue;  // NULL once done
+  job_start_fn start;
+  void *userdata;
+
+  // Progress in units of the job's choosing, e.g. tracks; `total` is 0 if
+  // unknown
+  long progress;
+  long total;
+
+  // Final reply, set once done
+  int code;
+  char *message;
+  char *content_type;
+  char *body;
+  size_t body_len;
+
+  TAILQ_ENTRY(job) entries;  // In the queue while waiting, in `done` after
+};
+
+TAILQ_HEAD(job_list, job);
+TAILQ_HEAD(job_queue_list, job_queue);
+
+// Write requests that were accepted to run in the background
+struct jobs {
+  struct event *kick;  // Starts ready jobs from the event loop
+  apr_hash_t *queues;  // key -> struct job_queue *
+  apr_hash_t *by_id;   // id -> struct job *
+  struct job_queue_list ready;
+  struct job_list done;  // Oldest first
+  int num_done;
+  int max_done;
+  int max_running_per_queue;
+  unsigned int next_id;
+  unsigned long num_queued;
+  unsigned long num_running;
+};
+
+struct jobs *jobs_new(struct event_base *event_base,
+                      apr_pool_t *pool,
+                      int max_running_per_queue,
+                      int max_done);
+
+void jobs_free(struct jobs *jobs);
+
+// Queues a job. It's started from the event loop once no more than
+// `max_running_per_queue` other jobs with the same key are running. Returns
+// NULL if out of memory.
+struct job *jobs_submit(struct jobs *jobs,
+                        const char *key,
+                        job_start_fn start,
+                        void *userdata);
+
+// Returns NULL if there's no such job or it has been forgotten
+struct job *jobs_get(struct jobs *jobs, unsigned int id);
+
+// Records the final reply of a running job and lets the next one in its
+// queue start
+void jobs_finish(struct jobs *jobs,
+                 struct job *job,
+                 int code,
+                 const char *message,
+                 const char *content_type,
+                 const char *body,
+                 size_t body_len);
+
+const char *job_state_name(enum job_state state);
+
+#endif
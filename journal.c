@@ -0,0 +1,342 @@
+#define _GNU_SOURCE  // fdatasync
+
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <jansson.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+// Journals with no open changes are truncated once they grow past this
+static const off_t kJournalCompactSize = 1 << 20;
+
+struct journal_waiter {
+  journal_committed_fn committed;
+  void *userdata;
+  TAILQ_ENTRY(journal_waiter) entries;
+};
+
+TAILQ_HEAD(journal_waiter_list, journal_waiter);
+
+struct journal {
+  int fd;
+  off_t size;
+  struct evbuffer *pending;  // Records not yet written
+  struct journal_waiter_list waiters;  // Begins in `pending`
+  struct event *flush;
+  json_t *incomplete;
+  unsigned long next_id;
+  struct journal_stats stats;
+};
+
+// Appends a record to the pending buffer and makes sure it gets flushed at
+// the end of this event loop iteration
+static bool journal_append(struct journal *journal, json_t *record) {
+  char *line = json_dumps(record, JSON_COMPACT);
+
+  if (line == NULL)
+    return false;
+
+  evbuffer_add_printf(journal->pending, "%s\n", line);
+  free(line);
+  journal->stats.records++;
+  struct timeval now = {0, 0};
+  evtimer_add(journal->flush, &now);
+  return true;
+}
+
+static bool journal_write(struct journal *journal) {
+  while (evbuffer_get_length(journal->pending) > 0) {
+    int written = evbuffer_write(journal->pending, journal->fd);
+
+    if (written < 0 && errno != EINTR)
+      return false;
+
+    if (written > 0)
+      journal->size += written;
+  }
+
+  return fdatasync(journal->fd) == 0;
+}
+
+// Group commit: one write and one fsync for everything recorded since the
+// last flush
+static void journal_flush(evutil_socket_t socket, short what, void *userdata) {
+  struct journal *journal = userdata;
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  bool ok = journal_write(journal);
+  gettimeofday(&end, NULL);
+  journal->stats.commits++;
+  journal->stats.commit_usec += (end.tv_sec - start.tv_sec) * 1000000L +
+                                (end.tv_usec - start.tv_usec);
+
+  if (!ok) {
+    syslog(LOG_ERR, "Could not write journal: %m");
+    evbuffer_drain(journal->pending, evbuffer_get_length(journal->pending));
+  }
+
+  if (ok && journal->stats.open == 0 && journal->size > kJournalCompactSize &&
+      ftruncate(journal->fd, 0) == 0) {
+    lseek(journal->fd, 0, SEEK_SET);
+    journal->size = 0;
+  }
+
+  struct journal_waiter_list waiters;
+  TAILQ_INIT(&waiters);
+  TAILQ_CONCAT(&waiters, &journal->waiters, entries);
+
+  while (!TAILQ_EMPTY(&waiters)) {
+    struct journal_waiter *waiter = TAILQ_FIRST(&waiters);
+    TAILQ_REMOVE(&waiters, waiter, entries);
+    waiter->committed(ok, waiter->userdata);
+    free(waiter);
+  }
+}
+
+static int compare_keys(const void *a, const void *b) {
+  return strcmp(*(const char **) a, *(const char **) b);
+}
+
+// Finds the changes that were begun but never ended. `num_lines` is set to
+// the number of lines read, torn or not.
+static json_t *read_incomplete(FILE *file,
+                               unsigned long *max_id,
+                               size_t *num_lines) {
+  json_t *open = json_object();
+  char *line = NULL;
+  size_t line_size = 0;
+
+  while (getline(&line, &line_size, file) != -1) {
+    (*num_lines)++;
+    json_t *record = json_loads(line, 0, NULL);
+
+    // A torn last line is a record that never committed
+    if (record == NULL)
+      continue;
+
+    json_int_t id = json_integer_value(json_object_get(record, "id"));
+    const char *type = json_string_value(json_object_get(record, "type"));
+    char key[32];
+    snprintf(key, sizeof(key), "%020lld", (long long) id);
+
+    if ((unsigned long) id > *max_id)
+      *max_id = id;
+
+    if (type != NULL && strcmp(type, "begin") == 0)
+      json_object_set(open, key, record);
+    else if (type != NULL && strcmp(type, "end") == 0)
+      json_object_del(open, key);
+
+    json_decref(record);
+  }
+
+  free(line);
+
+  // Keys are zero padded IDs, so sorting them restores the original order
+  json_t *incomplete = json_array();
+  size_t num_keys = json_object_size(open);
+  const char **keys = malloc((num_keys > 0 ? num_keys : 1) * sizeof(char *));
+  size_t num_sorted = 0;
+
+  if (keys != NULL) {
+    for (void *iter = json_object_iter(open);
+         iter != NULL;
+         iter = json_object_iter_next(open, iter))
+      keys[num_sorted++] = json_object_iter_key(iter);
+
+    qsort(keys, num_sorted, sizeof(char *), &compare_keys);
+
+    for (size_t i = 0; i < num_sorted; i++)
+      json_array_append(incomplete, json_object_get(open, keys[i]));
+  }
+
+  free(keys);
+  json_decref(open);
+  return incomplete;
+}
+
+// Writes the changes still open to a new file and moves it over the journal,
+// so that a crash leaves either the old journal or the new one. Returns the
+// new file, open for appending, or -1 on error.
+static int journal_compact(const char *path, json_t *incomplete, off_t *size) {
+  char tmp_path[1024];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+
+  if (fd == -1)
+    return -1;
+
+  struct evbuffer *buf = evbuffer_new();
+  bool ok = buf != NULL;
+
+  for (size_t i = 0; ok && i < json_array_size(incomplete); i++) {
+    char *line = json_dumps(json_array_get(incomplete, i), JSON_COMPACT);
+    ok = line != NULL && evbuffer_add_printf(buf, "%s\n", line) >= 0;
+    free(line);
+  }
+
+  *size = ok ? evbuffer_get_length(buf) : 0;
+
+  while (ok && evbuffer_get_length(buf) > 0) {
+    if (evbuffer_write(buf, fd) < 0 && errno != EINTR)
+      ok = false;
+  }
+
+  if (buf != NULL)
+    evbuffer_free(buf);
+
+  ok = ok && fsync(fd) == 0 && rename(tmp_path, path) == 0;
+
+  if (!ok) {
+    close(fd);
+    remove(tmp_path);
+    return -1;
+  }
+
+  // Make the rename itself durable
+  char dir_path[1024];
+  snprintf(dir_path, sizeof(dir_path), "%s", path);
+  char *slash = strrchr(dir_path, '/');
+
+  if (slash == NULL)
+    snprintf(dir_path, sizeof(dir_path), ".");
+  else
+    slash[slash == dir_path ? 1 : 0] = '\0';
+
+  int dir_fd = open(dir_path, O_RDONLY);
+
+  if (dir_fd != -1) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  return fd;
+}
+
+struct journal *journal_open(const char *path, struct event_base *event_base) {
+  struct journal *journal = calloc(1, sizeof(struct journal));
+
+  if (journal == NULL)
+    return NULL;
+
+  journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+
+  if (journal->fd == -1) {
+    free(journal);
+    return NULL;
+  }
+
+  FILE *file = fdopen(dup(journal->fd), "r");
+  unsigned long max_id = 0;
+  size_t num_lines = 0;
+  journal->incomplete = file != NULL
+      ? read_incomplete(file, &max_id, &num_lines) : json_array();
+
+  if (file != NULL)
+    fclose(file);
+
+  journal->next_id = max_id + 1;
+  journal->pending = evbuffer_new();
+  journal->flush = evtimer_new(event_base, &journal_flush, journal);
+  TAILQ_INIT(&journal->waiters);
+
+  // Start over with just the changes still open, unless that's all there is.
+  // A torn last line counts as something to drop, or the next record would
+  // be appended to it.
+  struct stat st;
+  journal->size = fstat(journal->fd, &st) == 0 ? st.st_size : 0;
+
+  if (num_lines > json_array_size(journal->incomplete)) {
+    off_t size;
+    int fd = journal_compact(path, journal->incomplete, &size);
+
+    if (fd != -1) {
+      close(journal->fd);
+      journal->fd = fd;
+      journal->size = size;
+    } else {
+      syslog(LOG_WARNING, "Could not compact journal: %m");
+    }
+  }
+
+  journal->stats.open = json_array_size(journal->incomplete);
+
+  if (!journal_write(journal)) {
+    journal_close(journal);
+    return NULL;
+  }
+
+  return journal;
+}
+
+void journal_close(struct journal *journal) {
+  if (evbuffer_get_length(journal->pending) > 0)
+    journal_write(journal);
+
+  while (!TAILQ_EMPTY(&journal->waiters)) {
+    struct journal_waiter *waiter = TAILQ_FIRST(&journal->waiters);
+    TAILQ_REMOVE(&journal->waiters, waiter, entries);
+    free(waiter);
+  }
+
+  close(journal->fd);
+  evbuffer_free(journal->pending);
+  event_free(journal->flush);
+  json_decref(journal->incomplete);
+  free(journal);
+}
+
+json_t *journal_take_incomplete(struct journal *journal) {
+  json_t *incomplete = journal->incomplete;
+  journal->incomplete = json_array();
+  return incomplete;
+}
+
+unsigned long journal_begin(struct journal *journal,
+                            json_t *record,
+                            journal_committed_fn committed,
+                            void *userdata) {
+  struct journal_waiter *waiter = malloc(sizeof(struct journal_waiter));
+
+  if (waiter == NULL)
+    return 0;
+
+  unsigned long id = journal->next_id++;
+  json_object_set_new(record, "id", json_integer(id));
+  json_object_set_new(record, "type", json_string("begin"));
+
+  if (!journal_append(journal, record)) {
+    free(waiter);
+    return 0;
+  }
+
+  waiter->committed = committed;
+  waiter->userdata = userdata;
+  TAILQ_INSERT_TAIL(&journal->waiters, waiter, entries);
+  journal->stats.open++;
+  return id;
+}
+
+void journal_end(struct journal *journal, unsigned long id) {
+  json_t *record = json_object();
+  json_object_set_new(record, "id", json_integer(id));
+  json_object_set_new(record, "type", json_string("end"));
+  journal_append(journal, record);
+  json_decref(record);
+  journal->stats.open--;
+}
+
+void journal_get_stats(struct journal *journal, struct journal_stats *stats) {
+  *stats = journal->stats;
+}
@@ -0,0 +1,48 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <event2/event.h>
+#include <jansson.h>
+#include <stdbool.h>
+
+// Append-only log of playlist changes. A change is recorded with
+// journal_begin() before it is made and with journal_end() once libspotify
+// has synced it, so that changes cut short by a crash can be found on the
+// next start. Records are JSON objects, one per line.
+struct journal;
+
+// Called once the record of a change is on disk, or failed to get there
+typedef void (*journal_committed_fn)(bool ok, void *userdata);
+
+struct journal_stats {
+  unsigned long records;      // Records written
+  unsigned long commits;      // fsyncs, each covering any number of records
+  unsigned long commit_usec;  // Time spent writing and syncing in total
+  unsigned long open;         // Changes begun but not ended
+};
+
+// Opens or creates a journal. Changes that were never ended are kept and can
+// be had with journal_take_incomplete(). Returns NULL on error.
+struct journal *journal_open(const char *path, struct event_base *event_base);
+
+void journal_close(struct journal *journal);
+
+// Returns an array of the begin records of changes left incomplete by the
+// previous run and gives up the journal's reference to it. They're still
+// open: end them once they have been dealt with.
+json_t *journal_take_incomplete(struct journal *journal);
+
+// Records the start of a change. `record` gets an "id" and is written along
+// with every other record begun in the same event loop iteration; `committed`
+// is called after the fsync. Returns the ID, or 0 if out of memory.
+unsigned long journal_begin(struct journal *journal,
+                            json_t *record,
+                            journal_committed_fn committed,
+                            void *userdata);
+
+// Records that a change has been synced, or given up on
+void journal_end(struct journal *journal, unsigned long id);
+
+void journal_get_stats(struct journal *journal, struct journal_stats *stats);
+
+#endif
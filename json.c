@@ -3,10 +3,28 @@
 #include <libspotify/api.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdlib.h>
 
 #include "constants.h"
+#include "json.h"
 
-json_t *track_to_json(sp_track *track, json_t *object) {
+const char *track_availability_name(sp_track_availability availability) {
+  switch (availability) {
+    case SP_TRACK_AVAILABILITY_AVAILABLE:
+      return "available";
+
+    case SP_TRACK_AVAILABILITY_NOT_STREAMABLE:
+      return "notStreamable";
+
+    case SP_TRACK_AVAILABILITY_BANNED_BY_ARTIST:
+      return "bannedByArtist";
+
+    default:
+      return "unavailable";
+  }
+}
+
+json_t *track_to_json(sp_track *track, sp_session *session, json_t *object) {
   char uri[kTrackLinkLength];
   sp_link *link = sp_link_create_from_track(track, 0);
   sp_link_as_string(link, uri, kTrackLinkLength);
@@ -19,6 +37,39 @@ json_t *track_to_json(sp_track *track, json_t *object) {
 
   const char *name = sp_track_name(track);
   json_object_set_new(object, "title", json_string_nocheck(name)); 
+
+  // Artists
+  json_t *artists = json_array();
+  json_object_set_new(object, "artists", artists);
+
+  for (int i = 0; i < sp_track_num_artists(track); i++) {
+    sp_artist *artist = sp_track_artist(track, i);
+
+    if (artist != NULL && sp_artist_is_loaded(artist))
+      json_array_append_new(artists, json_string_nocheck(sp_artist_name(artist)));
+  }
+
+  // Album
+  sp_album *album = sp_track_album(track);
+
+  if (album != NULL && sp_album_is_loaded(album)) {
+    json_object_set_new(object, "album",
+                        json_string_nocheck(sp_album_name(album)));
+  }
+
+  json_object_set_new(object, "duration",
+                      json_integer(sp_track_duration(track)));
+  json_object_set_new(object, "popularity",
+                      json_integer(sp_track_popularity(track)));
+
+  // Availability
+  if (session == NULL)
+    return object;
+
+  sp_track_availability availability = sp_track_get_availability(session,
+                                                                 track);
+  json_object_set_new(object, "availability",
+                      json_string_nocheck(track_availability_name(availability)));
   return object;
 }
 
@@ -30,103 +81,146 @@ json_t *playlist_to_json_set_collaborative(sp_playlist *playlist,
   return object;
 }
 
-json_t *playlist_to_json(sp_playlist *playlist, json_t *object) {
+unsigned int playlist_fields_parse(const char *fields) {
+  static const struct {
+    const char *name;
+    unsigned int field;
+  } names[] = {
+    {"creator", PLAYLIST_FIELD_CREATOR},
+    {"uri", PLAYLIST_FIELD_URI},
+    {"title", PLAYLIST_FIELD_TITLE},
+    {"collaborative", PLAYLIST_FIELD_COLLABORATIVE},
+    {"description", PLAYLIST_FIELD_DESCRIPTION},
+    {"subscriberCount", PLAYLIST_FIELD_SUBSCRIBER_COUNT},
+    {"tracks", PLAYLIST_FIELD_TRACKS},
+    {"numTracks", PLAYLIST_FIELD_NUM_TRACKS}
+  };
+  unsigned int mask = 0;
+
+  while (*fields != '\0') {
+    size_t len = strcspn(fields, ",");
+    bool found = false;
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+      if (strlen(names[i].name) == len &&
+          strncmp(names[i].name, fields, len) == 0) {
+        mask |= names[i].field;
+        found = true;
+        break;
+      }
+    }
+
+    if (!found)
+      return 0;
+
+    fields += len;
+
+    if (*fields == ',')
+      fields++;
+  }
+
+  return mask;
+}
+
+json_t *playlist_to_json_with_options(
+    sp_playlist *playlist,
+    const struct playlist_json_options *options,
+    json_t *object) {
   assert(sp_playlist_is_loaded(playlist));
+  unsigned int fields = options->fields;
 
   // Owner
   sp_user *owner = sp_playlist_owner(playlist);
   const char *username = sp_user_display_name(owner);
   sp_user_release(owner);
-  json_object_set_new_nocheck(object, "creator",
-                              json_string_nocheck(username));
 
-  // URI
-  size_t playlist_uri_len = strlen("spotify:user:") + strlen(username) + 
-                            strlen(":playlist:") +
-                            strlen("284on3DVWeAxWkgVuzZKGt") + 1;
-  char *playlist_uri = malloc(playlist_uri_len);
-
-  if (playlist_uri == NULL)
-    return NULL;
+  if (fields & PLAYLIST_FIELD_CREATOR) {
+    json_object_set_new_nocheck(object, "creator",
+                                json_string_nocheck(username));
+  }
 
-  sp_link *playlist_link = sp_link_create_from_playlist(playlist);
+  // URI
+  if (fields & PLAYLIST_FIELD_URI) {
+    char playlist_uri[kMaxPlaylistLinkLength];
+    sp_link *playlist_link = sp_link_create_from_playlist(playlist);
 
-  if (playlist_link == NULL)  // Shouldn't happen; playlist is loaded (?)
-    return object;
+    if (playlist_link == NULL)  // Shouldn't happen; playlist is loaded (?)
+      return object;
 
-  sp_link_as_string(playlist_link, playlist_uri, playlist_uri_len);
-  sp_link_release(playlist_link);
-  json_object_set_new(object, "uri", 
-                      json_string_nocheck(playlist_uri));
-  free(playlist_uri);
+    sp_link_as_string(playlist_link, playlist_uri, kMaxPlaylistLinkLength);
+    sp_link_release(playlist_link);
+    json_object_set_new(object, "uri", 
+                        json_string_nocheck(playlist_uri));
+  }
 
   // Title
-  const char *title = sp_playlist_name(playlist);
-  json_object_set_new(object, "title",
-                      json_string_nocheck(title));
+  if (fields & PLAYLIST_FIELD_TITLE) {
+    const char *title = sp_playlist_name(playlist);
+    json_object_set_new(object, "title",
+                        json_string_nocheck(title));
+  }
 
   // Collaborative
-  playlist_to_json_set_collaborative(playlist, object);
+  if (fields & PLAYLIST_FIELD_COLLABORATIVE)
+    playlist_to_json_set_collaborative(playlist, object);
 
   // Description
-  const char *description = sp_playlist_get_description(playlist);
+  if (fields & PLAYLIST_FIELD_DESCRIPTION) {
+    const char *description = sp_playlist_get_description(playlist);
 
-  if (description != NULL) {
-    json_object_set_new(object, "description",
-                        json_string_nocheck(description));
+    if (description != NULL) {
+      json_object_set_new(object, "description",
+                          json_string_nocheck(description));
+    }
   }
 
   // Number of subscribers
-  int num_subscribers = sp_playlist_num_subscribers(playlist);
-  json_object_set_new(object, "subscriberCount",
-                      json_integer(num_subscribers));
-
-  // Tracks
-  json_t *tracks = json_array();
-  json_object_set_new(object, "tracks", tracks);
-  char track_uri[kTrackLinkLength];
-
-  for (int i = 0; i < sp_playlist_num_tracks(playlist); i++) {
-    sp_track *track = sp_playlist_track(playlist, i);
-    sp_link *track_link = sp_link_create_from_track(track, 0);
-    sp_link_as_string(track_link, track_uri, kTrackLinkLength);
-    json_array_append(tracks, json_string_nocheck(track_uri));
-    sp_link_release(track_link);
+  if (fields & PLAYLIST_FIELD_SUBSCRIBER_COUNT) {
+    int num_subscribers = sp_playlist_num_subscribers(playlist);
+    json_object_set_new(object, "subscriberCount",
+                        json_integer(num_subscribers));
   }
 
-  return object;
-}
-
-bool json_to_track(json_t *json, sp_track **track) {
-  if (!json_is_string(json))
-    return false;
-
-  sp_link *link = sp_link_create_from_string(json_string_value(json));
+  int num_tracks = sp_playlist_num_tracks(playlist);
 
-  if (link == NULL)
-    return false;
-
-  if (sp_link_type(link) != SP_LINKTYPE_TRACK) {
-    sp_link_release(link);
-    return false;
-  }
+  if (fields & PLAYLIST_FIELD_NUM_TRACKS)
+    json_object_set_new(object, "numTracks", json_integer(num_tracks));
 
-  *track = sp_link_as_track(link);
-  return *track != NULL;
-}
+  // Tracks: only the requested slice is walked
+  if (fields & PLAYLIST_FIELD_TRACKS) {
+    json_t *tracks = json_array();
+    json_object_set_new(object, "tracks", tracks);
+    char track_uri[kTrackLinkLength];
+    int end = num_tracks;
 
-int json_to_tracks(json_t *json, sp_track **tracks, int num_tracks) {
-  if (!json_is_array(json))
-    return 0;
+    if (options->limit >= 0 && options->limit < num_tracks - options->offset)
+      end = options->offset + options->limit;
 
-  int num_valid_tracks = 0;
+    for (int i = options->offset; i < end; i++) {
+      sp_track *track = sp_playlist_track(playlist, i);
 
-  for (int i = 0; i < num_tracks; i++) {
-    json_t *item = json_array_get(json, i);
+      if (options->expand_tracks) {
+        json_array_append_new(tracks, track_to_json(track, options->session,
+                                                    json_object()));
+        continue;
+      }
 
-    if (json_to_track(item, &tracks[num_valid_tracks]))
-      num_valid_tracks++;
+      sp_link *track_link = sp_link_create_from_track(track, 0);
+      sp_link_as_string(track_link, track_uri, kTrackLinkLength);
+      json_array_append_new(tracks, json_string_nocheck(track_uri));
+      sp_link_release(track_link);
+    }
   }
 
-  return num_valid_tracks;
+  return object;
+}
+
+json_t *playlist_to_json(sp_playlist *playlist, json_t *object) {
+  struct playlist_json_options options = {
+    .fields = PLAYLIST_FIELDS_DEFAULT,
+    .offset = 0,
+    .limit = -1,
+    .expand_tracks = false
+  };
+  return playlist_to_json_with_options(playlist, &options, object);
 }
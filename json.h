@@ -1,14 +1,60 @@
 #ifndef JSON_H_
 #define JSON_H_
 
+// Playlist fields that can be selected with `?fields=`
+enum playlist_field {
+  PLAYLIST_FIELD_CREATOR = 1 << 0,
+  PLAYLIST_FIELD_URI = 1 << 1,
+  PLAYLIST_FIELD_TITLE = 1 << 2,
+  PLAYLIST_FIELD_COLLABORATIVE = 1 << 3,
+  PLAYLIST_FIELD_DESCRIPTION = 1 << 4,
+  PLAYLIST_FIELD_SUBSCRIBER_COUNT = 1 << 5,
+  PLAYLIST_FIELD_TRACKS = 1 << 6,
+  PLAYLIST_FIELD_NUM_TRACKS = 1 << 7
+};
+
+// Fields emitted when the client doesn't ask for anything in particular
+#define PLAYLIST_FIELDS_DEFAULT (PLAYLIST_FIELD_CREATOR | \
+                                 PLAYLIST_FIELD_URI | \
+                                 PLAYLIST_FIELD_TITLE | \
+                                 PLAYLIST_FIELD_COLLABORATIVE | \
+                                 PLAYLIST_FIELD_DESCRIPTION | \
+                                 PLAYLIST_FIELD_SUBSCRIBER_COUNT | \
+                                 PLAYLIST_FIELD_TRACKS)
+
+// Fields of a shallow container listing, none of which need track data
+#define PLAYLIST_FIELDS_SHALLOW (PLAYLIST_FIELD_CREATOR | \
+                                 PLAYLIST_FIELD_URI | \
+                                 PLAYLIST_FIELD_TITLE | \
+                                 PLAYLIST_FIELD_COLLABORATIVE | \
+                                 PLAYLIST_FIELD_NUM_TRACKS)
+
+// What parts of a playlist to serialize
+struct playlist_json_options {
+  unsigned int fields;  // Bitmask of `enum playlist_field`
+  int offset;           // Index of the first track to include
+  int limit;            // Maximum number of tracks to include; -1 for all
+  bool expand_tracks;   // Track metadata instead of bare URIs
+  sp_session *session;  // Used for track availability when expanding
+};
+
+// "available", "notStreamable", "bannedByArtist" or "unavailable"
+const char *track_availability_name(sp_track_availability availability);
+
+// Serializes a track's URI and, if loaded, its metadata. Availability in the
+// session's region is left out if `session` is NULL.
+json_t *track_to_json(sp_track *track, sp_session *session, json_t *object);
+
 json_t *playlist_to_json(sp_playlist *, json_t *);
 
-json_t *playlist_to_json_set_collaborative(sp_playlist *, json_t *);
+json_t *playlist_to_json_with_options(sp_playlist *,
+                                      const struct playlist_json_options *,
+                                      json_t *);
 
-// Read track URI into Spotify track
-bool json_to_track(json_t *json, sp_track **track);
+json_t *playlist_to_json_set_collaborative(sp_playlist *, json_t *);
 
-// Read tracks from an JSON array of track URIs
-int json_to_tracks(json_t *json, sp_track **tracks, int num_tracks);
+// Parses a comma separated list of field names, e.g. "title,uri,tracks".
+// Returns 0 if any of the names is unknown.
+unsigned int playlist_fields_parse(const char *fields);
 
 #endif
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE  // struct addrinfo
+
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "listener.h"
+
+bool listener_parse_address(const char *address,
+                            struct listen_address *listen_address) {
+  memset(listen_address, 0, sizeof(struct listen_address));
+  listen_address->fd = -1;
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    if (address[5] == '\0')
+      return false;
+
+    listen_address->path = strdup(address + 5);
+    return listen_address->path != NULL;
+  }
+
+  const char *colon = strrchr(address, ':');
+
+  if (colon == NULL || colon == address)
+    return false;
+
+  char *end;
+  long port = strtol(colon + 1, &end, 10);
+
+  if (*end != '\0' || end == colon + 1 || port <= 0 || port > 65535)
+    return false;
+
+  // [::1]:1337
+  const char *host = address;
+  size_t host_len = colon - address;
+
+  if (host[0] == '[' && host[host_len - 1] == ']') {
+    host++;
+    host_len -= 2;
+  }
+
+  listen_address->host = strndup(host, host_len);
+  listen_address->port = port;
+  return listen_address->host != NULL;
+}
+
+struct evconnlistener *listener_bind_tcp(struct event_base *event_base,
+                                         const char *host,
+                                         int port,
+                                         bool reuse_port) {
+  struct evutil_addrinfo hints, *addresses;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = EVUTIL_AI_PASSIVE | EVUTIL_AI_ADDRCONFIG;
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+
+  if (evutil_getaddrinfo(host, service, &hints, &addresses) != 0)
+    return NULL;
+
+  unsigned flags = LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE |
+                   LEV_OPT_CLOSE_ON_EXEC;
+
+  if (reuse_port)
+    flags |= LEV_OPT_REUSEABLE_PORT;
+
+  struct evconnlistener *listener = NULL;
+
+  for (struct evutil_addrinfo *address = addresses;
+       address != NULL && listener == NULL;
+       address = address->ai_next)
+    listener = evconnlistener_new_bind(event_base, NULL, NULL, flags, -1,
+                                       address->ai_addr, address->ai_addrlen);
+
+  evutil_freeaddrinfo(addresses);
+  return listener;
+}
+
+bool listener_bind_unix(struct listen_address *listen_address) {
+  struct sockaddr_un address;
+
+  if (strlen(listen_address->path) >= sizeof(address.sun_path))
+    return false;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, listen_address->path);
+
+  // Left behind by a server that didn't exit cleanly
+  struct stat st;
+
+  if (lstat(listen_address->path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(listen_address->path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd == -1)
+    return false;
+
+  if (bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+      listen(fd, SOMAXCONN) == -1 || stat(listen_address->path, &st) == -1) {
+    close(fd);
+    return false;
+  }
+
+  listen_address->fd = fd;
+  listen_address->dev = st.st_dev;
+  listen_address->ino = st.st_ino;
+  return true;
+}
+
+void listener_unlink_unix(const struct listen_address *listen_address) {
+  struct stat st;
+
+  if (listen_address->fd != -1 && stat(listen_address->path, &st) == 0 &&
+      st.st_dev == listen_address->dev && st.st_ino == listen_address->ino)
+    unlink(listen_address->path);
+}
+
+// The first socket passed by socket activation is always descriptor 3
+#define LISTEN_FDS_START 3
+
+int listener_inherited_fd(void) {
+  const char *pid = getenv("LISTEN_PID");
+  const char *fds = getenv("LISTEN_FDS");
+
+  if (pid == NULL || fds == NULL || atol(pid) != getpid() || atoi(fds) < 1)
+    return -1;
+
+  // Children mustn't think they were passed the sockets too
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  evutil_make_socket_closeonexec(LISTEN_FDS_START);
+  return LISTEN_FDS_START;
+}
+
+struct evconnlistener *listener_from_fd(struct event_base *event_base,
+                                        int fd,
+                                        bool enabled) {
+  unsigned flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC;
+
+  if (!enabled)
+    flags |= LEV_OPT_DISABLED;
+
+  evutil_make_socket_nonblocking(fd);
+  return evconnlistener_new(event_base, NULL, NULL, flags, -1, fd);
+}
@@ -0,0 +1,52 @@
+#ifndef LISTENER_H_
+#define LISTENER_H_
+
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+// An address to listen on besides --host and --port (--listen): host:port,
+// or unix:<path> for a Unix domain socket
+struct listen_address {
+  char *host;  // NULL for a Unix domain socket
+  int port;
+  char *path;
+  int fd;  // Unix domain sockets are bound before workers are forked
+  dev_t dev;  // Of the socket file, to tell whether it's still ours
+  ino_t ino;
+  struct evconnlistener *listener;
+};
+
+// Parses host:port ([host]:port for IPv6) or unix:<path>. Returns false if
+// the address is malformed or out of memory.
+bool listener_parse_address(const char *address,
+                            struct listen_address *listen_address);
+
+// Opens a listening TCP socket on host:port. With `reuse_port`, several
+// processes can listen on the same port (SO_REUSEPORT) and the kernel
+// spreads new connections over them. Returns NULL on error.
+struct evconnlistener *listener_bind_tcp(struct event_base *event_base,
+                                         const char *host,
+                                         int port,
+                                         bool reuse_port);
+
+// Creates the Unix domain socket of an address, replacing a stale socket
+// file at its path, and listens on it (`fd`). Returns false on error.
+bool listener_bind_unix(struct listen_address *listen_address);
+
+// Removes the socket file of an address unless another server has replaced
+// it since
+void listener_unlink_unix(const struct listen_address *listen_address);
+
+// Returns the first socket passed by systemd-style socket activation
+// (LISTEN_FDS and LISTEN_PID), or -1 if there is none
+int listener_inherited_fd(void);
+
+// Listens on a socket that is already bound and listening, e.g. inherited
+// or handed over. The listener is disabled to begin with unless `enabled`.
+struct evconnlistener *listener_from_fd(struct event_base *event_base,
+                                        int fd,
+                                        bool enabled);
+
+#endif
@@ -0,0 +1,346 @@
+#include <event2/buffer.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+
+#include "listing_cache.h"
+
+// Shared by a fragment and the replies still sending it
+struct fragment_body {
+  int refs;
+  size_t len;
+  char data[];
+};
+
+static void fragment_body_release(struct fragment_body *body) {
+  if (--body->refs == 0)
+    free(body);
+}
+
+static void fragment_body_cleanup(const void *data,
+                                  size_t len,
+                                  void *extra) {
+  fragment_body_release(extra);
+}
+
+static void fragment_changed(struct listing_fragment *fragment) {
+  if (fragment->body == NULL)
+    return;
+
+  fragment_body_release(fragment->body);
+  fragment->body = NULL;
+}
+
+static void playlist_changed(sp_playlist *playlist, void *userdata) {
+  fragment_changed(userdata);
+}
+
+static void playlist_tracks_added(sp_playlist *playlist,
+                                  sp_track *const *tracks,
+                                  int num_tracks,
+                                  int position,
+                                  void *userdata) {
+  fragment_changed(userdata);
+}
+
+static void playlist_tracks_removed(sp_playlist *playlist,
+                                    const int *tracks,
+                                    int num_tracks,
+                                    void *userdata) {
+  fragment_changed(userdata);
+}
+
+// What a listing shows of a playlist: its name, owner, collaborative flag
+// and length
+static sp_playlist_callbacks playlist_callbacks = {
+  .tracks_added = &playlist_tracks_added,
+  .tracks_removed = &playlist_tracks_removed,
+  .playlist_renamed = &playlist_changed,
+  .playlist_state_changed = &playlist_changed
+};
+
+static void container_changed(struct listing *listing) {
+  listing->reorder = true;
+}
+
+static void container_playlist_added(sp_playlistcontainer *pc,
+                                     sp_playlist *playlist,
+                                     int position,
+                                     void *userdata) {
+  container_changed(userdata);
+}
+
+static void container_playlist_removed(sp_playlistcontainer *pc,
+                                       sp_playlist *playlist,
+                                       int position,
+                                       void *userdata) {
+  container_changed(userdata);
+}
+
+static void container_playlist_moved(sp_playlistcontainer *pc,
+                                     sp_playlist *playlist,
+                                     int position,
+                                     int new_position,
+                                     void *userdata) {
+  container_changed(userdata);
+}
+
+static sp_playlistcontainer_callbacks container_callbacks = {
+  .playlist_added = &container_playlist_added,
+  .playlist_removed = &container_playlist_removed,
+  .playlist_moved = &container_playlist_moved
+};
+
+// `playlist` is NULL for folder markers
+static struct listing_fragment *fragment_new(struct listing *listing,
+                                             sp_playlist_type type,
+                                             int index,
+                                             sp_playlist *playlist) {
+  struct listing_fragment *fragment = malloc(sizeof(struct listing_fragment));
+
+  if (fragment == NULL)
+    return NULL;
+
+  fragment->listing = listing;
+  fragment->type = type;
+  fragment->index = index;
+  fragment->folder_id = type == SP_PLAYLIST_TYPE_PLAYLIST ? 0 :
+      sp_playlistcontainer_playlist_folder_id(listing->container, index);
+  fragment->playlist = playlist;
+  fragment->body = NULL;
+
+  if (playlist != NULL) {
+    sp_playlist_add_ref(playlist);
+    sp_playlist_add_callbacks(playlist, &playlist_callbacks, fragment);
+  }
+
+  return fragment;
+}
+
+static void fragment_free(struct listing_fragment *fragment) {
+  if (fragment->playlist != NULL) {
+    sp_playlist_remove_callbacks(fragment->playlist, &playlist_callbacks,
+                                 fragment);
+    sp_playlist_release(fragment->playlist);
+  }
+
+  if (fragment->body != NULL)
+    fragment_body_release(fragment->body);
+
+  free(fragment);
+}
+
+static bool fragment_render(struct listing_fragment *fragment) {
+  struct listing_cache *cache = fragment->listing->cache;
+  struct evbuffer *buf = evbuffer_new();
+
+  if (buf == NULL)
+    return false;
+
+  if (!cache->render(fragment->playlist, fragment->listing->variant, buf,
+                     cache->userdata)) {
+    evbuffer_free(buf);
+    return false;
+  }
+
+  size_t len = evbuffer_get_length(buf);
+  struct fragment_body *body = malloc(sizeof(struct fragment_body) + len);
+
+  if (body == NULL) {
+    evbuffer_free(buf);
+    return false;
+  }
+
+  body->refs = 1;
+  body->len = len;
+  evbuffer_remove(buf, body->data, len);
+  evbuffer_free(buf);
+  fragment->body = body;
+  cache->renders++;
+  return true;
+}
+
+// Matches fragments to the container's playlists again, keeping the ones
+// whose playlist is still there (in their new place) and dropping the rest.
+// Folder markers are cheap and made anew.
+static bool listing_reorder(struct listing *listing) {
+  sp_playlistcontainer *container = listing->container;
+  int num_playlists = sp_playlistcontainer_num_playlists(container);
+  struct listing_fragment **fragments = calloc(
+      num_playlists > 0 ? num_playlists : 1, sizeof(struct listing_fragment *));
+
+  if (fragments == NULL)
+    return false;
+
+  int num_fragments = 0;
+  bool complete = true;
+
+  for (int i = 0; i < num_playlists && complete; i++) {
+    sp_playlist_type type = sp_playlistcontainer_playlist_type(container, i);
+    sp_playlist *playlist = NULL;
+
+    if (type == SP_PLAYLIST_TYPE_PLAYLIST)
+      playlist = sp_playlistcontainer_playlist(container, i);
+
+    if (type == SP_PLAYLIST_TYPE_PLACEHOLDER ||
+        (type == SP_PLAYLIST_TYPE_PLAYLIST && playlist == NULL))
+      continue;
+
+    // Most playlists stay where they were, so look there first
+    struct listing_fragment *fragment = NULL;
+
+    for (int j = 0; j < listing->num_fragments && playlist != NULL &&
+                    fragment == NULL; j++) {
+      int k = (num_fragments + j) % listing->num_fragments;
+
+      if (listing->fragments[k] != NULL &&
+          listing->fragments[k]->playlist == playlist) {
+        fragment = listing->fragments[k];
+        fragment->index = i;
+        listing->fragments[k] = NULL;
+      }
+    }
+
+    if (fragment == NULL)
+      fragment = fragment_new(listing, type, i, playlist);
+
+    if (fragment == NULL)
+      complete = false;
+    else
+      fragments[num_fragments++] = fragment;
+  }
+
+  for (int i = 0; i < listing->num_fragments; i++) {
+    if (listing->fragments[i] != NULL)
+      fragment_free(listing->fragments[i]);
+  }
+
+  free(listing->fragments);
+  listing->fragments = fragments;
+  listing->num_fragments = num_fragments;
+  listing->reorder = !complete;
+  return complete;
+}
+
+static void listing_free(struct listing *listing) {
+  struct listing_cache *cache = listing->cache;
+  TAILQ_REMOVE(&cache->lru, listing, lru_entries);
+  cache->num_entries--;
+
+  for (int i = 0; i < listing->num_fragments; i++)
+    fragment_free(listing->fragments[i]);
+
+  sp_playlistcontainer_remove_callbacks(listing->container,
+                                        &container_callbacks, listing);
+  sp_playlistcontainer_release(listing->container);
+  free(listing->fragments);
+  free(listing);
+}
+
+static struct listing *listing_new(struct listing_cache *cache,
+                                   sp_playlistcontainer *container,
+                                   int variant) {
+  while (cache->num_entries >= cache->max_entries)
+    listing_free(TAILQ_FIRST(&cache->lru));
+
+  struct listing *listing = malloc(sizeof(struct listing));
+
+  if (listing == NULL)
+    return NULL;
+
+  listing->cache = cache;
+  listing->container = container;
+  listing->variant = variant;
+  listing->fragments = NULL;
+  listing->num_fragments = 0;
+  listing->reorder = true;
+  sp_playlistcontainer_add_ref(container);
+  sp_playlistcontainer_add_callbacks(container, &container_callbacks, listing);
+  TAILQ_INSERT_TAIL(&cache->lru, listing, lru_entries);
+  cache->num_entries++;
+  return listing;
+}
+
+struct listing_cache *listing_cache_new(int max_entries) {
+  struct listing_cache *cache = malloc(sizeof(struct listing_cache));
+
+  if (cache == NULL)
+    return NULL;
+
+  TAILQ_INIT(&cache->lru);
+  cache->num_entries = 0;
+  cache->max_entries = max_entries;
+  cache->render = NULL;
+  cache->userdata = NULL;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->renders = 0;
+  return cache;
+}
+
+void listing_cache_free(struct listing_cache *cache) {
+  while (!TAILQ_EMPTY(&cache->lru))
+    listing_free(TAILQ_FIRST(&cache->lru));
+
+  free(cache);
+}
+
+struct listing *listing_cache_get(struct listing_cache *cache,
+                                  sp_playlistcontainer *container,
+                                  int variant) {
+  if (cache->max_entries <= 0 || cache->render == NULL)
+    return NULL;
+
+  struct listing *listing;
+
+  TAILQ_FOREACH(listing, &cache->lru, lru_entries) {
+    if (listing->container == container && listing->variant == variant)
+      break;
+  }
+
+  if (listing == NULL) {
+    listing = listing_new(cache, container, variant);
+
+    if (listing == NULL)
+      return NULL;
+
+    cache->misses++;
+  } else {
+    // Most recently used listings live at the tail
+    TAILQ_REMOVE(&cache->lru, listing, lru_entries);
+    TAILQ_INSERT_TAIL(&cache->lru, listing, lru_entries);
+  }
+
+  unsigned long renders = cache->renders;
+  bool reordered = listing->reorder;
+
+  if (listing->reorder && !listing_reorder(listing))
+    return NULL;
+
+  for (int i = 0; i < listing->num_fragments; i++) {
+    if (listing->fragments[i]->playlist != NULL &&
+        listing->fragments[i]->body == NULL &&
+        !fragment_render(listing->fragments[i]))
+      return NULL;
+  }
+
+  if (!reordered && cache->renders == renders)
+    cache->hits++;
+
+  return listing;
+}
+
+bool listing_fragment_add(const struct listing_fragment *fragment,
+                          struct evbuffer *buf) {
+  struct fragment_body *body = fragment->body;
+  body->refs++;
+
+  if (evbuffer_add_reference(buf, body->data, body->len,
+                             &fragment_body_cleanup, body) != 0) {
+    fragment_body_release(body);
+    return false;
+  }
+
+  return true;
+}
@@ -0,0 +1,77 @@
+#ifndef LISTING_CACHE_H_
+#define LISTING_CACHE_H_
+
+#include <event2/buffer.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/queue.h>
+
+// Renders one playlist of a listing in a variant of the caller's choosing,
+// e.g. a reply format. Returns false if the playlist can't be rendered yet.
+typedef bool (*listing_render_fn)(sp_playlist *playlist,
+                                  int variant,
+                                  struct evbuffer *buf,
+                                  void *userdata);
+
+struct fragment_body;
+
+// A playlist's part of a listing, or a folder marker. The body is dropped
+// when the playlist is renamed, changes length or changes state, and
+// rendered again when the listing is next asked for. Markers have no
+// playlist and no body; what to write for them is up to the caller.
+struct listing_fragment {
+  struct listing *listing;
+  sp_playlist_type type;  // Never SP_PLAYLIST_TYPE_PLACEHOLDER
+  int index;              // In the container
+  sp_uint64 folder_id;    // Of a folder marker
+  sp_playlist *playlist;
+  struct fragment_body *body;  // NULL until rendered
+};
+
+// A playlist container rendered as one fragment per playlist or folder
+// marker, in container order. Adding, removing or moving a playlist only
+// reorders the fragments.
+struct listing {
+  struct listing_cache *cache;
+  sp_playlistcontainer *container;
+  int variant;
+  struct listing_fragment **fragments;
+  int num_fragments;
+  bool reorder;  // The container has changed since fragments were matched
+  TAILQ_ENTRY(listing) lru_entries;
+};
+
+TAILQ_HEAD(listing_list, listing);
+
+// Bounded LRU cache of listings, e.g. of shallow /user/{username}/playlists
+struct listing_cache {
+  struct listing_list lru;
+  int num_entries;
+  int max_entries;
+  listing_render_fn render;  // Set by the owner before the first get
+  void *userdata;
+  unsigned long hits;     // Listings served without rendering anything
+  unsigned long misses;   // Listings rendered from scratch
+  unsigned long renders;  // Fragments rendered
+};
+
+struct listing_cache *listing_cache_new(int max_entries);
+
+void listing_cache_free(struct listing_cache *cache);
+
+// Returns the listing of a container variant with every fragment rendered,
+// rendering only the playlists that aren't yet. Returns NULL if a playlist
+// can't be rendered yet, or if the cache holds no entries or has nothing to
+// render with.
+struct listing *listing_cache_get(struct listing_cache *cache,
+                                  sp_playlistcontainer *container,
+                                  int variant);
+
+// Appends a rendered fragment to `buf` by reference rather than by copy. The
+// fragment stays valid until `buf` is done with it, even if the listing
+// changes or is evicted meanwhile. Returns false if out of memory.
+bool listing_fragment_add(const struct listing_fragment *fragment,
+                          struct evbuffer *buf);
+
+#endif
@@ -1,17 +1,38 @@
+#define _GNU_SOURCE  // sigaction, kill
+
 #include <apr.h>
+#include <errno.h>
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/thread.h>
 #include <getopt.h>
+#include <signal.h>
 #include <libspotify/api.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <svn_diff.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <syslog.h>
-
+#include <unistd.h>
+
+#include "availability.h"
+#include "cache.h"
+#include "config.h"
+#include "constants.h"
+#include "idempotency.h"
+#include "jobs.h"
+#include "journal.h"
+#include "listener.h"
+#include "listing_cache.h"
+#include "metadata.h"
+#include "preload.h"
+#include "router.h"
 #include "server.h"
+#include "shared_cache.h"
+#include "track_cache.h"
 
 // Application keys are 321 bytes, from what I've seen... but ramp it up
 // to be on the safe side
@@ -56,16 +77,173 @@ void read_application_key(char *path, sp_session_config *session_config) {
   fclose(file);
 }
 
+// Path of a worker's own copy of a file or directory
+static char *worker_path(const char *path, const char *separator, int worker) {
+  size_t size = strlen(path) + strlen(separator) + 16;
+  char *worker_path = malloc(size);
+
+  if (worker_path != NULL)
+    snprintf(worker_path, size, "%s%s%d", path, separator, worker);
+
+  return worker_path;
+}
+
+static volatile sig_atomic_t stopping_workers = 0;
+static volatile sig_atomic_t reloading_workers = 0;
+
+static void stop_workers(int signal) {
+  stopping_workers = 1;
+}
+
+static void reload_workers(int signal) {
+  reloading_workers = 1;
+}
+
+// Forks `workers` processes and restarts those that crash until told to
+// stop with SIGINT or SIGTERM, which is passed on to them. With `reload`,
+// so is SIGHUP. Returns the worker number in workers, and -1 in the
+// supervisor once all have exited.
+static int supervise_workers(int workers, bool reload) {
+  pid_t *pids = calloc(workers, sizeof(pid_t));
+
+  if (pids == NULL)
+    return -1;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &stop_workers;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  if (reload) {
+    action.sa_handler = &reload_workers;
+    sigaction(SIGHUP, &action, NULL);
+  }
+
+  int running = 0;
+  bool signalled = false;
+
+  for (int worker = 0; ; ) {
+    // Start workers that aren't running
+    for (; worker < workers; worker++) {
+      if (pids[worker] != 0 || stopping_workers)
+        continue;
+
+      pid_t pid = fork();
+
+      if (pid == 0) {
+        free(pids);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        // Until the worker is ready to reload, a SIGHUP mustn't kill it
+        signal(SIGHUP, SIG_IGN);
+        return worker;
+      }
+
+      if (pid == -1) {
+        syslog(LOG_CRIT, "Could not start worker %d: %m", worker);
+        continue;
+      }
+
+      pids[worker] = pid;
+      running++;
+    }
+
+    if (running == 0)
+      break;
+
+    if (stopping_workers && !signalled) {
+      for (int i = 0; i < workers; i++) {
+        if (pids[i] != 0)
+          kill(pids[i], SIGINT);
+      }
+
+      signalled = true;
+    }
+
+    if (reloading_workers) {
+      for (int i = 0; i < workers; i++) {
+        if (pids[i] != 0)
+          kill(pids[i], SIGHUP);
+      }
+
+      reloading_workers = 0;
+    }
+
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+
+    if (pid == -1) {
+      if (errno != EINTR)
+        break;
+
+      continue;
+    }
+
+    for (int i = 0; i < workers; i++) {
+      if (pids[i] != pid)
+        continue;
+
+      pids[i] = 0;
+      running--;
+
+      if (!stopping_workers &&
+          (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)) {
+        syslog(LOG_WARNING, "Worker %d exited abnormally; restarting", i);
+        sleep(1);
+        worker = i;
+      }
+    }
+  }
+
+  free(pids);
+  return -1;
+}
+
 int main(int argc, char **argv) {
   // Open syslog
   openlog("spotify-api-server", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_LOCAL1);
 
   // Initialize program state
   struct state *state = malloc(sizeof(struct state));
+  gettimeofday(&state->start_time, NULL);
+  state->session = NULL;
+  state->http = NULL;
+  state->listener = NULL;
+  state->ready = false;
+  state->online = false;
+  state->outages = 0;
+  state->offline_seconds = 0;
+  state->reconnect = NULL;
 
   // Web server defaults
   state->http_host = strdup("127.0.0.1");
   state->http_port = 1337;
+  state->listen_addresses = NULL;
+  state->num_listen_addresses = 0;
+  state->cache_entries = kDefaultCacheEntries;
+  state->compression_level = kDefaultCompressionLevel;
+  state->idempotency_keys = kDefaultIdempotencyKeys;
+  state->chunk_size = kDefaultChunkSize;
+  state->config_path = NULL;
+  state->preload_path = NULL;
+  state->hot_playlists_path = NULL;
+  state->preload = NULL;
+  state->traffic = NULL;
+  state->spotify_cache_size = -1;
+  state->drain_timeout = kDrainTimeout;
+  state->offline_queue_timeout = kOfflineQueueTimeout;
+  state->journal_path = NULL;
+  state->journal = NULL;
+  state->workers = 1;
+  state->worker = 0;
+  state->shared_cache = NULL;
+  state->handoff_path = NULL;
+  state->handoff_control = -1;
+  state->handoff = NULL;
+  state->draining = false;
+  state->drain = NULL;
 
   // Initialize libev w/ pthreads
   evthread_use_pthreads();
@@ -74,6 +252,10 @@ int main(int argc, char **argv) {
   state->async = event_new(state->event_base, -1, 0, &process_events, state);
   state->timer = evtimer_new(state->event_base, &process_events, state);
   state->sigint = evsignal_new(state->event_base, SIGINT, &sigint_handler, state);
+  state->sigterm = evsignal_new(state->event_base, SIGTERM, &sigint_handler,
+                                state);
+  state->sighup = evsignal_new(state->event_base, SIGHUP, &sighup_handler,
+                               state);
   state->exit_status = EXIT_FAILURE;
 
   // Initialize APR
@@ -88,6 +270,9 @@ int main(int argc, char **argv) {
     sp_session_callbacks session_callbacks = {
       .logged_in = &logged_in,
       .logged_out = &logged_out,
+      .connection_error = &connection_error,
+      .connectionstate_updated = &connectionstate_updated,
+      .metadata_updated = &metadata_updated,
       .notify_main_thread = &notify_main_thread
     };
 
@@ -106,6 +291,9 @@ int main(int argc, char **argv) {
     char *credentials_blob = NULL;
     bool remember_me = false;
     bool relogin = false;
+    char **shards = NULL;
+    int num_shards = 0;
+    bool listen_ok = true;
     struct option opts[] = {
       // Login configuration
       {"username", required_argument, NULL, 'u'},
@@ -135,9 +323,51 @@ int main(int argc, char **argv) {
       {"host", required_argument, NULL, 'H'},
       {"port", required_argument, NULL, 'P'},
 
+      // Another address to listen on: host:port or unix:<path>; may be given
+      // several times
+      {"listen", required_argument, NULL, 'l'},
+
+      // Number of rendered playlist bodies to cache (0 disables caching)
+      {"cache-entries", required_argument, NULL, 'E'},
+
+      // zlib level (1-9) for compressed responses; 0 disables compression
+      {"compression-level", required_argument, NULL, 'Z'},
+
+      // Number of Idempotency-Key replies to keep (0 disables them)
+      {"idempotency-keys", required_argument, NULL, 'I'},
+
+      // Most tracks to add or remove at a time
+      {"chunk-size", required_argument, NULL, 'B'},
+
+      // File to record playlist changes in until they're synced
+      {"journal", required_argument, NULL, 'J'},
+
+      // Route requests to other instances (host:port) instead of serving
+      // them; may be given several times
+      {"shard", required_argument, NULL, 'R'},
+
+      // Number of processes serving the port, each with its own session
+      {"workers", required_argument, NULL, 'W'},
+
+      // Socket to take the listening socket over from a running server on,
+      // and to hand it on to the next one
+      {"handoff", required_argument, NULL, 'O'},
+
+      // JSON file with settings, reloaded on SIGHUP. Its settings win over
+      // the command line.
+      {"config", required_argument, NULL, 'F'},
+
+      // Playlists (and spotify:user:<name> containers) to load right after
+      // logging in, one per line
+      {"preload", required_argument, NULL, 'L'},
+
+      // File the most requested playlists are written to on shutdown and
+      // preloaded from on startup
+      {"hot-playlists", required_argument, NULL, 'M'},
+
       {NULL, 0, NULL, 0}
     };
-    const char optstring[] = "u:p:k:A:C:S:T:U:H:P:";
+    const char optstring[] = "u:p:k:A:C:S:T:U:H:P:l:E:Z:I:B:J:R:W:O:F:L:M:";
 
     for (int c; (c = getopt_long(argc, argv, optstring, opts, NULL)) != -1; ) {
       switch (c) {
@@ -185,12 +415,220 @@ int main(int argc, char **argv) {
         case 'P':
           state->http_port = atoi(optarg);
           break;
+
+        case 'l': {
+          struct listen_address *more = realloc(
+              state->listen_addresses,
+              (state->num_listen_addresses + 1) * sizeof(struct listen_address));
+
+          if (more == NULL)
+            break;
+
+          state->listen_addresses = more;
+
+          if (listener_parse_address(optarg,
+                                     &more[state->num_listen_addresses])) {
+            state->num_listen_addresses++;
+          } else {
+            fprintf(stderr, "Invalid address %s (use host:port or "
+                            "unix:<path>)\n", optarg);
+            listen_ok = false;
+          }
+
+          break;
+        }
+
+        case 'E':
+          state->cache_entries = atoi(optarg);
+          break;
+
+        case 'Z':
+          state->compression_level = atoi(optarg);
+          break;
+
+        case 'I':
+          state->idempotency_keys = atoi(optarg);
+          break;
+
+        case 'B':
+          state->chunk_size = atoi(optarg);
+          break;
+
+        case 'J':
+          state->journal_path = strdup(optarg);
+          break;
+
+        case 'W':
+          state->workers = atoi(optarg);
+          break;
+
+        case 'O':
+          state->handoff_path = strdup(optarg);
+          break;
+
+        case 'F':
+          state->config_path = strdup(optarg);
+          break;
+
+        case 'L':
+          state->preload_path = strdup(optarg);
+          break;
+
+        case 'M':
+          state->hot_playlists_path = strdup(optarg);
+          break;
+
+        case 'R': {
+          char **more = realloc(shards, (num_shards + 1) * sizeof(char *));
+
+          if (more != NULL) {
+            shards = more;
+            shards[num_shards++] = strdup(optarg);
+          }
+
+          break;
+        }
       }
     }
 
-    if (session_config.application_key_size == 0) {
+    // Settings from the file that are only read at startup
+    struct config config;
+    bool config_ok = state->config_path == NULL ||
+                     config_read(state->config_path, &config);
+
+    if (state->config_path != NULL && config_ok) {
+      if (config.host != NULL) {
+        free(state->http_host);
+        state->http_host = strdup(config.host);
+      }
+
+      if (config.port >= 0)
+        state->http_port = config.port;
+
+      if (config.workers > 0)
+        state->workers = config.workers;
+
+      if (config.cache_location != NULL)
+        session_config.cache_location = strdup(config.cache_location);
+
+      if (config.settings_location != NULL)
+        session_config.settings_location = strdup(config.settings_location);
+
+      if (config.preload != NULL)
+        state->preload_path = strdup(config.preload);
+
+      if (config.hot_playlists != NULL)
+        state->hot_playlists_path = strdup(config.hot_playlists);
+
+      if (config.compress_playlists >= 0)
+        session_config.compress_playlists = config.compress_playlists;
+
+      if (config.initially_unload_playlists >= 0)
+        session_config.initially_unload_playlists =
+            config.initially_unload_playlists;
+    }
+
+    // Bind Unix domain sockets before forking so that workers share them
+    if (num_shards > 0 && state->num_listen_addresses > 0)
+      syslog(LOG_WARNING, "Ignoring --listen with --shard");
+
+    for (int i = 0;
+         i < state->num_listen_addresses && listen_ok && num_shards == 0;
+         i++) {
+      struct listen_address *listen_address = &state->listen_addresses[i];
+
+      if (listen_address->path != NULL && !listener_bind_unix(listen_address)) {
+        syslog(LOG_CRIT, "Unable to listen on unix:%s: %m",
+               listen_address->path);
+        listen_ok = false;
+      }
+    }
+
+    // Workers bind with SO_REUSEPORT so a new set can start next to the old
+    if (state->handoff_path != NULL && (state->workers > 1 || num_shards > 0)) {
+      syslog(LOG_WARNING, "Ignoring --handoff with --workers or --shard");
+      free(state->handoff_path);
+      state->handoff_path = NULL;
+    }
+
+    // Each worker gets its own session, with its own cache and settings
+    bool supervisor = false;
+
+    if (state->workers > 1 && num_shards == 0 && config_ok && listen_ok) {
+      state->shared_cache = shared_cache_new(kSharedCacheSlots,
+                                             kSharedCacheSlotSize);
+      state->worker = supervise_workers(state->workers,
+                                        state->config_path != NULL);
+      supervisor = state->worker == -1;
+
+      if (!supervisor) {
+        event_reinit(state->event_base);
+        session_config.cache_location = worker_path(
+            session_config.cache_location, "/worker-", state->worker);
+
+        if (session_config.settings_location != NULL)
+          session_config.settings_location = worker_path(
+              session_config.settings_location, "/worker-", state->worker);
+
+        if (state->journal_path != NULL)
+          state->journal_path = worker_path(state->journal_path, ".",
+                                            state->worker);
+
+        if (state->hot_playlists_path != NULL)
+          state->hot_playlists_path = worker_path(state->hot_playlists_path,
+                                                  ".", state->worker);
+      }
+    }
+
+    state->cache = cache_new(state->pool, state->cache_entries);
+    state->listing_cache = listing_cache_new(kListingCacheEntries);
+    state->availability = availability_cache_new(state->pool,
+                                                 kAvailabilityEntries,
+                                                 kAvailabilityTtl);
+    state->metadata_waits = metadata_waits_new(state->event_base);
+    state->track_cache = track_cache_new(state->pool, kTrackCacheEntries,
+                                         state->metadata_waits);
+    state->idempotency = idempotency_table_new(state->pool,
+                                               state->idempotency_keys);
+    state->jobs = jobs_new(state->event_base, state->pool, kJobsPerPlaylist,
+                           kFinishedJobs);
+
+    if (state->journal_path != NULL && !supervisor)
+      state->journal = journal_open(state->journal_path, state->event_base);
+
+    if (state->hot_playlists_path != NULL && !supervisor)
+      state->traffic = playlist_traffic_new(state->pool, kHotPlaylistsTracked);
+
+    if (state->config_path != NULL && config_ok) {
+      apply_config(state, &config);
+      config_free(&config);
+    }
+
+    if (!config_ok) {
+      syslog(LOG_CRIT, "Unable to read configuration file %s",
+             state->config_path);
+    } else if (!listen_ok) {
+      // Already reported
+    } else if (supervisor) {
+      for (int i = 0; i < state->num_listen_addresses; i++) {
+        if (state->listen_addresses[i].path != NULL)
+          listener_unlink_unix(&state->listen_addresses[i]);
+      }
+
+      state->exit_status = EXIT_SUCCESS;
+    } else if (num_shards > 0) {
+      struct router *router = router_new(state->event_base, state->http_host,
+                                         state->http_port, shards, num_shards);
+
+      if (router != NULL) {
+        event_base_dispatch(state->event_base);
+        router_free(router);
+      }
+    } else if (session_config.application_key_size == 0) {
       fprintf(stderr, "You didn't specify a path to your application key (use"
                       " -A/--application-key).\n");
+    } else if (state->journal_path != NULL && state->journal == NULL) {
+      syslog(LOG_CRIT, "Unable to open journal %s: %m", state->journal_path);
     } else {
       sp_session *session;
       sp_error session_create_error = sp_session_create(&session_config,
@@ -199,6 +637,8 @@ int main(int argc, char **argv) {
       if (session_create_error != SP_ERROR_OK) {
         syslog(LOG_CRIT, "Error creating Spotify session: %s",
                sp_error_message(session_create_error));
+      } else if (!http_listen(state)) {
+        sp_session_release(session);
       } else {
         // Log in to Spotify
         if (relogin) {
@@ -208,6 +648,9 @@ int main(int argc, char **argv) {
                            credentials_blob);
         }
 
+        if (state->config_path != NULL)
+          evsignal_add(state->sighup, NULL);
+
         event_base_dispatch(state->event_base);
       }
     }
@@ -217,13 +660,28 @@ int main(int argc, char **argv) {
     if (username != NULL) free(username);
     if (password != NULL) free(password);
     if (credentials_blob != NULL) free(credentials_blob);
+
+    for (int i = 0; i < num_shards; i++)
+      free(shards[i]);
+
+    free(shards);
   }
 
   event_free(state->async);
   event_free(state->timer);
   event_free(state->sigint);
+  event_free(state->sigterm);
+  event_free(state->sighup);
   if (state->http != NULL) evhttp_free(state->http);
   free(state->http_host);
+  free(state->config_path);
+
+  for (int i = 0; i < state->num_listen_addresses; i++) {
+    free(state->listen_addresses[i].host);
+    free(state->listen_addresses[i].path);
+  }
+
+  free(state->listen_addresses);
   event_base_free(state->event_base);
   int exit_status = state->exit_status;
   free(state);
@@ -0,0 +1,132 @@
+#include <event2/event.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/queue.h>
+
+#include "metadata.h"
+
+bool track_metadata_is_loaded(sp_track *track) {
+  if (!sp_track_is_loaded(track))
+    return false;
+
+  sp_album *album = sp_track_album(track);
+
+  if (album != NULL && !sp_album_is_loaded(album))
+    return false;
+
+  for (int i = 0; i < sp_track_num_artists(track); i++) {
+    sp_artist *artist = sp_track_artist(track, i);
+
+    if (artist != NULL && !sp_artist_is_loaded(artist))
+      return false;
+  }
+
+  return true;
+}
+
+static void wait_finish(struct metadata_wait *wait, bool complete) {
+  TAILQ_REMOVE(&wait->waits->waits, wait, entries);
+  event_free(wait->deadline);
+
+  for (int i = 0; i < wait->num_pending; i++)
+    sp_track_release(wait->pending[i]);
+
+  free(wait->pending);
+  wait->callback(complete, wait->userdata);
+  free(wait);
+}
+
+static void wait_deadline(evutil_socket_t socket, short what, void *userdata) {
+  wait_finish(userdata, false);
+}
+
+// Drops loaded tracks from the pending set. Returns true when none are left.
+static bool wait_count_down(struct metadata_wait *wait) {
+  for (int i = 0; i < wait->num_pending; ) {
+    if (track_metadata_is_loaded(wait->pending[i])) {
+      sp_track_release(wait->pending[i]);
+      wait->pending[i] = wait->pending[--wait->num_pending];
+    } else {
+      i++;
+    }
+  }
+
+  return wait->num_pending == 0;
+}
+
+struct metadata_waits *metadata_waits_new(struct event_base *event_base) {
+  struct metadata_waits *waits = malloc(sizeof(struct metadata_waits));
+
+  if (waits == NULL)
+    return NULL;
+
+  waits->event_base = event_base;
+  TAILQ_INIT(&waits->waits);
+  return waits;
+}
+
+void metadata_waits_free(struct metadata_waits *waits) {
+  while (!TAILQ_EMPTY(&waits->waits))
+    wait_finish(TAILQ_FIRST(&waits->waits), false);
+
+  free(waits);
+}
+
+struct metadata_wait *metadata_wait_tracks(struct metadata_waits *waits,
+                                           sp_track *const *tracks,
+                                           int num_tracks,
+                                           const struct timeval *timeout,
+                                           metadata_loaded_fn callback,
+                                           void *userdata) {
+  struct metadata_wait *wait = malloc(sizeof(struct metadata_wait));
+
+  if (wait == NULL) {
+    callback(false, userdata);
+    return NULL;
+  }
+
+  wait->pending = calloc(num_tracks > 0 ? num_tracks : 1, sizeof(sp_track *));
+  wait->num_pending = 0;
+
+  if (wait->pending == NULL) {
+    free(wait);
+    callback(false, userdata);
+    return NULL;
+  }
+
+  for (int i = 0; i < num_tracks; i++) {
+    if (!track_metadata_is_loaded(tracks[i])) {
+      sp_track_add_ref(tracks[i]);
+      wait->pending[wait->num_pending++] = tracks[i];
+    }
+  }
+
+  if (wait->num_pending == 0) {
+    free(wait->pending);
+    free(wait);
+    callback(true, userdata);
+    return NULL;
+  }
+
+  wait->waits = waits;
+  wait->callback = callback;
+  wait->userdata = userdata;
+  wait->deadline = evtimer_new(waits->event_base, &wait_deadline, wait);
+  evtimer_add(wait->deadline, timeout);
+  TAILQ_INSERT_TAIL(&waits->waits, wait, entries);
+  return wait;
+}
+
+void metadata_waits_updated(struct metadata_waits *waits) {
+  struct metadata_wait *wait, *next;
+
+  // Callbacks may start new waits; those go to the tail and are checked too,
+  // which is harmless
+  for (wait = TAILQ_FIRST(&waits->waits); wait != NULL; wait = next) {
+    next = TAILQ_NEXT(wait, entries);
+
+    if (wait_count_down(wait))
+      wait_finish(wait, true);
+  }
+}
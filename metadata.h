@@ -0,0 +1,53 @@
+#ifndef METADATA_H_
+#define METADATA_H_
+
+#include <event2/event.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+
+// Called when all tracks of a wait have their metadata (`complete` is true)
+// or when its deadline passed first (`complete` is false)
+typedef void (*metadata_loaded_fn)(bool complete, void *userdata);
+
+// Tracks that some request is waiting for metadata on. Rather than polling
+// each track, the tracks still missing metadata are counted down every time
+// the session reports that metadata was updated.
+struct metadata_wait {
+  struct metadata_waits *waits;
+  sp_track **pending;
+  int num_pending;
+  struct event *deadline;
+  metadata_loaded_fn callback;
+  void *userdata;
+  TAILQ_ENTRY(metadata_wait) entries;
+};
+
+TAILQ_HEAD(metadata_wait_list, metadata_wait);
+
+struct metadata_waits {
+  struct event_base *event_base;
+  struct metadata_wait_list waits;
+};
+
+struct metadata_waits *metadata_waits_new(struct event_base *event_base);
+
+// Calls back every outstanding wait as incomplete and frees them
+void metadata_waits_free(struct metadata_waits *waits);
+
+// True if the track, its album and its artists are all loaded
+bool track_metadata_is_loaded(sp_track *track);
+
+// Waits for metadata on all tracks together. If all of them are loaded
+// already, the callback is called right away and NULL is returned.
+struct metadata_wait *metadata_wait_tracks(struct metadata_waits *waits,
+                                           sp_track *const *tracks,
+                                           int num_tracks,
+                                           const struct timeval *timeout,
+                                           metadata_loaded_fn callback,
+                                           void *userdata);
+
+// To be called from the session's `metadata_updated` callback
+void metadata_waits_updated(struct metadata_waits *waits);
+
+#endif
@@ -0,0 +1,472 @@
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msgpack.h"
+#include "track_id.h"
+
+// Deepest nesting accepted when unpacking
+#define MAX_DEPTH 64
+
+static void pack_byte(struct evbuffer *buf, uint8_t byte) {
+  evbuffer_add(buf, &byte, 1);
+}
+
+// Type byte followed by a big-endian number of `size` bytes
+static void pack_number(struct evbuffer *buf,
+                        uint8_t type,
+                        uint64_t value,
+                        int size) {
+  uint8_t bytes[9];
+  bytes[0] = type;
+
+  for (int i = 0; i < size; i++)
+    bytes[size - i] = (value >> (8 * i)) & 0xff;
+
+  evbuffer_add(buf, bytes, size + 1);
+}
+
+static void pack_integer(struct evbuffer *buf, json_int_t value) {
+  if (value >= 0) {
+    if (value < 0x80)
+      pack_byte(buf, value);
+    else if (value <= UINT8_MAX)
+      pack_number(buf, 0xcc, value, 1);
+    else if (value <= UINT16_MAX)
+      pack_number(buf, 0xcd, value, 2);
+    else if (value <= UINT32_MAX)
+      pack_number(buf, 0xce, value, 4);
+    else
+      pack_number(buf, 0xcf, value, 8);
+  } else {
+    if (value >= -32)
+      pack_byte(buf, value & 0xff);
+    else if (value >= INT8_MIN)
+      pack_number(buf, 0xd0, value & 0xff, 1);
+    else if (value >= INT16_MIN)
+      pack_number(buf, 0xd1, value & 0xffff, 2);
+    else if (value >= INT32_MIN)
+      pack_number(buf, 0xd2, value & 0xffffffff, 4);
+    else
+      pack_number(buf, 0xd3, value, 8);
+  }
+}
+
+static void pack_real(struct evbuffer *buf, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  pack_number(buf, 0xcb, bits, 8);
+}
+
+// Header for strings, bins, arrays and maps: `fix` is the fixed-size type
+// byte (or 0 if there is none) holding up to `fix_max` items
+static void pack_header(struct evbuffer *buf,
+                        size_t size,
+                        uint8_t fix,
+                        size_t fix_max,
+                        uint8_t type8,
+                        uint8_t type16,
+                        uint8_t type32) {
+  if (fix != 0 && size <= fix_max)
+    pack_byte(buf, fix | size);
+  else if (type8 != 0 && size <= UINT8_MAX)
+    pack_number(buf, type8, size, 1);
+  else if (size <= UINT16_MAX)
+    pack_number(buf, type16, size, 2);
+  else
+    pack_number(buf, type32, size, 4);
+}
+
+static void pack_string(struct evbuffer *buf, const char *str, size_t len) {
+  pack_header(buf, len, 0xa0, 31, 0xd9, 0xda, 0xdb);
+  evbuffer_add(buf, str, len);
+}
+
+// Packs an array of track URIs as a bin of IDs, if that's what it is
+static bool pack_tracks_compact(struct evbuffer *buf, json_t *array) {
+  size_t num_tracks = json_array_size(array);
+
+  for (size_t i = 0; i < num_tracks; i++) {
+    json_t *item = json_array_get(array, i);
+
+    if (!json_is_string(item) ||
+        strlen(json_string_value(item)) != TRACK_URI_LENGTH)
+      return false;
+  }
+
+  struct evbuffer *ids = evbuffer_new();
+
+  for (size_t i = 0; i < num_tracks; i++) {
+    unsigned char id[TRACK_ID_SIZE];
+
+    if (!track_id_from_uri(json_string_value(json_array_get(array, i)), id)) {
+      evbuffer_free(ids);
+      return false;
+    }
+
+    evbuffer_add(ids, id, TRACK_ID_SIZE);
+  }
+
+  pack_header(buf, evbuffer_get_length(ids), 0, 0, 0xc4, 0xc5, 0xc6);
+  evbuffer_add_buffer(buf, ids);
+  evbuffer_free(ids);
+  return true;
+}
+
+static int pack(json_t *json, struct evbuffer *buf, int flags) {
+  switch (json_typeof(json)) {
+    case JSON_OBJECT:
+      {
+        pack_header(buf, json_object_size(json), 0x80, 15, 0, 0xde, 0xdf);
+
+        for (void *iter = json_object_iter(json);
+             iter != NULL;
+             iter = json_object_iter_next(json, iter)) {
+          const char *key = json_object_iter_key(iter);
+          json_t *value = json_object_iter_value(iter);
+          pack_string(buf, key, strlen(key));
+
+          if ((flags & MSGPACK_COMPACT_TRACKS) && json_is_array(value) &&
+              strcmp(key, "tracks") == 0 && pack_tracks_compact(buf, value))
+            continue;
+
+          if (pack(value, buf, flags) != 0)
+            return -1;
+        }
+      }
+      return 0;
+
+    case JSON_ARRAY:
+      {
+        size_t size = json_array_size(json);
+        pack_header(buf, size, 0x90, 15, 0, 0xdc, 0xdd);
+
+        for (size_t i = 0; i < size; i++) {
+          if (pack(json_array_get(json, i), buf, flags) != 0)
+            return -1;
+        }
+      }
+      return 0;
+
+    case JSON_STRING:
+      {
+        const char *str = json_string_value(json);
+        pack_string(buf, str, strlen(str));
+      }
+      return 0;
+
+    case JSON_INTEGER:
+      pack_integer(buf, json_integer_value(json));
+      return 0;
+
+    case JSON_REAL:
+      pack_real(buf, json_real_value(json));
+      return 0;
+
+    case JSON_TRUE:
+      pack_byte(buf, 0xc3);
+      return 0;
+
+    case JSON_FALSE:
+      pack_byte(buf, 0xc2);
+      return 0;
+
+    case JSON_NULL:
+      pack_byte(buf, 0xc0);
+      return 0;
+  }
+
+  return -1;
+}
+
+int msgpack_pack_json(json_t *json, struct evbuffer *buf, int flags) {
+  return pack(json, buf, flags);
+}
+
+void msgpack_pack_map_header(struct evbuffer *buf, size_t size) {
+  pack_header(buf, size, 0x80, 15, 0, 0xde, 0xdf);
+}
+
+void msgpack_pack_array_header(struct evbuffer *buf, size_t size) {
+  pack_header(buf, size, 0x90, 15, 0, 0xdc, 0xdd);
+}
+
+void msgpack_pack_string(struct evbuffer *buf, const char *str) {
+  pack_string(buf, str, strlen(str));
+}
+
+// Unpacking
+
+struct reader {
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+  const char *error;
+};
+
+static bool read_number(struct reader *reader, int size, uint64_t *value) {
+  if (reader->len - reader->pos < (size_t) size) {
+    reader->error = "Truncated MessagePack";
+    return false;
+  }
+
+  *value = 0;
+
+  for (int i = 0; i < size; i++)
+    *value = (*value << 8) | reader->data[reader->pos++];
+
+  return true;
+}
+
+static const unsigned char *read_bytes(struct reader *reader, size_t size) {
+  if (reader->len - reader->pos < size) {
+    reader->error = "Truncated MessagePack";
+    return NULL;
+  }
+
+  const unsigned char *bytes = reader->data + reader->pos;
+  reader->pos += size;
+  return bytes;
+}
+
+static json_t *unpack(struct reader *reader, int depth);
+
+static json_t *unpack_string(struct reader *reader, size_t size) {
+  const unsigned char *bytes = read_bytes(reader, size);
+
+  if (bytes == NULL)
+    return NULL;
+
+  char *str = malloc(size + 1);
+
+  if (str == NULL) {
+    reader->error = "Out of memory";
+    return NULL;
+  }
+
+  memcpy(str, bytes, size);
+  str[size] = '\0';
+  json_t *json = json_string(str);
+  free(str);
+
+  if (json == NULL)
+    reader->error = "Invalid UTF-8 in MessagePack string";
+
+  return json;
+}
+
+static json_t *unpack_tracks(struct reader *reader, size_t size) {
+  const unsigned char *ids = read_bytes(reader, size);
+
+  if (ids == NULL)
+    return NULL;
+
+  if (size % TRACK_ID_SIZE != 0) {
+    reader->error = "bin is not a list of 16 byte track IDs";
+    return NULL;
+  }
+
+  json_t *array = json_array();
+  char uri[TRACK_URI_LENGTH + 1];
+
+  for (size_t i = 0; i < size; i += TRACK_ID_SIZE) {
+    track_id_to_uri(ids + i, uri);
+    json_array_append_new(array, json_string_nocheck(uri));
+  }
+
+  return array;
+}
+
+static json_t *unpack_array(struct reader *reader, size_t size, int depth) {
+  json_t *array = json_array();
+
+  for (size_t i = 0; i < size; i++) {
+    json_t *item = unpack(reader, depth + 1);
+
+    if (item == NULL) {
+      json_decref(array);
+      return NULL;
+    }
+
+    json_array_append_new(array, item);
+  }
+
+  return array;
+}
+
+static json_t *unpack_map(struct reader *reader, size_t size, int depth) {
+  json_t *object = json_object();
+
+  for (size_t i = 0; i < size; i++) {
+    json_t *key = unpack(reader, depth + 1);
+
+    if (key == NULL || !json_is_string(key)) {
+      if (key != NULL) {
+        json_decref(key);
+        reader->error = "MessagePack map keys must be strings";
+      }
+
+      json_decref(object);
+      return NULL;
+    }
+
+    json_t *value = unpack(reader, depth + 1);
+
+    if (value == NULL) {
+      json_decref(key);
+      json_decref(object);
+      return NULL;
+    }
+
+    json_object_set_new(object, json_string_value(key), value);
+    json_decref(key);
+  }
+
+  return object;
+}
+
+static json_t *unpack(struct reader *reader, int depth) {
+  uint64_t value;
+
+  if (depth > MAX_DEPTH) {
+    reader->error = "MessagePack nested too deeply";
+    return NULL;
+  }
+
+  if (!read_number(reader, 1, &value))
+    return NULL;
+
+  uint8_t type = value;
+
+  if (type <= 0x7f)
+    return json_integer(type);
+
+  if (type >= 0xe0)
+    return json_integer((int8_t) type);
+
+  if ((type & 0xf0) == 0x80)
+    return unpack_map(reader, type & 0x0f, depth);
+
+  if ((type & 0xf0) == 0x90)
+    return unpack_array(reader, type & 0x0f, depth);
+
+  if ((type & 0xe0) == 0xa0)
+    return unpack_string(reader, type & 0x1f);
+
+  switch (type) {
+    case 0xc0:
+      return json_null();
+
+    case 0xc2:
+      return json_false();
+
+    case 0xc3:
+      return json_true();
+
+    case 0xc4:
+    case 0xc5:
+    case 0xc6:
+      if (!read_number(reader, 1 << (type - 0xc4), &value))
+        return NULL;
+      return unpack_tracks(reader, value);
+
+    case 0xca:
+      {
+        if (!read_number(reader, 4, &value))
+          return NULL;
+
+        uint32_t bits = value;
+        float real;
+        memcpy(&real, &bits, sizeof(real));
+        return json_real(real);
+      }
+
+    case 0xcb:
+      {
+        if (!read_number(reader, 8, &value))
+          return NULL;
+
+        double real;
+        memcpy(&real, &value, sizeof(real));
+        return json_real(real);
+      }
+
+    case 0xcc:
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+      if (!read_number(reader, 1 << (type - 0xcc), &value))
+        return NULL;
+
+      if (value > INT64_MAX) {
+        reader->error = "MessagePack integer out of range";
+        return NULL;
+      }
+
+      return json_integer(value);
+
+    case 0xd0:
+      return read_number(reader, 1, &value) ?
+          json_integer((int8_t) value) : NULL;
+
+    case 0xd1:
+      return read_number(reader, 2, &value) ?
+          json_integer((int16_t) value) : NULL;
+
+    case 0xd2:
+      return read_number(reader, 4, &value) ?
+          json_integer((int32_t) value) : NULL;
+
+    case 0xd3:
+      return read_number(reader, 8, &value) ?
+          json_integer((int64_t) value) : NULL;
+
+    case 0xd9:
+    case 0xda:
+    case 0xdb:
+      if (!read_number(reader, 1 << (type - 0xd9), &value))
+        return NULL;
+      return unpack_string(reader, value);
+
+    case 0xdc:
+    case 0xdd:
+      if (!read_number(reader, type == 0xdc ? 2 : 4, &value))
+        return NULL;
+      return unpack_array(reader, value, depth);
+
+    case 0xde:
+    case 0xdf:
+      if (!read_number(reader, type == 0xde ? 2 : 4, &value))
+        return NULL;
+      return unpack_map(reader, value, depth);
+  }
+
+  reader->error = "Unsupported MessagePack type";
+  return NULL;
+}
+
+json_t *msgpack_unpack_json(const unsigned char *data,
+                            size_t len,
+                            const char **error) {
+  struct reader reader = {
+    .data = data,
+    .len = len,
+    .pos = 0,
+    .error = NULL
+  };
+  json_t *json = unpack(&reader, 0);
+
+  if (json != NULL && reader.pos != len) {
+    json_decref(json);
+    json = NULL;
+    reader.error = "Trailing data after MessagePack document";
+  }
+
+  if (json == NULL)
+    *error = reader.error != NULL ? reader.error : "Invalid MessagePack";
+
+  return json;
+}
@@ -0,0 +1,30 @@
+#ifndef MSGPACK_H_
+#define MSGPACK_H_
+
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <stddef.h>
+
+// Pack arrays of track URIs found under a "tracks" key as a single bin of
+// 16 byte track IDs instead of 36 character strings
+#define MSGPACK_COMPACT_TRACKS 0x1
+
+// Writes JSON as MessagePack. Returns 0 on success, -1 on error.
+int msgpack_pack_json(json_t *json, struct evbuffer *buf, int flags);
+
+// For writing a document piece by piece: a map or array header is followed
+// by `size` keys and values or items, each packed separately
+void msgpack_pack_map_header(struct evbuffer *buf, size_t size);
+
+void msgpack_pack_array_header(struct evbuffer *buf, size_t size);
+
+void msgpack_pack_string(struct evbuffer *buf, const char *str);
+
+// Reads a MessagePack document into JSON. bin values are taken to be packed
+// track IDs and are unpacked into arrays of track URIs. Returns NULL and
+// points `error` at a message on malformed input.
+json_t *msgpack_unpack_json(const unsigned char *data,
+                            size_t len,
+                            const char **error);
+
+#endif
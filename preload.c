@@ -0,0 +1,445 @@
+#define _GNU_SOURCE  // strdup
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <event2/event.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <syslog.h>
+
+#include "preload.h"
+
+static const char kUserPrefix[] = "spotify:user:";
+
+struct preload_entry {
+  struct preload *preload;
+  char *uri;
+  sp_playlist *playlist;
+  sp_playlistcontainer *container;
+  struct event *deadline;
+  TAILQ_ENTRY(preload_entry) entries;
+};
+
+TAILQ_HEAD(preload_entry_list, preload_entry);
+
+struct preload {
+  struct event_base *event_base;
+  sp_session *session;
+  int concurrency;
+  int timeout;
+  struct preload_entry_list waiting;
+  struct preload_entry_list loading;
+  struct preload_entry_list done;  // Loaded entries keep their references
+  struct timeval started;
+  struct preload_stats stats;
+};
+
+static void preload_next(struct preload *preload);
+
+// A user's published playlists rather than a playlist
+static bool is_container_uri(const char *uri) {
+  return strncmp(uri, kUserPrefix, sizeof(kUserPrefix) - 1) == 0 &&
+         strstr(uri, ":playlist:") == NULL &&
+         strchr(uri + sizeof(kUserPrefix) - 1, ':') == NULL;
+}
+
+static void playlist_state_changed(sp_playlist *playlist, void *userdata);
+
+static sp_playlist_callbacks preload_playlist_callbacks = {
+  .playlist_state_changed = &playlist_state_changed
+};
+
+static void container_loaded(sp_playlistcontainer *pc, void *userdata);
+
+static sp_playlistcontainer_callbacks preload_container_callbacks = {
+  .container_loaded = &container_loaded
+};
+
+static void entry_release(struct preload_entry *entry) {
+  if (entry->playlist != NULL) {
+    sp_playlist_set_in_ram(entry->preload->session, entry->playlist, false);
+    sp_playlist_release(entry->playlist);
+  }
+
+  if (entry->container != NULL)
+    sp_playlistcontainer_release(entry->container);
+
+  entry->playlist = NULL;
+  entry->container = NULL;
+}
+
+static void entry_free(struct preload_entry *entry) {
+  entry_release(entry);
+
+  if (entry->deadline != NULL)
+    event_free(entry->deadline);
+
+  free(entry->uri);
+  free(entry);
+}
+
+static void entry_finish(struct preload_entry *entry, bool loaded) {
+  struct preload *preload = entry->preload;
+
+  if (entry->playlist != NULL)
+    sp_playlist_remove_callbacks(entry->playlist, &preload_playlist_callbacks,
+                                 entry);
+
+  if (entry->container != NULL)
+    sp_playlistcontainer_remove_callbacks(entry->container,
+                                          &preload_container_callbacks, entry);
+
+  if (entry->deadline != NULL)
+    event_free(entry->deadline);
+
+  entry->deadline = NULL;
+  TAILQ_REMOVE(&preload->loading, entry, entries);
+  preload->stats.loading--;
+
+  if (loaded) {
+    preload->stats.loaded++;
+    TAILQ_INSERT_TAIL(&preload->done, entry, entries);
+  } else {
+    syslog(LOG_DEBUG, "Could not preload %s", entry->uri);
+    preload->stats.failed++;
+    entry_free(entry);
+  }
+
+  preload_next(preload);
+}
+
+static void playlist_state_changed(sp_playlist *playlist, void *userdata) {
+  if (sp_playlist_is_loaded(playlist))
+    entry_finish(userdata, true);
+}
+
+static void container_loaded(sp_playlistcontainer *pc, void *userdata) {
+  entry_finish(userdata, true);
+}
+
+static void entry_expired(evutil_socket_t socket, short what, void *userdata) {
+  entry_finish(userdata, false);
+}
+
+// Asks libspotify for an entry. Returns true if it's loaded already.
+static bool entry_begin(struct preload_entry *entry) {
+  struct preload *preload = entry->preload;
+
+  if (is_container_uri(entry->uri)) {
+    entry->container = sp_session_publishedcontainer_for_user_create(
+        preload->session, entry->uri + sizeof(kUserPrefix) - 1);
+
+    if (entry->container == NULL)
+      return false;
+
+    if (sp_playlistcontainer_is_loaded(entry->container))
+      return true;
+
+    sp_playlistcontainer_add_callbacks(entry->container,
+                                       &preload_container_callbacks, entry);
+    return false;
+  }
+
+  sp_link *link = sp_link_create_from_string(entry->uri);
+
+  if (link == NULL)
+    return false;
+
+  if (sp_link_type(link) == SP_LINKTYPE_PLAYLIST)
+    entry->playlist = sp_playlist_create(preload->session, link);
+
+  sp_link_release(link);
+
+  // sp_playlist_create() returned a reference, released in entry_release()
+  if (entry->playlist == NULL)
+    return false;
+
+  sp_playlist_set_in_ram(preload->session, entry->playlist, true);
+
+  if (sp_playlist_is_loaded(entry->playlist))
+    return true;
+
+  sp_playlist_add_callbacks(entry->playlist, &preload_playlist_callbacks,
+                            entry);
+  return false;
+}
+
+static void preload_next(struct preload *preload) {
+  while (preload->stats.loading < preload->concurrency &&
+         !TAILQ_EMPTY(&preload->waiting)) {
+    struct preload_entry *entry = TAILQ_FIRST(&preload->waiting);
+    TAILQ_REMOVE(&preload->waiting, entry, entries);
+    TAILQ_INSERT_TAIL(&preload->loading, entry, entries);
+    preload->stats.loading++;
+
+    // A failed entry is finished right away, which starts the next one
+    if (entry_begin(entry)) {
+      entry_finish(entry, true);
+      return;
+    }
+
+    if (entry->playlist == NULL && entry->container == NULL) {
+      entry_finish(entry, false);
+      return;
+    }
+
+    entry->deadline = evtimer_new(preload->event_base, &entry_expired, entry);
+
+    if (entry->deadline != NULL) {
+      struct timeval timeout = {preload->timeout, 0};
+      evtimer_add(entry->deadline, &timeout);
+    }
+  }
+
+  if (preload->stats.loading == 0 && TAILQ_EMPTY(&preload->waiting) &&
+      preload->stats.total > 0) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    syslog(LOG_INFO, "Preloaded %d of %d playlists and containers in %.3f s",
+           preload->stats.loaded, preload->stats.total,
+           (now.tv_sec - preload->started.tv_sec) +
+           (now.tv_usec - preload->started.tv_usec) / 1e6);
+  }
+}
+
+struct preload *preload_new(struct event_base *event_base,
+                            sp_session *session,
+                            int concurrency,
+                            int timeout) {
+  struct preload *preload = calloc(1, sizeof(struct preload));
+
+  if (preload == NULL)
+    return NULL;
+
+  preload->event_base = event_base;
+  preload->session = session;
+  preload->concurrency = concurrency;
+  preload->timeout = timeout;
+  TAILQ_INIT(&preload->waiting);
+  TAILQ_INIT(&preload->loading);
+  TAILQ_INIT(&preload->done);
+  return preload;
+}
+
+static bool preload_contains(struct preload *preload, const char *uri) {
+  struct preload_entry *entry;
+
+  TAILQ_FOREACH(entry, &preload->waiting, entries) {
+    if (strcmp(entry->uri, uri) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+bool preload_read(struct preload *preload, const char *path) {
+  FILE *file = fopen(path, "r");
+
+  if (file == NULL)
+    return false;
+
+  char line[256];
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, " \t\r\n")] = '\0';
+
+    if (line[0] == '\0' || line[0] == '#' || preload_contains(preload, line))
+      continue;
+
+    struct preload_entry *entry = calloc(1, sizeof(struct preload_entry));
+
+    if (entry == NULL)
+      break;
+
+    entry->preload = preload;
+    entry->uri = strdup(line);
+
+    if (entry->uri == NULL) {
+      free(entry);
+      break;
+    }
+
+    TAILQ_INSERT_TAIL(&preload->waiting, entry, entries);
+    preload->stats.total++;
+  }
+
+  fclose(file);
+  return true;
+}
+
+void preload_start(struct preload *preload) {
+  gettimeofday(&preload->started, NULL);
+  preload_next(preload);
+}
+
+void preload_get_stats(struct preload *preload, struct preload_stats *stats) {
+  *stats = preload->stats;
+}
+
+void preload_free(struct preload *preload) {
+  // Nothing more is started while the waiting list is empty
+  while (!TAILQ_EMPTY(&preload->waiting)) {
+    struct preload_entry *entry = TAILQ_FIRST(&preload->waiting);
+    TAILQ_REMOVE(&preload->waiting, entry, entries);
+    entry_free(entry);
+  }
+
+  while (!TAILQ_EMPTY(&preload->loading))
+    entry_finish(TAILQ_FIRST(&preload->loading), false);
+
+  while (!TAILQ_EMPTY(&preload->done)) {
+    struct preload_entry *entry = TAILQ_FIRST(&preload->done);
+    TAILQ_REMOVE(&preload->done, entry, entries);
+    entry_free(entry);
+  }
+
+  free(preload);
+}
+
+struct playlist_traffic_entry {
+  char *uri;
+  unsigned long hits;
+};
+
+struct playlist_traffic {
+  apr_hash_t *entries;  // uri -> struct playlist_traffic_entry *
+  int num_entries;
+  int max_entries;
+};
+
+struct playlist_traffic *playlist_traffic_new(apr_pool_t *pool,
+                                              int max_playlists) {
+  struct playlist_traffic *traffic = malloc(sizeof(struct playlist_traffic));
+
+  if (traffic == NULL)
+    return NULL;
+
+  traffic->entries = apr_hash_make(pool);
+  traffic->num_entries = 0;
+  traffic->max_entries = max_playlists;
+  return traffic;
+}
+
+// Halves every count and forgets playlists that are down to zero
+static void traffic_decay(struct playlist_traffic *traffic) {
+  for (apr_hash_index_t *index = apr_hash_first(NULL, traffic->entries);
+       index != NULL;
+       index = apr_hash_next(index)) {
+    void *value;
+    apr_hash_this(index, NULL, NULL, &value);
+    struct playlist_traffic_entry *entry = value;
+    entry->hits /= 2;
+
+    if (entry->hits == 0) {
+      apr_hash_set(traffic->entries, entry->uri, APR_HASH_KEY_STRING, NULL);
+      traffic->num_entries--;
+      free(entry->uri);
+      free(entry);
+    }
+  }
+}
+
+void playlist_traffic_hit(struct playlist_traffic *traffic, const char *uri) {
+  struct playlist_traffic_entry *entry = apr_hash_get(
+      traffic->entries, uri, APR_HASH_KEY_STRING);
+
+  if (entry != NULL) {
+    entry->hits++;
+    return;
+  }
+
+  if (traffic->num_entries >= traffic->max_entries)
+    traffic_decay(traffic);
+
+  if (traffic->num_entries >= traffic->max_entries)
+    return;
+
+  entry = malloc(sizeof(struct playlist_traffic_entry));
+
+  if (entry == NULL)
+    return;
+
+  entry->uri = strdup(uri);
+
+  if (entry->uri == NULL) {
+    free(entry);
+    return;
+  }
+
+  entry->hits = 1;
+  apr_hash_set(traffic->entries, entry->uri, APR_HASH_KEY_STRING, entry);
+  traffic->num_entries++;
+}
+
+static int compare_hits(const void *a, const void *b) {
+  const struct playlist_traffic_entry *x =
+      *(struct playlist_traffic_entry *const *) a;
+  const struct playlist_traffic_entry *y =
+      *(struct playlist_traffic_entry *const *) b;
+  return x->hits < y->hits ? 1 : x->hits > y->hits ? -1 : 0;
+}
+
+bool playlist_traffic_write(struct playlist_traffic *traffic,
+                            const char *path,
+                            int top) {
+  struct playlist_traffic_entry **entries = malloc(
+      (traffic->num_entries + 1) * sizeof(struct playlist_traffic_entry *));
+
+  if (entries == NULL)
+    return false;
+
+  int num_entries = 0;
+
+  for (apr_hash_index_t *index = apr_hash_first(NULL, traffic->entries);
+       index != NULL;
+       index = apr_hash_next(index)) {
+    void *value;
+    apr_hash_this(index, NULL, NULL, &value);
+    entries[num_entries++] = value;
+  }
+
+  qsort(entries, num_entries, sizeof(struct playlist_traffic_entry *),
+        &compare_hits);
+
+  // Replace the file in one go so that a crash leaves the old one
+  char tmp_path[1024];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  FILE *file = fopen(tmp_path, "w");
+
+  if (file == NULL) {
+    free(entries);
+    return false;
+  }
+
+  fprintf(file, "# Most requested playlists, written on shutdown\n");
+
+  for (int i = 0; i < num_entries && i < top; i++)
+    fprintf(file, "%s\n", entries[i]->uri);
+
+  free(entries);
+  bool ok = fclose(file) == 0 && rename(tmp_path, path) == 0;
+
+  if (!ok)
+    remove(tmp_path);
+
+  return ok;
+}
+
+void playlist_traffic_free(struct playlist_traffic *traffic) {
+  for (apr_hash_index_t *index = apr_hash_first(NULL, traffic->entries);
+       index != NULL;
+       index = apr_hash_next(index)) {
+    void *value;
+    apr_hash_this(index, NULL, NULL, &value);
+    struct playlist_traffic_entry *entry = value;
+    free(entry->uri);
+    free(entry);
+  }
+
+  free(traffic);
+}
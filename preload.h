@@ -0,0 +1,63 @@
+#ifndef PRELOAD_H_
+#define PRELOAD_H_
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <event2/event.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+
+// Loads hot playlists and playlist containers right after logging in, so
+// that the first requests for them don't pay the load time. A few load at a
+// time and the rest wait their turn. Loaded playlists are kept in RAM until
+// the preload is freed.
+struct preload;
+
+struct preload_stats {
+  int total;
+  int loading;
+  int loaded;
+  int failed;
+};
+
+// Loads at most `concurrency` entries at once and gives up on each after
+// `timeout` seconds
+struct preload *preload_new(struct event_base *event_base,
+                            sp_session *session,
+                            int concurrency,
+                            int timeout);
+
+// Adds the entries of a file: one URI per line, either a playlist or
+// spotify:user:<name> for a user's published playlists. Blank lines and
+// lines starting with '#' are skipped, as are URIs already added. Returns
+// false if the file can't be read.
+bool preload_read(struct preload *preload, const char *path);
+
+// Starts loading. Entries added afterwards aren't loaded.
+void preload_start(struct preload *preload);
+
+void preload_get_stats(struct preload *preload, struct preload_stats *stats);
+
+// Stops loading and releases everything that was loaded
+void preload_free(struct preload *preload);
+
+// Counts requests per playlist, so that the most requested ones can be
+// preloaded after the next restart. When more than `max_playlists` are
+// counted, all counts are halved and playlists down to zero are forgotten,
+// so recent traffic weighs the most.
+struct playlist_traffic;
+
+struct playlist_traffic *playlist_traffic_new(apr_pool_t *pool,
+                                              int max_playlists);
+
+void playlist_traffic_hit(struct playlist_traffic *traffic, const char *uri);
+
+// Writes the `top` most requested playlists to a file preload_read() reads
+// back, most requested first. Returns false if it can't be written.
+bool playlist_traffic_write(struct playlist_traffic *traffic,
+                            const char *path,
+                            int top);
+
+void playlist_traffic_free(struct playlist_traffic *traffic);
+
+#endif
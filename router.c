@@ -0,0 +1,511 @@
+#define _GNU_SOURCE  // strdup, strndup
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <jansson.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/queue.h>
+#include <syslog.h>
+
+#include "constants.h"
+#include "msgpack.h"
+#include "router.h"
+
+#define HTTP_BADGATEWAY 502
+
+// A request waiting for a shard to answer it
+struct proxy_request {
+  struct shard *shard;
+  struct evhttp_request *request;
+  bool job;  // GET /jobs/<id>, whose reply gets the shard put into its "id"
+};
+
+// Headers that describe a connection rather than the request or reply.
+// libevent sets Content-Length itself.
+static bool is_hop_by_hop_header(const char *key) {
+  static const char *const headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Authenticate", "Proxy-Authorization",
+    "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Host", "Content-Length"
+  };
+
+  for (size_t i = 0; i < sizeof(headers) / sizeof(headers[0]); i++) {
+    if (strcasecmp(key, headers[i]) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+static int shard_index(struct shard *shard) {
+  return shard - shard->router->shards;
+}
+
+// Will wrap an error message in a JSON object before sending it
+static void send_error(struct evhttp_request *request,
+                       int code,
+                       const char *message) {
+  json_t *error_object = json_object();
+  json_object_set_new(error_object, "message", json_string(message));
+  char *body = json_dumps(error_object, JSON_COMPACT);
+  json_decref(error_object);
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+
+  if (body != NULL)
+    evbuffer_add(buf, body, strlen(body));
+
+  free(body);
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Content-type", "application/json");
+  evhttp_send_reply(request, code, message, buf);
+}
+
+static void rebuild_ring(struct router *router) {
+  const char *names[router->num_shards];
+  bool healthy[router->num_shards];
+
+  for (int i = 0; i < router->num_shards; i++) {
+    names[i] = router->shards[i].name;
+    healthy[i] = router->shards[i].healthy;
+  }
+
+  if (!hash_ring_build(&router->ring, names, healthy, router->num_shards,
+                       kShardReplicas))
+    syslog(LOG_WARNING, "Out of memory rebuilding the shard ring");
+}
+
+// Shards coming and going move only their own keys on the ring
+static void set_shard_healthy(struct shard *shard, bool healthy) {
+  if (shard->healthy == healthy)
+    return;
+
+  syslog(healthy ? LOG_INFO : LOG_WARNING, "Shard %s is %s", shard->name,
+         healthy ? "up" : "down");
+  shard->healthy = healthy;
+  rebuild_ring(shard->router);
+}
+
+static void health_check_done(struct evhttp_request *reply, void *userdata) {
+  struct shard *shard = userdata;
+  shard->checking = false;
+  set_shard_healthy(shard, reply != NULL &&
+                           evhttp_request_get_response_code(reply) == HTTP_OK);
+}
+
+static void check_health(evutil_socket_t socket, short what, void *userdata) {
+  struct router *router = userdata;
+
+  for (int i = 0; i < router->num_shards; i++) {
+    struct shard *shard = &router->shards[i];
+
+    if (shard->checking)
+      continue;
+
+    struct evhttp_request *check = evhttp_request_new(&health_check_done,
+                                                      shard);
+
+    if (check == NULL)
+      continue;
+
+    evhttp_add_header(evhttp_request_get_output_headers(check), "Host",
+                      shard->name);
+
+    if (evhttp_make_request(shard->health_connection, check, EVHTTP_REQ_GET,
+                            "/readyz") == 0)
+      shard->checking = true;
+    else
+      set_shard_healthy(shard, false);
+  }
+
+  struct timeval interval = {kShardHealthInterval, 0};
+  evtimer_add(router->health_check, &interval);
+}
+
+// Job IDs are only unique per shard. Replaces the "id" of a job in a reply
+// body with <shard>-<id>, as in its URL. Bodies that can't be read, such as
+// compressed ones, are left alone.
+static void rewrite_job_id(struct shard *shard, struct evhttp_request *reply) {
+  struct evkeyvalq *headers = evhttp_request_get_input_headers(reply);
+  const char *type = evhttp_find_header(headers, "Content-type");
+  struct evbuffer *buf = evhttp_request_get_input_buffer(reply);
+  size_t len = evbuffer_get_length(buf);
+
+  if (type == NULL || len == 0 ||
+      evhttp_find_header(headers, "Content-Encoding") != NULL)
+    return;
+
+  bool msgpack = strncasecmp(type, "application/msgpack",
+                             strlen("application/msgpack")) == 0;
+  const char *body = (const char *) evbuffer_pullup(buf, len);
+  const char *error = NULL;
+  json_t *json = msgpack
+      ? msgpack_unpack_json((const unsigned char *) body, len, &error)
+      : json_loadb(body, len, 0, NULL);
+  json_t *id = json_object_get(json, "id");
+
+  if (!json_is_integer(id)) {
+    json_decref(json);
+    return;
+  }
+
+  char shard_id[32];
+  snprintf(shard_id, sizeof(shard_id), "%d-%lld", shard_index(shard),
+           (long long) json_integer_value(id));
+  json_object_set_new(json, "id", json_string(shard_id));
+  struct evbuffer *rewritten = evbuffer_new();
+  bool ok = rewritten != NULL;
+
+  if (ok && msgpack) {
+    int flags = strstr(type, "tracks=binary") != NULL ?
+        MSGPACK_COMPACT_TRACKS : 0;
+    ok = msgpack_pack_json(json, rewritten, flags) == 0;
+  } else if (ok) {
+    char *dumped = json_dumps(json, JSON_COMPACT);
+    ok = dumped != NULL &&
+         evbuffer_add(rewritten, dumped, strlen(dumped)) == 0;
+    free(dumped);
+  }
+
+  if (ok) {
+    evbuffer_drain(buf, len);
+    evbuffer_add_buffer(buf, rewritten);
+  }
+
+  if (rewritten != NULL)
+    evbuffer_free(rewritten);
+
+  json_decref(json);
+}
+
+static void proxy_reply(struct evhttp_request *reply, void *userdata) {
+  struct proxy_request *proxy = userdata;
+  struct shard *shard = proxy->shard;
+  struct evhttp_request *request = proxy->request;
+  bool job = proxy->job;
+  free(proxy);
+
+  if (reply == NULL || evhttp_request_get_response_code(reply) == 0) {
+    shard->failures++;
+    set_shard_healthy(shard, false);
+    send_error(request, HTTP_BADGATEWAY, "Shard unavailable");
+    return;
+  }
+
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+  struct evkeyval *header;
+
+  TAILQ_FOREACH(header, evhttp_request_get_input_headers(reply), next) {
+    if (is_hop_by_hop_header(header->key))
+      continue;
+
+    // Job IDs are only unique per shard, so the shard goes into the URL.
+    // The reply is the job that was submitted.
+    if (strcasecmp(header->key, "Location") == 0 &&
+        strncmp(header->value, "/jobs/", 6) == 0) {
+      char location[256];
+      snprintf(location, sizeof(location), "/jobs/%d-%s", shard_index(shard),
+               header->value + 6);
+      evhttp_add_header(headers, header->key, location);
+      job = true;
+    } else {
+      evhttp_add_header(headers, header->key, header->value);
+    }
+  }
+
+  if (job)
+    rewrite_job_id(shard, reply);
+
+  const char *reason = evhttp_request_get_response_code_line(reply);
+  evhttp_send_reply(request, evhttp_request_get_response_code(reply),
+                    reason != NULL ? reason : "",
+                    evhttp_request_get_input_buffer(reply));
+}
+
+// Jobs are asked for uncompressed, so that their IDs can be rewritten
+static void forward(struct shard *shard,
+                    struct evhttp_request *request,
+                    const char *uri,
+                    bool job) {
+  struct proxy_request *proxy = malloc(sizeof(struct proxy_request));
+  struct evhttp_request *forwarded = proxy != NULL ?
+      evhttp_request_new(&proxy_reply, proxy) : NULL;
+
+  if (forwarded == NULL) {
+    free(proxy);
+    send_error(request, HTTP_INTERNAL, "Out of memory");
+    return;
+  }
+
+  proxy->shard = shard;
+  proxy->request = request;
+  proxy->job = job;
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(forwarded);
+  struct evkeyval *header;
+
+  TAILQ_FOREACH(header, evhttp_request_get_input_headers(request), next) {
+    if (!is_hop_by_hop_header(header->key) &&
+        !(job && strcasecmp(header->key, "Accept-Encoding") == 0))
+      evhttp_add_header(headers, header->key, header->value);
+  }
+
+  evhttp_add_header(headers, "Host", shard->name);
+  evbuffer_add_buffer(evhttp_request_get_output_buffer(forwarded),
+                      evhttp_request_get_input_buffer(request));
+
+  // Requests are spread over a few connections; libevent runs one request at
+  // a time on each
+  struct evhttp_connection *connection =
+      shard->connections[shard->next_connection];
+  shard->next_connection = (shard->next_connection + 1) % kShardConnections;
+  shard->requests++;
+
+  // libevent frees `forwarded` when this fails
+  if (evhttp_make_request(connection, forwarded,
+                          evhttp_request_get_command(request), uri) != 0) {
+    free(proxy);
+    shard->failures++;
+    send_error(request, HTTP_BADGATEWAY, "Shard unavailable");
+  }
+}
+
+static void get_stats(struct router *router, struct evhttp_request *request) {
+  json_t *shards = json_array();
+
+  for (int i = 0; i < router->num_shards; i++) {
+    struct shard *shard = &router->shards[i];
+    json_t *json = json_object();
+    json_object_set_new(json, "address", json_string(shard->name));
+    json_object_set_new(json, "healthy", json_boolean(shard->healthy));
+    json_object_set_new(json, "requests", json_integer(shard->requests));
+    json_object_set_new(json, "failures", json_integer(shard->failures));
+    json_array_append_new(shards, json);
+  }
+
+  json_t *json = json_object();
+  json_object_set_new(json, "shards", shards);
+  json_object_set_new(json, "unrouted", json_integer(router->unrouted));
+  char *body = json_dumps(json, JSON_COMPACT);
+  json_decref(json);
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+
+  if (body != NULL)
+    evbuffer_add(buf, body, strlen(body));
+
+  free(body);
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Content-type", "application/json");
+  evhttp_send_reply(request, HTTP_OK, "OK", buf);
+}
+
+static void send_probe(struct evhttp_request *request, bool ready) {
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  evbuffer_add_printf(buf, "{\"phase\":\"%s\"}",
+                      ready ? "ready" : "no shards");
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Content-type", "application/json");
+  evhttp_send_reply(request, ready ? HTTP_OK : HTTP_SERVUNAVAIL,
+                    ready ? "OK" : "Not ready", buf);
+}
+
+// GET /jobs/<shard>-<id> goes to the shard that ran the job
+static void get_job(struct router *router,
+                    struct evhttp_request *request,
+                    const char *id) {
+  char *end;
+  long index = id != NULL ? strtol(id, &end, 10) : -1;
+
+  if (id == NULL || end == id || *end != '-' || index < 0 ||
+      index >= router->num_shards) {
+    send_error(request, HTTP_NOTFOUND, "Job not found");
+    return;
+  }
+
+  char uri[256];
+  snprintf(uri, sizeof(uri), "/jobs/%s", end + 1);
+  forward(&router->shards[index], request, uri, true);
+}
+
+static void handle_request(struct evhttp_request *request, void *userdata) {
+  struct router *router = userdata;
+  const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(request));
+  char *copy = strdup(path != NULL ? path : "");
+
+  if (copy == NULL) {
+    send_error(request, HTTP_INTERNAL, "Out of memory");
+    return;
+  }
+
+  char *entity = strtok(copy, "/");
+  char *segment = entity != NULL ? strtok(NULL, "/") : NULL;
+  int method = evhttp_request_get_command(request);
+
+  if (entity != NULL && strcmp(entity, "stats") == 0 &&
+      method == EVHTTP_REQ_GET) {
+    get_stats(router, request);
+    free(copy);
+    return;
+  }
+
+  // The router is ready as soon as one shard is
+  if (entity != NULL && segment == NULL && method == EVHTTP_REQ_GET &&
+      (strcmp(entity, "healthz") == 0 || strcmp(entity, "readyz") == 0)) {
+    bool ready = strcmp(entity, "healthz") == 0 || router->ring.num_points > 0;
+    send_probe(request, ready);
+    free(copy);
+    return;
+  }
+
+  if (entity != NULL && strcmp(entity, "jobs") == 0 &&
+      method == EVHTTP_REQ_GET) {
+    get_job(router, request, segment);
+    free(copy);
+    return;
+  }
+
+  // Playlists hash on their URI and users on their name. Anything else has
+  // no key and goes to the same shard every time.
+  char *key = segment != NULL ? evhttp_uridecode(segment, 0, NULL) : NULL;
+  int shard = hash_ring_lookup(&router->ring, key != NULL ? key : "",
+                               key != NULL ? strlen(key) : 0);
+  free(key);
+  free(copy);
+
+  if (shard == -1) {
+    router->unrouted++;
+    send_error(request, HTTP_SERVUNAVAIL, "No shard available");
+    return;
+  }
+
+  forward(&router->shards[shard], request, evhttp_request_get_uri(request),
+          false);
+}
+
+static bool shard_init(struct shard *shard,
+                       struct router *router,
+                       const char *address) {
+  const char *colon = strrchr(address, ':');
+  char *end;
+  long port = colon != NULL ? strtol(colon + 1, &end, 10) : 0;
+
+  if (colon == NULL || colon == address || *end != '\0' || port <= 0 ||
+      port > 65535)
+    return false;
+
+  shard->router = router;
+  shard->name = strdup(address);
+  shard->host = strndup(address, colon - address);
+  shard->port = port;
+  shard->connections = calloc(kShardConnections,
+                              sizeof(struct evhttp_connection *));
+
+  if (shard->name == NULL || shard->host == NULL || shard->connections == NULL)
+    return false;
+
+  for (int i = 0; i < kShardConnections; i++) {
+    shard->connections[i] = evhttp_connection_base_new(
+        router->event_base, NULL, shard->host, shard->port);
+
+    if (shard->connections[i] == NULL)
+      return false;
+  }
+
+  shard->health_connection = evhttp_connection_base_new(
+      router->event_base, NULL, shard->host, shard->port);
+
+  if (shard->health_connection == NULL)
+    return false;
+
+  evhttp_connection_set_timeout(shard->health_connection,
+                                kShardHealthTimeout);
+
+  // Shards are assumed to be up until a health check says otherwise
+  shard->healthy = true;
+  return true;
+}
+
+static void shard_free(struct shard *shard) {
+  if (shard->connections != NULL) {
+    for (int i = 0; i < kShardConnections; i++) {
+      if (shard->connections[i] != NULL)
+        evhttp_connection_free(shard->connections[i]);
+    }
+  }
+
+  if (shard->health_connection != NULL)
+    evhttp_connection_free(shard->health_connection);
+
+  free(shard->connections);
+  free(shard->host);
+  free(shard->name);
+}
+
+struct router *router_new(struct event_base *event_base,
+                          const char *host,
+                          int port,
+                          char *const *shards,
+                          int num_shards) {
+  struct router *router = calloc(1, sizeof(struct router));
+
+  if (router == NULL)
+    return NULL;
+
+  router->event_base = event_base;
+  hash_ring_init(&router->ring);
+  router->shards = calloc(num_shards, sizeof(struct shard));
+  router->num_shards = num_shards;
+  router->http = evhttp_new(event_base);
+  router->health_check = evtimer_new(event_base, &check_health, router);
+  bool ok = router->shards != NULL && router->http != NULL &&
+            router->health_check != NULL;
+
+  for (int i = 0; ok && i < num_shards; i++) {
+    ok = shard_init(&router->shards[i], router, shards[i]);
+
+    if (!ok)
+      syslog(LOG_CRIT, "Bad shard address %s", shards[i]);
+  }
+
+  if (ok) {
+    rebuild_ring(router);
+    evhttp_set_timeout(router->http, 60);
+    evhttp_set_gencb(router->http, &handle_request, router);
+    ok = evhttp_bind_socket(router->http, host, port) == 0;
+
+    if (!ok)
+      syslog(LOG_CRIT, "Could not bind HTTP server socket to %s:%d", host,
+             port);
+  }
+
+  if (!ok) {
+    router_free(router);
+    return NULL;
+  }
+
+  struct timeval now = {0, 0};
+  evtimer_add(router->health_check, &now);
+  syslog(LOG_DEBUG, "Routing requests on %s:%d to %d shards", host, port,
+         num_shards);
+  return router;
+}
+
+void router_free(struct router *router) {
+  if (router->http != NULL)
+    evhttp_free(router->http);
+
+  if (router->health_check != NULL)
+    event_free(router->health_check);
+
+  if (router->shards != NULL) {
+    for (int i = 0; i < router->num_shards; i++)
+      shard_free(&router->shards[i]);
+  }
+
+  free(router->shards);
+  hash_ring_free(&router->ring);
+  free(router);
+}
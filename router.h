@@ -0,0 +1,50 @@
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <stdbool.h>
+
+#include "hash_ring.h"
+
+// A server instance requests are forwarded to
+struct shard {
+  struct router *router;
+  char *name;  // host:port
+  char *host;
+  int port;
+  struct evhttp_connection **connections;
+  int next_connection;
+  struct evhttp_connection *health_connection;
+  bool healthy;
+  bool checking;
+  unsigned long requests;
+  unsigned long failures;
+};
+
+// Front end for several server instances, each with its own session. A
+// request goes to the shard that owns its playlist URI or username on a
+// consistent hash ring, so each shard's caches see the same playlists. Shards
+// that fail health checks are taken off the ring until they pass again.
+struct router {
+  struct event_base *event_base;
+  struct evhttp *http;
+  struct shard *shards;
+  int num_shards;
+  struct hash_ring ring;
+  struct event *health_check;
+  unsigned long unrouted;  // Requests that found no healthy shard
+};
+
+// Starts routing requests that arrive on host:port to shards given as
+// "host:port" strings. Returns NULL if a shard address is bad, the socket
+// can't be bound or out of memory.
+struct router *router_new(struct event_base *event_base,
+                          const char *host,
+                          int port,
+                          char *const *shards,
+                          int num_shards);
+
+void router_free(struct router *router);
+
+#endif
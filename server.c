@@ -16,14 +16,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
 #include <apr.h>
+#include <apr_hash.h>
 #include <assert.h>
+#include <errno.h>
 #include <event2/buffer.h>
 #include <event2/event.h>
 #include <event2/http.h>
 #include <event2/http_struct.h>
 #include <event2/keyvalq_struct.h>
+#include <event2/listener.h>
 #include <event2/thread.h>
 #include <event2/util.h>
+#include <inttypes.h>
 #include <jansson.h>
 #include <libspotify/api.h>
 #include <pthread.h>
@@ -32,19 +36,219 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <svn_diff.h>
+#include <svn_pools.h>
 #include <sys/queue.h>
+#include <sys/time.h>
 #include <syslog.h>
 
+#include "apply.h"
+#include "arena.h"
+#include "availability.h"
+#include "cache.h"
+#include "compress.h"
+#include "config.h"
 #include "constants.h"
 #include "diff.h"
+#include "handoff.h"
+#include "idempotency.h"
+#include "jobs.h"
+#include "journal.h"
 #include "json.h"
+#include "listener.h"
+#include "listing_cache.h"
+#include "metadata.h"
+#include "msgpack.h"
+#include "preload.h"
 #include "server.h"
+#include "shared_cache.h"
+#include "track_batch.h"
+#include "track_cache.h"
+#include "track_id.h"
 
+#define HTTP_ACCEPTED 202
 #define HTTP_PARTIAL 210
 #define HTTP_ERROR 500
 #define HTTP_NOTIMPL 501
 
+// Called with the final reply of a request just before it's sent, with the
+// body not yet compressed
+typedef void (*reply_hook_fn)(struct evhttp_request *request,
+                              int code,
+                              const char *message,
+                              struct evbuffer *body,
+                              void *userdata);
+
+// Per-request state that lives from dispatch until the reply has been sent
+struct request_context {
+  struct evhttp_request *request;
+  struct state *state;
+  struct arena *arena;  // Owns everything allocated for the request
+  reply_hook_fn reply_hook;
+  void *reply_hook_userdata;
+  // Set while this is the original request of an Idempotency-Key...
+  struct idempotency_entry *idempotency_entry;
+  // ...or while it's a retry waiting for the original to finish
+  struct idempotency_waiter *idempotency_waiter;
+  struct job *job;  // Set if the request runs in the background
+  // What handlers read of the request. A background job's request has no
+  // connection of its own and gets these from its job_request.
+  enum evhttp_cmd_type method;
+  const struct evhttp_uri *uri;
+  struct evbuffer *body;
+  struct job_request *job_request;  // Owned while a job's request runs
+  struct playlist_write *write;  // Set if the request changes a playlist
+};
+
+// A request to run in the background: one with no connection, which
+// libevent frees once it's replied to, and the method, URI and body of the
+// request it stands in for
+struct job_request {
+  struct evhttp_request *request;
+  struct state *state;
+  enum evhttp_cmd_type method;
+  struct evhttp_uri *uri;
+  struct evbuffer *body;
+};
+
+// Frees all but the request
+static void job_request_free(struct job_request *job_request) {
+  if (job_request->uri != NULL)
+    evhttp_uri_free(job_request->uri);
+
+  if (job_request->body != NULL)
+    evbuffer_free(job_request->body);
+
+  free(job_request);
+}
+
+// Contexts of the requests that have been dispatched but not yet completed,
+// by evhttp_request pointer
+static apr_hash_t *request_contexts = NULL;
+
+static int num_active_requests = 0;
+
+// While shutting down: requests finished and playlists synced since it
+// began, and the background jobs there were to begin with
+static int num_drained_requests = 0;
+static int num_drained_playlists = 0;
+static unsigned long drain_jobs = 0;
+
+// A request that arrived while the session couldn't serve it: before it
+// was ready, or while the connection to Spotify was down
+struct held_request {
+  struct evhttp_request *request;
+  struct event *deadline;
+  TAILQ_ENTRY(held_request) entries;
+};
+
+TAILQ_HEAD(held_request_list, held_request);
+
+static struct held_request_list held_requests =
+    TAILQ_HEAD_INITIALIZER(held_requests);
+static int num_held_requests = 0;
+static int max_held_requests = 0;
+static unsigned long num_held_served = 0;
+static unsigned long num_held_rejected = 0;
+
+static struct request_context *request_context_get(
+    struct evhttp_request *request) {
+  return request_contexts != NULL
+      ? apr_hash_get(request_contexts, &request, sizeof(request))
+      : NULL;
+}
+
+// The method, URI and body of a request as handlers should see them
+static enum evhttp_cmd_type request_method(struct evhttp_request *request) {
+  struct request_context *context = request_context_get(request);
+  return context != NULL ? context->method
+                         : evhttp_request_get_command(request);
+}
+
+static const struct evhttp_uri *request_uri(struct evhttp_request *request) {
+  struct request_context *context = request_context_get(request);
+  return context != NULL ? context->uri
+                         : evhttp_request_get_evhttp_uri(request);
+}
+
+static struct evbuffer *request_body(struct evhttp_request *request) {
+  struct request_context *context = request_context_get(request);
+  return context != NULL ? context->body
+                         : evhttp_request_get_input_buffer(request);
+}
+
+// Allocates memory that is released when the request completes. Returns
+// NULL if out of memory.
+static void *request_alloc(struct evhttp_request *request, size_t size) {
+  struct request_context *context = request_context_get(request);
+  return context != NULL ? arena_alloc(context->arena, size) : NULL;
+}
+
+static void *request_calloc(struct evhttp_request *request,
+                            size_t count,
+                            size_t size) {
+  struct request_context *context = request_context_get(request);
+  return context != NULL ? arena_calloc(context->arena, count, size) : NULL;
+}
+
+static void playlist_write_done(struct playlist_write *write);
+
+static void request_completed(struct evhttp_request *request, void *userdata) {
+  struct request_context *context = userdata;
+
+  if (context->idempotency_waiter != NULL)
+    idempotency_waiter_cancel(context->idempotency_waiter);
+
+  // The request finished without a reply that could be recorded
+  if (context->idempotency_entry != NULL &&
+      context->state->idempotency != NULL)
+    idempotency_abandon(context->state->idempotency,
+                        context->idempotency_entry);
+
+  apr_hash_set(request_contexts, &context->request, sizeof(context->request),
+               NULL);
+  num_active_requests--;
+
+  if (context->state->draining)
+    num_drained_requests++;
+
+  if (context->job_request != NULL)
+    job_request_free(context->job_request);
+
+  if (context->write != NULL)
+    playlist_write_done(context->write);
+
+  arena_free(context->arena);
+}
+
+// Sets up the context of a new request. Returns NULL if out of memory.
+static struct request_context *request_context_new(
+    struct evhttp_request *request,
+    struct state *state) {
+  if (request_contexts == NULL)
+    request_contexts = apr_hash_make(state->pool);
+
+  struct arena *arena = arena_new();
+
+  if (arena == NULL)
+    return NULL;
+
+  struct request_context *context = arena_calloc(
+      arena, 1, sizeof(struct request_context));
+  context->request = request;
+  context->state = state;
+  context->arena = arena;
+  context->method = evhttp_request_get_command(request);
+  context->uri = evhttp_request_get_evhttp_uri(request);
+  context->body = evhttp_request_get_input_buffer(request);
+  apr_hash_set(request_contexts, &context->request, sizeof(context->request),
+               context);
+  num_active_requests++;
+  evhttp_request_set_on_complete_cb(request, &request_completed, context);
+  return context;
+}
+
 typedef void (*handle_playlist_fn)(sp_playlist *playlist,
                                    struct evhttp_request *request,
                                    void *userdata);
@@ -68,33 +272,188 @@ struct playlistcontainer_handler {
   void *userdata;
 };
 
+// Response body formats a client can ask for with the Accept header
+enum reply_format {
+  REPLY_FORMAT_JSON,
+  REPLY_FORMAT_MSGPACK,
+  REPLY_FORMAT_MSGPACK_COMPACT  // Tracks as packed binary IDs
+};
+
+static const char *reply_format_content_type(enum reply_format format) {
+  switch (format) {
+    case REPLY_FORMAT_MSGPACK:
+      return "application/msgpack";
+
+    case REPLY_FORMAT_MSGPACK_COMPACT:
+      return "application/msgpack; tracks=binary";
+
+    default:
+      return "application/json; charset=UTF-8";
+  }
+}
+
+static bool is_msgpack_media_type(const char *type, size_t len) {
+  return (len == strlen("application/msgpack") &&
+          strncasecmp(type, "application/msgpack", len) == 0) ||
+         (len == strlen("application/x-msgpack") &&
+          strncasecmp(type, "application/x-msgpack", len) == 0);
+}
+
+// Picks the first MessagePack media range in the Accept header, if any.
+// `application/msgpack; tracks=binary` selects the compact representation.
+static enum reply_format negotiate_reply_format(
+    struct evhttp_request *request) {
+  const char *accept = evhttp_find_header(
+      evhttp_request_get_input_headers(request), "Accept");
+
+  if (accept == NULL)
+    return REPLY_FORMAT_JSON;
+
+  while (*accept != '\0') {
+    size_t range_len = strcspn(accept, ",");
+    size_t type_len = strcspn(accept, ",;");
+    const char *type = accept;
+
+    while (type_len > 0 && (*type == ' ' || *type == '\t')) {
+      type++;
+      type_len--;
+    }
+
+    while (type_len > 0 && (type[type_len - 1] == ' ' ||
+                            type[type_len - 1] == '\t'))
+      type_len--;
+
+    if (is_msgpack_media_type(type, type_len)) {
+      const char *params = accept + strcspn(accept, ",;");
+      size_t params_len = accept + range_len - params;
+
+      for (size_t i = 0; i + strlen("tracks=binary") <= params_len; i++) {
+        if (strncmp(params + i, "tracks=binary", strlen("tracks=binary")) == 0)
+          return REPLY_FORMAT_MSGPACK_COMPACT;
+      }
+
+      return REPLY_FORMAT_MSGPACK;
+    }
+
+    accept += range_len;
+
+    if (*accept == ',')
+      accept++;
+  }
+
+  return REPLY_FORMAT_JSON;
+}
+
+static int dump_to_evbuffer(const char *buffer, size_t size, void *data) {
+  return evbuffer_add(data, buffer, size);
+}
+
+// Serializes JSON into `buf` in the given format
+static void render_json(json_t *json,
+                        enum reply_format format,
+                        struct evbuffer *buf) {
+  if (format == REPLY_FORMAT_JSON) {
+    json_dump_callback(json, &dump_to_evbuffer, buf, JSON_COMPACT);
+  } else {
+    msgpack_pack_json(json, buf, format == REPLY_FORMAT_MSGPACK_COMPACT ?
+                                 MSGPACK_COMPACT_TRACKS : 0);
+  }
+}
+
+// Compression level for response bodies (0 disables compression). Set when
+// the HTTP server is started and when the configuration is reloaded.
+static int compression_level = kDefaultCompressionLevel;
+
+// Picks an encoding the client accepts for a body of the given size
+static enum content_encoding negotiate_content_encoding(
+    struct evhttp_request *request,
+    size_t body_len) {
+  if (compression_level <= 0 || body_len < kMinCompressedBodySize)
+    return CONTENT_ENCODING_IDENTITY;
+
+  return content_encoding_negotiate(evhttp_find_header(
+      evhttp_request_get_input_headers(request), "Accept-Encoding"));
+}
+
+// Compresses a body in place if the client accepts a compressed encoding
+static void compress_reply_body(struct evhttp_request *request,
+                                struct evbuffer *body) {
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+
+  if (evhttp_find_header(headers, "Content-Encoding") != NULL)
+    return;
+
+  enum content_encoding encoding = negotiate_content_encoding(
+      request, evbuffer_get_length(body));
+
+  if (encoding == CONTENT_ENCODING_IDENTITY)
+    return;
+
+  struct evbuffer *compressed = evbuffer_new();
+
+  if (compress_evbuffer(body, encoding, compression_level, compressed) == 0) {
+    evbuffer_drain(body, evbuffer_get_length(body));
+    evbuffer_add_buffer(body, compressed);
+    evhttp_add_header(headers, "Content-Encoding",
+                      content_encoding_name(encoding));
+  }
+
+  evbuffer_free(compressed);
+}
+
+// Sends the reply. Bodies are JSON unless a Content-type is set already.
 static void send_reply(struct evhttp_request *request,
                        int code,
                        const char *message,
                        struct evbuffer *body) {
-  evhttp_add_header(evhttp_request_get_output_headers(request),
-                    "Content-type", "application/json; charset=UTF-8");
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+
+  if (evhttp_find_header(headers, "Content-type") == NULL) {
+    evhttp_add_header(headers, "Content-type",
+                      reply_format_content_type(REPLY_FORMAT_JSON));
+  }
+
+  evhttp_add_header(headers, "Vary", "Accept, Accept-Encoding");
+  struct request_context *context = request_context_get(request);
+
+  if (context != NULL && context->reply_hook != NULL) {
+    reply_hook_fn reply_hook = context->reply_hook;
+    context->reply_hook = NULL;
+    reply_hook(request, code, message, body, context->reply_hook_userdata);
+  }
+
+  if (body != NULL)
+    compress_reply_body(request, body);
+
   bool empty_body = body == NULL;
 
   if (empty_body)
     body = evbuffer_new();
 
+  // libevent frees requests whose client has gone away as soon as they're
+  // replied to, without calling the completion callback
+  bool detached = evhttp_request_get_connection(request) == NULL;
   evhttp_send_reply(request, code, message, body);
 
   if (empty_body)
     evbuffer_free(body);
+
+  if (detached && context != NULL)
+    request_completed(NULL, context);
 }
 
-// Sends JSON to the client (also `free`s the JSON object)
+// Sends JSON to the client, or MessagePack if that's what it accepts (also
+// `free`s the JSON object)
 static void send_reply_json(struct evhttp_request *request,
                             int code,
                             const char *message,
                             json_t *json) {
+  enum reply_format format = negotiate_reply_format(request);
   struct evbuffer *buf = evhttp_request_get_output_buffer(request);
-  char *json_str = json_dumps(json, JSON_COMPACT);
+  render_json(json, format, buf);
   json_decref(json);
-  evbuffer_add(buf, json_str, strlen(json_str));
-  free(json_str);
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Content-type", reply_format_content_type(format));
   send_reply(request, code, message, buf);
 }
 
@@ -120,7 +479,12 @@ static struct playlist_handler *register_playlist_callbacks(
     handle_playlist_fn callback,
     sp_playlist_callbacks *playlist_callbacks,
     void *userdata) {
-  struct playlist_handler *handler = malloc(sizeof (struct playlist_handler));
+  struct playlist_handler *handler = request_alloc(
+      request, sizeof (struct playlist_handler));
+
+  if (handler == NULL)
+    return NULL;
+
   handler->request = request;
   handler->callback = callback;
   handler->playlist_callbacks = playlist_callbacks;
@@ -134,7 +498,6 @@ static void playlist_dispatch(sp_playlist *playlist, void *userdata) {
   sp_playlist_remove_callbacks(playlist, handler->playlist_callbacks, handler);
   handler->playlist_callbacks = NULL;
   handler->callback(playlist, handler->request, handler->userdata);
-  free(handler);
 }
 
 static struct playlistcontainer_handler *register_playlistcontainer_callbacks(
@@ -143,7 +506,12 @@ static struct playlistcontainer_handler *register_playlistcontainer_callbacks(
     handle_playlistcontainer_fn callback,
     sp_playlistcontainer_callbacks *playlistcontainer_callbacks,
     void *userdata) {
-  struct playlistcontainer_handler *handler = malloc(sizeof (struct playlistcontainer_handler));
+  struct playlistcontainer_handler *handler = request_alloc(
+      request, sizeof (struct playlistcontainer_handler));
+
+  if (handler == NULL)
+    return NULL;
+
   handler->request = request;
   handler->callback = callback;
   handler->playlistcontainer_callbacks = playlistcontainer_callbacks;
@@ -159,7 +527,6 @@ static void playlistcontainer_dispatch(sp_playlistcontainer *pc, void *userdata)
                                         handler->playlistcontainer_callbacks,
                                         handler);
   handler->callback(pc, handler->request, handler->userdata);
-  free(handler);
 }
 
 static void playlist_dispatch_if_loaded(sp_playlist *playlist, void *userdata) {
@@ -200,22 +567,294 @@ static sp_playlistcontainer_callbacks playlistcontainer_loaded_callbacks = {
 static void not_implemented(sp_playlist *playlist,
                             struct evhttp_request *request,
                             void *userdata) {
-  evhttp_send_error(request, HTTP_NOTIMPL, "Not Implemented");
+  send_error(request, HTTP_NOTIMPL, "Not Implemented");
 }
 
-// Responds with an entire playlist
-static void get_playlist(sp_playlist *playlist,
-                         struct evhttp_request *request,
-                         void *userdata) {
+// Reads `fields`, `offset` and `limit` from the query string. Returns false
+// and points `error` at a message if any of them is invalid.
+static bool parse_playlist_json_options(struct evhttp_request *request,
+                                        struct playlist_json_options *options,
+                                        const char **error) {
+  options->fields = PLAYLIST_FIELDS_DEFAULT;
+  options->offset = 0;
+  options->limit = -1;
+  options->expand_tracks = false;
+
+  const char *query = evhttp_uri_get_query(request_uri(request));
+
+  if (query == NULL)
+    return true;
+
+  struct evkeyvalq query_fields;
+
+  if (evhttp_parse_query_str(query, &query_fields) != 0) {
+    *error = "Bad query string";
+    return false;
+  }
+
+  bool valid = true;
+  const char *fields_field = evhttp_find_header(&query_fields, "fields");
+  const char *offset_field = evhttp_find_header(&query_fields, "offset");
+  const char *limit_field = evhttp_find_header(&query_fields, "limit");
+  const char *expand_field = evhttp_find_header(&query_fields, "expand");
+
+  if (fields_field != NULL &&
+      (options->fields = playlist_fields_parse(fields_field)) == 0) {
+    *error = "Bad parameter: fields contains an unknown field";
+    valid = false;
+  } else if (offset_field != NULL &&
+             (sscanf(offset_field, "%d", &options->offset) <= 0 ||
+              options->offset < 0)) {
+    *error = "Bad parameter: offset must be numeric and non-negative";
+    valid = false;
+  } else if (limit_field != NULL &&
+             (sscanf(limit_field, "%d", &options->limit) <= 0 ||
+              options->limit < 0)) {
+    *error = "Bad parameter: limit must be numeric and non-negative";
+    valid = false;
+  } else if (expand_field != NULL) {
+    options->expand_tracks = strcmp(expand_field, "tracks") == 0;
+
+    if (!options->expand_tracks) {
+      *error = "Bad parameter: expand must be tracks";
+      valid = false;
+    }
+  }
+
+  // A page of tracks is not much use without knowing how many there are
+  if ((offset_field != NULL || limit_field != NULL) &&
+      (options->fields & PLAYLIST_FIELD_TRACKS))
+    options->fields |= PLAYLIST_FIELD_NUM_TRACKS;
+
+  evhttp_clear_headers(&query_fields);
+  return valid;
+}
+
+// Writes the URI of a playlist into `uri`, which holds kMaxPlaylistLinkLength
+// bytes
+static bool get_playlist_uri(sp_playlist *playlist, char *uri) {
+  sp_link *link = sp_link_create_from_playlist(playlist);
+
+  if (link == NULL)
+    return false;
+
+  sp_link_as_string(link, uri, kMaxPlaylistLinkLength);
+  sp_link_release(link);
+  return true;
+}
+
+// Sends a cached body, compressing it at most once per encoding
+static void send_cache_entry(struct evhttp_request *request,
+                             struct cache_entry *entry,
+                             enum reply_format format) {
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  evhttp_add_header(headers, "Content-type",
+                    reply_format_content_type(format));
+  struct request_context *context = request_context_get(request);
+
+  // Replies that are recorded are compressed by send_reply(), after the hook
+  // has seen them
+  enum content_encoding encoding =
+      context != NULL && context->reply_hook != NULL
+          ? CONTENT_ENCODING_IDENTITY
+          : negotiate_content_encoding(request, entry->body_len);
+
+  if (encoding != CONTENT_ENCODING_IDENTITY &&
+      entry->encoded_body[encoding] == NULL) {
+    struct evbuffer *compressed = evbuffer_new();
+
+    if (compress_bytes(entry->body, entry->body_len, encoding,
+                       compression_level, compressed) == 0) {
+      size_t compressed_len = evbuffer_get_length(compressed);
+      cache_entry_set_encoded(
+          entry, encoding,
+          (const char *) evbuffer_pullup(compressed, compressed_len),
+          compressed_len);
+    }
+
+    evbuffer_free(compressed);
+  }
+
+  if (encoding != CONTENT_ENCODING_IDENTITY &&
+      entry->encoded_body[encoding] != NULL) {
+    evbuffer_add(buf, entry->encoded_body[encoding],
+                 entry->encoded_len[encoding]);
+    evhttp_add_header(headers, "Content-Encoding",
+                      content_encoding_name(encoding));
+  } else {
+    evbuffer_add(buf, entry->body, entry->body_len);
+  }
+
+  send_reply(request, HTTP_OK, "OK", buf);
+}
+
+// Renders a playlist and sends it. Only complete renderings are cached, and
+// those with track metadata only until metadata is next updated. Since other
+// workers can't tell when that happens here, they aren't shared.
+static void send_playlist(struct state *state,
+                          sp_playlist *playlist,
+                          struct evhttp_request *request,
+                          const struct playlist_json_options *options,
+                          const char *key,
+                          bool complete) {
+  int status = complete ? HTTP_OK : HTTP_PARTIAL;
+  const char *message = complete ? "OK" : "Partial Content";
+  enum reply_format format = negotiate_reply_format(request);
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  char uri[kMaxPlaylistLinkLength];
+  bool shared = complete && !options->expand_tracks &&
+                state->shared_cache != NULL &&
+                get_playlist_uri(playlist, uri);
+  uint32_t generation = shared ?
+      shared_cache_generation(state->shared_cache, uri) : 0;
   json_t *json = json_object();
 
-  if (playlist_to_json(playlist, json) == NULL) {
+  if (playlist_to_json_with_options(playlist, options, json) == NULL) {
     json_decref(json);
     send_error(request, HTTP_ERROR, "");
     return;
   }
 
-  send_reply_json(request, HTTP_OK, "OK", json);
+  render_json(json, format, buf);
+  json_decref(json);
+
+  if (complete) {
+    size_t body_len = evbuffer_get_length(buf);
+
+    if (shared)
+      shared_cache_put(state->shared_cache, uri, key, generation,
+                       (const char *) evbuffer_pullup(buf, body_len),
+                       body_len);
+
+    struct cache_entry *entry = cache_put(
+        state->cache, playlist, key,
+        (const char *) evbuffer_pullup(buf, body_len), body_len);
+
+    if (entry != NULL) {
+      if (options->expand_tracks)
+        cache_entry_set_ttl(entry, kExpandedCacheTtl);
+
+      evbuffer_drain(buf, body_len);
+      send_cache_entry(request, entry, format);
+      return;
+    }
+  }
+
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Content-type", reply_format_content_type(format));
+  send_reply(request, status, message, buf);
+}
+
+// A playlist request waiting for metadata of the tracks it expands
+struct expand_tracks_request {
+  struct state *state;
+  sp_playlist *playlist;
+  struct evhttp_request *request;
+  struct playlist_json_options options;
+  char key[64];
+};
+
+static void get_playlist_expanded(bool complete, void *userdata) {
+  struct expand_tracks_request *expand = userdata;
+  send_playlist(expand->state, expand->playlist, expand->request,
+                &expand->options, expand->key, complete);
+  sp_playlist_release(expand->playlist);
+}
+
+// Waits for metadata of the tracks in the requested page before sending the
+// playlist
+static void wait_for_expanded_tracks(struct state *state,
+                                     sp_playlist *playlist,
+                                     struct evhttp_request *request,
+                                     const struct playlist_json_options *options,
+                                     const char *key) {
+  int num_tracks = sp_playlist_num_tracks(playlist);
+  int end = num_tracks;
+
+  if (options->limit >= 0 && options->limit < num_tracks - options->offset)
+    end = options->offset + options->limit;
+
+  int num_page_tracks = end > options->offset ? end - options->offset : 0;
+  sp_track **tracks = request_calloc(request, num_page_tracks,
+                                     sizeof(sp_track *));
+  struct expand_tracks_request *expand = request_alloc(
+      request, sizeof(struct expand_tracks_request));
+
+  if (tracks == NULL || expand == NULL) {
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  for (int i = 0; i < num_page_tracks; i++)
+    tracks[i] = sp_playlist_track(playlist, options->offset + i);
+
+  expand->state = state;
+  expand->playlist = playlist;
+  expand->request = request;
+  expand->options = *options;
+  snprintf(expand->key, sizeof(expand->key), "%s", key);
+  sp_playlist_add_ref(playlist);
+  struct timeval timeout = {kMetadataTimeout, 0};
+  metadata_wait_tracks(state->metadata_waits, tracks, num_page_tracks,
+                       &timeout, &get_playlist_expanded, expand);
+}
+
+// Looks for a body another worker rendered and caches it here too, which
+// also makes this worker watch the playlist for changes
+static struct cache_entry *get_shared_cache_entry(struct state *state,
+                                                  sp_playlist *playlist,
+                                                  const char *key) {
+  char uri[kMaxPlaylistLinkLength];
+  struct evbuffer *body = evbuffer_new();
+  struct cache_entry *entry = NULL;
+
+  if (body != NULL && get_playlist_uri(playlist, uri) &&
+      shared_cache_get(state->shared_cache, uri, key, body)) {
+    size_t body_len = evbuffer_get_length(body);
+    entry = cache_put(state->cache, playlist, key,
+                      (const char *) evbuffer_pullup(body, body_len),
+                      body_len);
+  }
+
+  if (body != NULL)
+    evbuffer_free(body);
+
+  return entry;
+}
+
+// Responds with a playlist, or the parts of it asked for. Rendered bodies
+// are cached per page and projection until the playlist changes.
+static void get_playlist(sp_playlist *playlist,
+                         struct evhttp_request *request,
+                         void *userdata) {
+  struct state *state = userdata;
+  struct playlist_json_options options;
+  const char *options_error;
+
+  if (!parse_playlist_json_options(request, &options, &options_error)) {
+    send_error(request, HTTP_BADREQUEST, options_error);
+    return;
+  }
+
+  options.session = state->session;
+  enum reply_format format = negotiate_reply_format(request);
+  char key[64];
+  snprintf(key, sizeof(key), "%x:%d:%d:%d:%d", options.fields, options.offset,
+           options.limit, options.expand_tracks, format);
+  struct cache_entry *entry = cache_get(state->cache, playlist, key);
+
+  if (entry == NULL && state->shared_cache != NULL)
+    entry = get_shared_cache_entry(state, playlist, key);
+
+  if (entry != NULL) {
+    send_cache_entry(request, entry, format);
+  } else if (options.expand_tracks &&
+             (options.fields & PLAYLIST_FIELD_TRACKS)) {
+    wait_for_expanded_tracks(state, playlist, request, &options, key);
+  } else {
+    send_playlist(state, playlist, request, &options, key, true);
+  }
 }
 
 static void get_playlist_collaborative(sp_playlist *playlist,
@@ -247,44 +886,118 @@ static void get_playlist_subscribers(sp_playlist *playlist,
                                      struct evhttp_request *request,
                                      void *userdata) {
   assert(sp_playlist_is_loaded(playlist));
-  sp_session *session = userdata;
+  struct state *state = userdata;
   register_playlist_callbacks(playlist, request,
                               &get_playlist_subscribers_callback,
                               &playlist_subscribers_changed_callbacks,
                               userdata);
-  sp_playlist_update_subscribers(session, playlist);
+  sp_playlist_update_subscribers(state->session, playlist);
 }
 
-// Reads JSON from the requests body. Returns NULL on any error.
+// Reads JSON from the requests body, or MessagePack if the body's
+// Content-type says so. Returns NULL on any error.
 static json_t *read_request_body_json(struct evhttp_request *request,
                                       json_error_t *error) {
-  struct evbuffer *buf = evhttp_request_get_input_buffer(request);
+  struct evbuffer *buf = request_body(request);
   size_t buflen = evbuffer_get_length(buf);
 
   if (buflen == 0)
     return NULL;
 
-  // Read body
-  char *body = malloc(buflen + 1);
+  const char *content_type = evhttp_find_header(
+      evhttp_request_get_input_headers(request), "Content-type");
 
-  if (body == NULL)
-    return NULL; // TODO(liesen): Handle memory alloc fail
+  if (content_type != NULL &&
+      is_msgpack_media_type(content_type, strcspn(content_type, ";"))) {
+    const char *unpack_error = NULL;
+    json_t *json = msgpack_unpack_json(evbuffer_pullup(buf, buflen), buflen,
+                                       &unpack_error);
+    evbuffer_drain(buf, buflen);
 
-  if (evbuffer_remove(buf, body, buflen) == -1) {
-    free(body);
-    return NULL;
+    if (json == NULL)
+      snprintf(error->text, sizeof(error->text), "%s", unpack_error);
+
+    return json;
   }
 
-  body[buflen] = '\0';
+  // Parse JSON straight from the body, without copying it
+  const char *body = (const char *) evbuffer_pullup(buf, buflen);
+
+  if (body == NULL)
+    return NULL;
 
-  // Parse JSON
-  json_t *json = json_loads(body, 0, error);
-  free(body);
+  json_t *json = json_loadb(body, buflen, 0, error);
+  evbuffer_drain(buf, buflen);
   return json;
 }
 
+// Tracks posted to an inbox are held until libspotify is done with them
+struct inbox_post {
+  struct evhttp_request *request;
+  struct track_batch batch;
+};
+
+static struct arena *request_arena(struct evhttp_request *request) {
+  struct request_context *context = request_context_get(request);
+  return context != NULL ? context->arena : NULL;
+}
+
+// Resolves the track URIs in a request body, which is either a text/uri-list
+// or an array in any format read_request_body_json() understands. Returns
+// false with a message in `error` if the body can't be read.
+static bool read_request_body_tracks(struct evhttp_request *request,
+                                     struct track_batch *batch,
+                                     json_error_t *error) {
+  struct arena *arena = request_arena(request);
+  struct evbuffer *buf = request_body(request);
+  const char *content_type = evhttp_find_header(
+      evhttp_request_get_input_headers(request), "Content-type");
+
+  if (arena == NULL) {
+    snprintf(error->text, sizeof(error->text), "Out of memory");
+    return false;
+  }
+
+  if (evbuffer_get_length(buf) == 0) {
+    snprintf(error->text, sizeof(error->text), "No body");
+    return false;
+  }
+
+  if (content_type != NULL &&
+      strncasecmp(content_type, "text/uri-list", 13) == 0 &&
+      (content_type[13] == '\0' || content_type[13] == ';')) {
+    if (!track_batch_from_evbuffer(batch, buf, arena)) {
+      snprintf(error->text, sizeof(error->text), "Out of memory");
+      return false;
+    }
+
+    return true;
+  }
+
+  json_t *json = read_request_body_json(request, error);
+
+  if (json == NULL)
+    return false;
+
+  if (!json_is_array(json)) {
+    json_decref(json);
+    snprintf(error->text, sizeof(error->text), "Not valid JSON array");
+    return false;
+  }
+
+  bool resolved = track_batch_from_json(batch, json, arena);
+  json_decref(json);
+
+  if (!resolved)
+    snprintf(error->text, sizeof(error->text), "Out of memory");
+
+  return resolved;
+}
+
 static void inbox_post_complete(sp_inbox *inbox, void *userdata) {
-  struct evhttp_request *request = userdata;
+  struct inbox_post *post = userdata;
+  struct evhttp_request *request = post->request;
+  track_batch_release(&post->batch);
   sp_error inbox_error = sp_inbox_error(inbox);
   sp_inbox_release(inbox);
 
@@ -303,436 +1016,1973 @@ static void inbox_post_complete(sp_inbox *inbox, void *userdata) {
   }
 }
 
-static void get_user_playlists(sp_playlistcontainer *pc,
-                               struct evhttp_request *request,
-                               void *userdata) {
-  json_t *json = json_object();
-  json_t *playlists = json_array();
-  json_object_set_new(json, "playlists", playlists);
-  int status = HTTP_OK;
+// Whether a query parameter such as ?async=1 is set to 1 or true
+static bool request_has_flag(struct evhttp_request *request,
+                             const char *name) {
+  const char *query = evhttp_uri_get_query(request_uri(request));
 
-  for (int i = 0; i < sp_playlistcontainer_num_playlists(pc); i++) {
-    sp_playlist *playlist = sp_playlistcontainer_playlist(pc, i);
+  if (query == NULL)
+    return false;
 
-    if (!sp_playlist_is_loaded(playlist)) {
-      status = HTTP_PARTIAL;
-      continue;
-    }
+  struct evkeyvalq query_fields;
 
-    json_t *playlist_json = json_object();
-    playlist_to_json(playlist, playlist_json);
-    json_array_append_new(playlists, playlist_json);
-  }
+  if (evhttp_parse_query_str(query, &query_fields) != 0)
+    return false;
 
-  send_reply_json(request, status, status == HTTP_OK ? "OK" : "Partial Content",
-                  json);
+  const char *field = evhttp_find_header(&query_fields, name);
+  bool set = field != NULL &&
+             (strcmp(field, "1") == 0 || strcmp(field, "true") == 0);
+  evhttp_clear_headers(&query_fields);
+  return set;
 }
 
-static void put_user_inbox(const char *user,
-                           struct evhttp_request *request,
-                           void *userdata) {
-  json_error_t loads_error;
-  json_t *json = read_request_body_json(request, &loads_error);
+// Renders a playlist as an item of a shallow listing
+static bool render_listing_playlist(sp_playlist *playlist,
+                                    int variant,
+                                    struct evbuffer *buf,
+                                    void *userdata) {
+  if (!sp_playlist_is_loaded(playlist))
+    return false;
+
+  struct playlist_json_options options = {
+    .fields = PLAYLIST_FIELDS_SHALLOW,
+    .offset = 0,
+    .limit = -1,
+    .expand_tracks = false
+  };
+  json_t *json = json_object();
+  playlist_to_json_with_options(playlist, &options, json);
+  render_json(json, variant, buf);
+  json_decref(json);
+  return true;
+}
 
-  if (json == NULL) {
-    send_error(request, HTTP_BADREQUEST,
-        loads_error.text ? loads_error.text : "Unable to parse JSON");
-    return;
-  }
+// Folders are {folderId, title, playlists} with the ID in hex, as taken by
+// ?folder=
+static json_t *folder_to_json(sp_playlistcontainer *pc,
+                              int index,
+                              json_t *object) {
+  char id[17];
+  char name[kMaxPlaylistTitleLength];
+  snprintf(id, sizeof(id), "%016" PRIx64,
+           (uint64_t) sp_playlistcontainer_playlist_folder_id(pc, index));
+
+  if (sp_playlistcontainer_playlist_folder_name(pc, index, name,
+                                                sizeof(name)) != SP_ERROR_OK)
+    name[0] = '\0';
+
+  json_object_set_new(object, "folderId", json_string_nocheck(id));
+  json_object_set_new(object, "title", json_string_nocheck(name));
+  return object;
+}
 
-  if (!json_is_object(json)) {
-    json_decref(json);
-    send_error(request, HTTP_BADREQUEST, "Not valid JSON object");
-    return;
-  }
+// Writes a folder up to and including the key of its playlists
+static bool add_listing_folder(const struct listing *listing,
+                               const struct listing_fragment *fragment,
+                               enum reply_format format,
+                               struct evbuffer *buf) {
+  json_t *folder = folder_to_json(listing->container, fragment->index,
+                                  json_object());
 
-  json_t *tracks_json = json_object_get(json, "tracks");
+  if (format == REPLY_FORMAT_JSON) {
+    char *dump = json_dumps(folder, JSON_COMPACT);
 
-  if (!json_is_array(tracks_json)) {
-    json_decref(tracks_json);
-    send_error(request, HTTP_BADREQUEST, "tracks is not valid JSON array");
-    return;
-  }
+    if (dump == NULL) {
+      json_decref(folder);
+      return false;
+    }
 
-  // Handle empty array
-  int num_tracks = json_array_size(tracks_json);
+    evbuffer_add(buf, dump, strlen(dump) - 1);  // Without the closing }
+    evbuffer_add_printf(buf, ",\"playlists\":");
+    free(dump);
+  } else {
+    msgpack_pack_map_header(buf, json_object_size(folder) + 1);
 
-  if (num_tracks == 0) {
-    send_reply(request, HTTP_OK, "OK", NULL);
-    return;
+    for (void *iter = json_object_iter(folder);
+         iter != NULL;
+         iter = json_object_iter_next(folder, iter)) {
+      msgpack_pack_string(buf, json_object_iter_key(iter));
+      msgpack_pack_json(json_object_iter_value(iter), buf, 0);
+    }
+
+    msgpack_pack_string(buf, "playlists");
   }
 
-  sp_track **tracks = calloc(num_tracks, sizeof (sp_track *));
-  int num_valid_tracks = json_to_tracks(tracks_json, tracks, num_tracks);
+  json_decref(folder);
+  return true;
+}
 
-  if (num_valid_tracks == 0) {
-    send_error(request, HTTP_BADREQUEST, "No valid tracks");
-  } else {
-    json_t *message_json = json_object_get(json, "message");
-    sp_session *session = userdata;
-    sp_inbox *inbox = sp_inbox_post_tracks(session, user, tracks,
-        num_valid_tracks,
-        json_is_string(message_json) ? json_string_value(message_json) : "",
-        &inbox_post_complete, request);
+// Writes the fragments from `index` up to the end of the folder they're in
+// as an array, with folders nested. Playlists are added by reference rather
+// than copied.
+static bool add_listing_entries(const struct listing *listing,
+                                int *index,
+                                enum reply_format format,
+                                struct evbuffer *buf) {
+  int num_entries = 0;
+
+  for (int i = *index, depth = 0;
+       i < listing->num_fragments && depth >= 0;
+       i++) {
+    switch (listing->fragments[i]->type) {
+      case SP_PLAYLIST_TYPE_START_FOLDER:
+        if (depth++ == 0)
+          num_entries++;
+        break;
 
-    if (inbox == NULL)
-      send_error(request, HTTP_ERROR,
-                 "Failed to initialize request to add tracks to user's inbox");
+      case SP_PLAYLIST_TYPE_END_FOLDER:
+        depth--;
+        break;
+
+      default:
+        if (depth == 0)
+          num_entries++;
+    }
   }
 
-  json_decref(json);
-  free(tracks);
-}
+  if (format == REPLY_FORMAT_JSON)
+    evbuffer_add(buf, "[", 1);
+  else
+    msgpack_pack_array_header(buf, num_entries);
 
-static void put_playlist(sp_playlist *playlist,
-                         struct evhttp_request *request,
-                         void *userdata) {
-  // TODO(liesen): playlist there so that signatures of all handler methods are
-  // the same, but do they have to be?
-  assert(playlist == NULL);
+  for (int i = 0; i < num_entries; i++) {
+    const struct listing_fragment *fragment = listing->fragments[(*index)++];
 
-  sp_session *session = userdata;
-  json_error_t loads_error;
-  json_t *playlist_json = read_request_body_json(request, &loads_error);
+    if (format == REPLY_FORMAT_JSON && i > 0)
+      evbuffer_add(buf, ",", 1);
 
-  if (playlist_json == NULL) {
-    send_error(request, HTTP_BADREQUEST,
-               loads_error.text ? loads_error.text : "Unable to parse JSON");
-    return;
-  }
+    if (fragment->type == SP_PLAYLIST_TYPE_START_FOLDER) {
+      if (!add_listing_folder(listing, fragment, format, buf) ||
+          !add_listing_entries(listing, index, format, buf))
+        return false;
 
-  // Parse playlist
-  if (!json_is_object(playlist_json)) {
-    send_error(request, HTTP_BADREQUEST, "Invalid playlist object");
-    return;
+      if (format == REPLY_FORMAT_JSON)
+        evbuffer_add(buf, "}", 1);
+    } else if (!listing_fragment_add(fragment, buf)) {
+      return false;
+    }
   }
 
-  // Get title
-  json_t *title_json = json_object_get(playlist_json, "title");
+  // Past the end of the folder
+  if (*index < listing->num_fragments &&
+      listing->fragments[*index]->type == SP_PLAYLIST_TYPE_END_FOLDER)
+    (*index)++;
 
-  if (title_json == NULL) {
-    json_decref(playlist_json);
-    send_error(request, HTTP_BADREQUEST,
-               "Invalid playlist: title is missing");
-    return;
+  if (format == REPLY_FORMAT_JSON)
+    evbuffer_add(buf, "]", 1);
+
+  return true;
+}
+
+// Stitches {"playlists": [...]} together from the listing's fragments
+static void send_listing(struct evhttp_request *request,
+                         const struct listing *listing,
+                         enum reply_format format) {
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  int index = 0;
+
+  if (format == REPLY_FORMAT_JSON) {
+    evbuffer_add_printf(buf, "{\"playlists\":");
+  } else {
+    msgpack_pack_map_header(buf, 1);
+    msgpack_pack_string(buf, "playlists");
   }
 
-  if (!json_is_string(title_json)) {
-    json_decref(playlist_json);
-    send_error(request, HTTP_BADREQUEST,
-               "Invalid playlist: title is not a string");
+  if (!add_listing_entries(listing, &index, format, buf)) {
+    evbuffer_drain(buf, evbuffer_get_length(buf));
+    send_error(request, HTTP_ERROR, "Out of memory");
     return;
   }
 
-  char title[kMaxPlaylistTitleLength];
-  strncpy(title, json_string_value(title_json), kMaxPlaylistTitleLength);
-  json_decref(playlist_json);
-
-  // Add new playlist
-  sp_playlistcontainer *pc = sp_session_playlistcontainer(session);
-  playlist = sp_playlistcontainer_add_new_playlist(pc, title);
+  if (format == REPLY_FORMAT_JSON)
+    evbuffer_add(buf, "}", 1);
 
-  if (playlist == NULL) {
-    send_error(request, HTTP_ERROR, "Unable to create playlist");
-  } else {
-    register_playlist_callbacks(playlist, request, &get_playlist,
-                                &playlist_state_changed_callbacks, NULL);
-  }
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Content-type", reply_format_content_type(format));
+  send_reply(request, HTTP_OK, "OK", buf);
 }
 
-static void put_playlist_add_tracks(sp_playlist *playlist,
-                                    struct evhttp_request *request,
-                                    void *userdata) {
-  sp_session *session = userdata;
-  const char *uri = evhttp_request_get_uri(request);
-  struct evkeyvalq query_fields;
-  evhttp_parse_query(uri, &query_fields);
+// Appends the entries from `index` up to the end of the folder they're in
+// to `array`, with folders nested. Playlists that aren't loaded are left out
+// and make the status 210; with a session, they're asked to load as well.
+static void container_entries_to_json(sp_playlistcontainer *pc,
+                                      int *index,
+                                      const struct playlist_json_options *options,
+                                      sp_session *session,
+                                      json_t *array,
+                                      int *status) {
+  while (*index < sp_playlistcontainer_num_playlists(pc)) {
+    int i = (*index)++;
+
+    switch (sp_playlistcontainer_playlist_type(pc, i)) {
+      case SP_PLAYLIST_TYPE_START_FOLDER:
+        {
+          json_t *folder = folder_to_json(pc, i, json_object());
+          json_t *playlists = json_array();
+          json_object_set_new(folder, "playlists", playlists);
+          json_array_append_new(array, folder);
+          container_entries_to_json(pc, index, options, session, playlists,
+                                    status);
+        }
+        break;
 
-  // Parse index
-  const char *index_field = evhttp_find_header(&query_fields, "index");
-  int index;
+      case SP_PLAYLIST_TYPE_END_FOLDER:
+        return;
 
-  if (index_field == NULL || sscanf(index_field, "%d", &index) <= 0) {
-    send_error(request, HTTP_BADREQUEST,
-               "Bad parameter: index must be numeric");
-    return;
-  }
+      case SP_PLAYLIST_TYPE_PLAYLIST:
+        {
+          sp_playlist *playlist = sp_playlistcontainer_playlist(pc, i);
 
-  // Parse JSON
-  json_error_t loads_error;
-  json_t *json = read_request_body_json(request, &loads_error);
+          if (playlist == NULL)
+            break;
 
-  if (json == NULL) {
-    send_error(request, HTTP_BADREQUEST,
-               loads_error.text ? loads_error.text : "Unable to parse JSON");
-    return;
+          if (!sp_playlist_is_loaded(playlist)) {
+            if (session != NULL)
+              sp_playlist_set_in_ram(session, playlist, true);
+
+            *status = HTTP_PARTIAL;
+            break;
+          }
+
+          json_t *playlist_json = json_object();
+          playlist_to_json_with_options(playlist, options, playlist_json);
+          json_array_append_new(array, playlist_json);
+        }
+        break;
+
+      default:
+        break;
+    }
   }
+}
 
-  if (!json_is_array(json)) {
-    json_decref(json);
-    send_error(request, HTTP_BADREQUEST, "Not valid JSON array");
-    return;
+// Returns the index of a folder's start marker, or -1
+static int find_folder(sp_playlistcontainer *pc, uint64_t folder_id) {
+  for (int i = 0; i < sp_playlistcontainer_num_playlists(pc); i++) {
+    if (sp_playlistcontainer_playlist_type(pc, i) ==
+            SP_PLAYLIST_TYPE_START_FOLDER &&
+        sp_playlistcontainer_playlist_folder_id(pc, i) == folder_id)
+      return i;
   }
 
-  // Handle empty array
-  int num_tracks = json_array_size(json);
+  return -1;
+}
 
-  if (num_tracks == 0) {
-    send_reply(request, HTTP_OK, "OK", NULL);
-    return;
-  }
+// Parses ?folder=<hex ID>. Returns false if it's given but isn't an ID.
+static bool parse_folder_query(struct evhttp_request *request,
+                               bool *given,
+                               uint64_t *folder_id) {
+  *given = false;
+  const char *query = evhttp_uri_get_query(request_uri(request));
 
-  sp_track **tracks = calloc(num_tracks, sizeof (sp_track *));
-  int num_valid_tracks = json_to_tracks(json, tracks, num_tracks);
-  json_decref(json);
+  if (query == NULL)
+    return true;
 
-  // Bail if no tracks could be read from input
-  if (num_valid_tracks == 0) {
-    send_error(request, HTTP_BADREQUEST, "No valid tracks");
-    free(tracks);
-    return;
-  }
+  struct evkeyvalq query_fields;
 
-  struct playlist_handler *handler = register_playlist_callbacks(
-      playlist, request, &get_playlist,
-      &playlist_update_in_progress_callbacks, NULL);
-  sp_error add_tracks_error = sp_playlist_add_tracks(playlist, tracks,
-                                                     num_valid_tracks,
-                                                     index, session);
+  if (evhttp_parse_query_str(query, &query_fields) != 0)
+    return false;
+
+  const char *folder_field = evhttp_find_header(&query_fields, "folder");
+  bool valid = true;
 
-  if (add_tracks_error != SP_ERROR_OK) {
-    sp_playlist_remove_callbacks(playlist, handler->playlist_callbacks,
-                                 handler);
-    free(handler);
-    send_error_sp(request, HTTP_BADREQUEST, add_tracks_error);
+  if (folder_field != NULL) {
+    char *end;
+    errno = 0;
+    *folder_id = strtoull(folder_field, &end, 16);
+    *given = true;
+    valid = *folder_field != '\0' && *end == '\0' && errno == 0;
   }
 
-  free(tracks);
+  evhttp_clear_headers(&query_fields);
+  return valid;
 }
 
-static void put_playlist_remove_tracks(sp_playlist *playlist,
-                                       struct evhttp_request *request,
-                                       void *userdata) {
-  // sp_session *session = userdata;
-  const char *uri = evhttp_request_get_uri(request);
-  struct evkeyvalq query_fields;
-  evhttp_parse_query(uri, &query_fields);
-
-  // Parse index
-  const char *index_field = evhttp_find_header(&query_fields, "index");
-  int index;
+// Folders are nested: {folderId, title, playlists} holds what's between a
+// folder's start and end markers. ?folder=<folderId> only renders that
+// folder, and only asks its playlists to load.
+//
+// With ?shallow=1 only what the container listing itself needs is emitted:
+// uri, title, creator, collaborative and the number of tracks. No track is
+// looked at. Each playlist is rendered once and kept until it changes, so a
+// change to one playlist doesn't cost rendering all of them again.
+static void get_user_playlists(sp_playlistcontainer *pc,
+                               struct evhttp_request *request,
+                               void *userdata) {
+  struct state *state = userdata;
+  bool shallow = request_has_flag(request, "shallow");
+  bool folder_given;
+  uint64_t folder_id = 0;
 
-  if (index_field == NULL ||
-      sscanf(index_field, "%d", &index) <= 0 ||
-      index < 0) {
+  if (!parse_folder_query(request, &folder_given, &folder_id)) {
     send_error(request, HTTP_BADREQUEST,
-               "Bad parameter: index must be numeric");
+               "Bad parameter: folder must be a hexadecimal folder ID");
     return;
   }
 
-  const char *count_field = evhttp_find_header(&query_fields, "count");
-  int count;
+  if (shallow && !folder_given) {
+    enum reply_format format = negotiate_reply_format(request);
+    struct listing *listing = listing_cache_get(state->listing_cache, pc,
+                                                format);
 
-  if (count_field == NULL ||
-      sscanf(count_field, "%d", &count) <= 0 ||
-      count < 1) {
-    send_error(request, HTTP_BADREQUEST,
-               "Bad parameter: count must be numeric and positive");
-    return;
+    if (listing != NULL) {
+      send_listing(request, listing, format);
+      return;
+    }
   }
 
-  int *tracks = calloc(count, sizeof(int));
+  struct playlist_json_options options = {
+    .fields = shallow ? PLAYLIST_FIELDS_SHALLOW : PLAYLIST_FIELDS_DEFAULT,
+    .offset = 0,
+    .limit = -1,
+    .expand_tracks = false
+  };
+  int status = HTTP_OK;
+  int index = 0;
+  json_t *json = json_object();
 
-  for (int i = 0; i < count; i++)
-    tracks[i] = index + i;
+  if (folder_given) {
+    int start = find_folder(pc, folder_id);
 
-  struct playlist_handler *handler = register_playlist_callbacks(
-      playlist, request, &get_playlist,
-      &playlist_update_in_progress_callbacks, NULL);
-  sp_error remove_tracks_error = sp_playlist_remove_tracks(playlist, tracks, 
-                                                           count);
+    if (start < 0) {
+      json_decref(json);
+      send_error(request, HTTP_NOTFOUND, "Folder not found");
+      return;
+    }
 
-  if (remove_tracks_error != SP_ERROR_OK) {
-    sp_playlist_remove_callbacks(playlist, handler->playlist_callbacks, handler);
-    free(handler);
-    send_error_sp(request, HTTP_BADREQUEST, remove_tracks_error);
+    folder_to_json(pc, start, json);
+    index = start + 1;
   }
 
-  free(tracks);
+  json_t *playlists = json_array();
+  json_object_set_new(json, "playlists", playlists);
+  container_entries_to_json(pc, &index, &options,
+                            folder_given ? state->session : NULL,
+                            playlists, &status);
+  send_reply_json(request, status, status == HTTP_OK ? "OK" : "Partial Content",
+                  json);
 }
 
-static void put_playlist_patch(sp_playlist *playlist,
-                               struct evhttp_request *request,
-                               void *userdata) {
-  struct state *state = userdata;
-  struct evbuffer *buf = evhttp_request_get_input_buffer(request);
-  size_t buflen = evbuffer_get_length(buf);
-
-  if (buflen == 0) {
-    send_error(request, HTTP_BADREQUEST, "No body");
-    return;
-  }
-
-  // Read request body
+static void put_user_inbox(const char *user,
+                           struct evhttp_request *request,
+                           void *userdata) {
   json_error_t loads_error;
   json_t *json = read_request_body_json(request, &loads_error);
 
   if (json == NULL) {
     send_error(request, HTTP_BADREQUEST,
-               loads_error.text ? loads_error.text : "Unable to parse JSON");
+        loads_error.text ? loads_error.text : "Unable to parse JSON");
     return;
   }
 
-  if (!json_is_array(json)) {
+  if (!json_is_object(json)) {
     json_decref(json);
-    send_error(request, HTTP_BADREQUEST, "Not valid JSON array");
+    send_error(request, HTTP_BADREQUEST, "Not valid JSON object");
     return;
   }
 
-  // Handle empty array
-  int num_tracks = json_array_size(json);
+  json_t *tracks_json = json_object_get(json, "tracks");
+
+  if (!json_is_array(tracks_json)) {
+    json_decref(json);
+    send_error(request, HTTP_BADREQUEST, "tracks is not valid JSON array");
+    return;
+  }
 
-  if (num_tracks == 0) {
+  // Handle empty array
+  if (json_array_size(tracks_json) == 0) {
+    json_decref(json);
     send_reply(request, HTTP_OK, "OK", NULL);
     return;
   }
 
-  sp_track **tracks = calloc(num_tracks, sizeof (sp_track *));
-  int num_valid_tracks = 0;
+  struct inbox_post *post = request_alloc(request, sizeof(struct inbox_post));
 
-  for (int i = 0; i < num_tracks; i++) {
-    json_t *item = json_array_get(json, i);
+  if (post == NULL ||
+      !track_batch_from_json(&post->batch, tracks_json,
+                             request_arena(request))) {
+    json_decref(json);
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
 
-    if (!json_is_string(item)) {
-      json_decref(item);
-      continue;
+  post->request = request;
+
+  if (post->batch.num_tracks == 0) {
+    send_error(request, HTTP_BADREQUEST, "No valid tracks");
+  } else {
+    json_t *message_json = json_object_get(json, "message");
+    struct state *state = userdata;
+    sp_inbox *inbox = sp_inbox_post_tracks(state->session, user,
+        post->batch.tracks, post->batch.num_tracks,
+        json_is_string(message_json) ? json_string_value(message_json) : "",
+        &inbox_post_complete, post);
+
+    if (inbox == NULL) {
+      track_batch_release(&post->batch);
+      send_error(request, HTTP_ERROR,
+                 "Failed to initialize request to add tracks to user's inbox");
     }
+  }
 
-    char *uri = strdup(json_string_value(item));
-    sp_link *track_link = sp_link_create_from_string(uri);
-    free(uri);
+  json_decref(json);
+}
 
-    if (track_link == NULL)
-      continue;
+// A POST /tracks/availability waiting for metadata on the tracks it asks
+// about that aren't cached
+struct availability_request {
+  struct state *state;
+  struct evhttp_request *request;
+  struct track_batch batch;
+  sp_track_availability *availability;
+  bool *known;
+};
 
-    if (sp_link_type(track_link) != SP_LINKTYPE_TRACK) {
-      sp_link_release(track_link);
-      continue;
+static void send_tracks_availability(bool complete, void *userdata) {
+  struct availability_request *lookup = userdata;
+  struct state *state = lookup->state;
+  struct track_batch *batch = &lookup->batch;
+  json_t *json = json_object();
+  json_t *tracks = json_array();
+  json_object_set_new(json, "tracks", tracks);
+  int status = HTTP_OK;
+
+  for (int i = 0; i < batch->num_tracks; i++) {
+    const unsigned char *track_id = batch->track_ids + i * TRACK_ID_SIZE;
+    sp_track *track = batch->tracks[i];
+
+    if (!lookup->known[i] && sp_track_is_loaded(track)) {
+      lookup->availability[i] = sp_track_get_availability(state->session,
+                                                          track);
+      lookup->known[i] = true;
+
+      if (state->availability != NULL)
+        availability_cache_put(state->availability, track_id,
+                               lookup->availability[i]);
     }
 
-    sp_track *track = sp_link_as_track(track_link);
+    char uri[TRACK_URI_LENGTH + 1];
+    track_id_to_uri(track_id, uri);
+    json_t *track_json = json_object();
+    json_object_set_new(track_json, "uri", json_string_nocheck(uri));
+    json_array_append_new(tracks, track_json);
 
-    if (track == NULL)
+    if (!lookup->known[i]) {
+      status = HTTP_PARTIAL;
       continue;
+    }
 
-    tracks[num_valid_tracks++] = track;
+    json_object_set_new(track_json, "availability", json_string_nocheck(
+        track_availability_name(lookup->availability[i])));
   }
 
-  json_decref(json);
+  if (batch->num_rejected > 0) {
+    json_t *rejected = json_array();
 
-  // Bail if no tracks could be read from input
-  if (num_valid_tracks == 0) {
-    send_error(request, HTTP_BADREQUEST, "No valid tracks");
-    free(tracks);
-    return;
-  }
+    for (int i = 0; i < batch->num_rejected; i++)
+      json_array_append_new(rejected, json_integer(batch->rejected[i]));
 
-  tracks = realloc(tracks, num_valid_tracks * sizeof (sp_track *));
+    json_object_set_new(json, "rejected", rejected);
+  }
 
-  // Apply diff
-  apr_pool_t *pool = state->pool;
-  svn_diff_t *diff;
-  svn_error_t *diff_error = diff_playlist_tracks(&diff, playlist, tracks, 
-                                                 num_valid_tracks, pool); 
+  track_batch_release(batch);
+  send_reply_json(lookup->request, status,
+                  status == HTTP_OK ? "OK" : "Partial Content", json);
+}
 
-  if (diff_error != SVN_NO_ERROR) {
-    free(tracks);
-    svn_handle_error2(diff_error, stderr, false, "Diff");
-    send_error(request, HTTP_BADREQUEST, "Search failed");
+// Answers with the availability of each track in the body, in order. Cached
+// answers are used as they are; the rest wait for metadata together, for a
+// few seconds at most. Tracks still loading after that have no availability
+// and make the status 210. Positions of entries that aren't tracks are
+// listed under "rejected".
+static void post_tracks_availability(struct evhttp_request *request,
+                                     struct state *state) {
+  struct availability_request *lookup = request_alloc(
+      request, sizeof(struct availability_request));
+  json_error_t read_error;
+
+  if (lookup == NULL) {
+    send_error(request, HTTP_ERROR, "Out of memory");
     return;
   }
 
-  svn_error_t *apply_error = diff_playlist_tracks_apply(diff, playlist, tracks,
-                                                        num_valid_tracks,
-                                                        state->session);
-
-  if (apply_error != SVN_NO_ERROR) {
-    free(tracks);
-    svn_handle_error2(apply_error, stderr, false, "Updating playlist");
-    send_error(request, HTTP_BADREQUEST, "Could not apply diff");
+  if (!read_request_body_tracks(request, &lookup->batch, &read_error)) {
+    send_error(request, HTTP_BADREQUEST, read_error.text);
     return;
   }
 
-  if (!sp_playlist_has_pending_changes(playlist)) {
-    free(tracks);
-    get_playlist(playlist, request, NULL);
+  int num_tracks = lookup->batch.num_tracks;
+  lookup->state = state;
+  lookup->request = request;
+  lookup->availability = request_calloc(request, num_tracks,
+                                        sizeof(sp_track_availability));
+  lookup->known = request_calloc(request, num_tracks, sizeof(bool));
+  sp_track **pending = request_calloc(request, num_tracks, sizeof(sp_track *));
+
+  if (lookup->availability == NULL || lookup->known == NULL ||
+      pending == NULL) {
+    track_batch_release(&lookup->batch);
+    send_error(request, HTTP_ERROR, "Out of memory");
     return;
   }
 
-  free(tracks);
-  register_playlist_callbacks(playlist, request, &get_playlist,
-                              &playlist_update_in_progress_callbacks, NULL);
-}
+  int num_pending = 0;
 
-static void handle_user_request(struct evhttp_request *request,
-                                char *action,
-                                const char *canonical_username,
-                                sp_session *session) {
-  if (action == NULL) {
-    evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
-    return;
+  for (int i = 0; i < num_tracks; i++) {
+    const struct availability_entry *entry = state->availability != NULL ?
+        availability_cache_get(state->availability,
+                               lookup->batch.track_ids + i * TRACK_ID_SIZE) :
+        NULL;
+
+    if (entry != NULL) {
+      lookup->availability[i] = entry->availability;
+      lookup->known[i] = true;
+    } else {
+      pending[num_pending++] = lookup->batch.tracks[i];
+    }
   }
 
-  int http_method = evhttp_request_get_command(request);
+  struct timeval timeout = {kMetadataTimeout, 0};
+  metadata_wait_tracks(state->metadata_waits, pending, num_pending, &timeout,
+                       &send_tracks_availability, lookup);
+}
 
-  switch (http_method) {
-    case EVHTTP_REQ_GET:
-      if (strncmp(action, "playlists", 9) == 0) {
-        sp_playlistcontainer *pc = sp_session_publishedcontainer_for_user_create(
-            session, canonical_username);
+// A GET /track/{uri} or POST /tracks, waiting for metadata of the tracks
+// that aren't cached
+struct track_request {
+  struct state *state;
+  struct evhttp_request *request;
+  enum reply_format format;
+  struct track_batch batch;
+  bool single;  // The track itself rather than {tracks, rejected}
+  struct track_waiter *waiters;
+  int num_waiting;
+};
 
-        if (sp_playlistcontainer_is_loaded(pc)) {
-          get_user_playlists(pc, request, session);
-        } else {
-          register_playlistcontainer_callbacks(pc, request,
-              &get_user_playlists,
-              &playlistcontainer_loaded_callbacks,
-              session);
-        }
-      } else if (strncmp(action, "starred", 7) == 0) {
-        sp_playlist *playlist = sp_session_starred_for_user_create(session,
-            canonical_username);
+// Adds a track, from the cache if it's there. Tracks with all their
+// metadata are cached. Returns false if the track's metadata isn't loaded.
+static bool add_track(struct track_request *lookup,
+                      int index,
+                      struct evbuffer *buf) {
+  struct track_cache *cache = lookup->state->track_cache;
+  const unsigned char *track_id = lookup->batch.track_ids +
+                                  index * TRACK_ID_SIZE;
+  const struct track_cache_entry *entry = track_cache_get(cache, track_id,
+                                                          lookup->format);
+
+  if (entry != NULL) {
+    evbuffer_add(buf, entry->body, entry->body_len);
+    return true;
+  }
 
-        if (sp_playlist_is_loaded(playlist)) {
-          get_playlist(playlist, request, session);
-        } else {
-          register_playlist_callbacks(playlist, request, &get_playlist,
-              &playlist_state_changed_callbacks,
-              session);
-        }
-      }
-      break;
+  sp_track *track = lookup->batch.tracks[index];
+  bool complete = track_metadata_is_loaded(track);
+  struct evbuffer *rendered = evbuffer_new();
+  json_t *json = track_to_json(track, NULL, json_object());
+  render_json(json, lookup->format, rendered);
+  json_decref(json);
 
-    case EVHTTP_REQ_PUT:
+  if (complete) {
+    size_t rendered_len = evbuffer_get_length(rendered);
+    track_cache_put(cache, track_id, lookup->format,
+                    (const char *) evbuffer_pullup(rendered, rendered_len),
+                    rendered_len);
+  }
+
+  evbuffer_add_buffer(buf, rendered);
+  evbuffer_free(rendered);
+  return complete;
+}
+
+static void send_tracks(struct track_request *lookup) {
+  struct evhttp_request *request = lookup->request;
+  struct track_batch *batch = &lookup->batch;
+  enum reply_format format = lookup->format;
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+  bool complete = true;
+
+  if (lookup->single) {
+    complete = add_track(lookup, 0, buf);
+  } else {
+    if (format == REPLY_FORMAT_JSON) {
+      evbuffer_add_printf(buf, "{\"tracks\":[");
+    } else {
+      msgpack_pack_map_header(buf, batch->num_rejected > 0 ? 2 : 1);
+      msgpack_pack_string(buf, "tracks");
+      msgpack_pack_array_header(buf, batch->num_tracks);
+    }
+
+    for (int i = 0; i < batch->num_tracks; i++) {
+      if (format == REPLY_FORMAT_JSON && i > 0)
+        evbuffer_add(buf, ",", 1);
+
+      if (!add_track(lookup, i, buf))
+        complete = false;
+    }
+
+    if (format == REPLY_FORMAT_JSON)
+      evbuffer_add(buf, "]", 1);
+
+    if (batch->num_rejected > 0) {
+      json_t *rejected = json_array();
+
+      for (int i = 0; i < batch->num_rejected; i++)
+        json_array_append_new(rejected, json_integer(batch->rejected[i]));
+
+      if (format == REPLY_FORMAT_JSON)
+        evbuffer_add_printf(buf, ",\"rejected\":");
+      else
+        msgpack_pack_string(buf, "rejected");
+
+      render_json(rejected, format, buf);
+      json_decref(rejected);
+    }
+
+    if (format == REPLY_FORMAT_JSON)
+      evbuffer_add(buf, "}", 1);
+  }
+
+  track_batch_release(batch);
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Content-type", reply_format_content_type(format));
+  send_reply(request, complete ? HTTP_OK : HTTP_PARTIAL,
+             complete ? "OK" : "Partial Content", buf);
+}
+
+static void track_loaded(bool complete, void *userdata) {
+  struct track_request *lookup = userdata;
+
+  if (--lookup->num_waiting == 0)
+    send_tracks(lookup);
+}
+
+// Waits for metadata on the tracks that are neither cached nor loaded, for a
+// few seconds at most, then sends them all. Tracks someone else is already
+// waiting for join that wait. Any that didn't load make the status 210.
+static void lookup_tracks(struct track_request *lookup) {
+  struct state *state = lookup->state;
+  struct track_batch *batch = &lookup->batch;
+  lookup->waiters = request_calloc(lookup->request, batch->num_tracks,
+                                   sizeof(struct track_waiter));
+
+  if (lookup->waiters == NULL) {
+    track_batch_release(batch);
+    send_error(lookup->request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  struct timeval timeout = {kMetadataTimeout, 0};
+  lookup->num_waiting = 1;  // Until every wait has started
+
+  for (int i = 0; i < batch->num_tracks; i++) {
+    const unsigned char *track_id = batch->track_ids + i * TRACK_ID_SIZE;
+
+    if (track_cache_contains(state->track_cache, track_id, lookup->format) ||
+        track_metadata_is_loaded(batch->tracks[i]))
+      continue;
+
+    lookup->num_waiting++;
+    track_cache_wait(state->track_cache, batch->tracks[i], track_id, &timeout,
+                     &lookup->waiters[i], &track_loaded, lookup);
+  }
+
+  track_loaded(true, lookup);
+}
+
+static struct track_request *track_request_new(struct evhttp_request *request,
+                                               struct state *state,
+                                               bool single) {
+  struct track_request *lookup = request_alloc(request,
+                                               sizeof(struct track_request));
+
+  if (lookup == NULL)
+    return NULL;
+
+  lookup->state = state;
+  lookup->request = request;
+  lookup->format = negotiate_reply_format(request);
+  lookup->single = single;
+  return lookup;
+}
+
+// Answers with a track's uri, title, artists, album, duration and
+// popularity
+static void get_track(struct evhttp_request *request,
+                      const char *track_uri,
+                      struct state *state) {
+  struct track_request *lookup = track_request_new(request, state, true);
+  json_t *uris = json_array();
+  json_array_append_new(uris, json_string(track_uri));
+
+  if (lookup == NULL ||
+      !track_batch_from_json(&lookup->batch, uris, request_arena(request))) {
+    json_decref(uris);
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  json_decref(uris);
+
+  if (lookup->batch.num_tracks == 0) {
+    send_error(request, HTTP_BADREQUEST, "Not a track URI");
+    return;
+  }
+
+  lookup_tracks(lookup);
+}
+
+// Answers with the tracks in the body, in order, like GET /track/{uri}.
+// Positions of entries that aren't tracks are listed under "rejected".
+static void post_tracks(struct evhttp_request *request, struct state *state) {
+  struct track_request *lookup = track_request_new(request, state, false);
+  json_error_t read_error;
+
+  if (lookup == NULL) {
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  if (!read_request_body_tracks(request, &lookup->batch, &read_error)) {
+    send_error(request, HTTP_BADREQUEST, read_error.text);
+    return;
+  }
+
+  lookup_tracks(lookup);
+}
+
+// A playlist this server has changed, kept until Spotify has synced the
+// change so that shutting down can wait for it
+struct touched_playlist {
+  sp_playlist *playlist;
+  TAILQ_ENTRY(touched_playlist) entries;
+};
+
+TAILQ_HEAD(touched_playlist_list, touched_playlist);
+
+static struct touched_playlist_list touched_playlists =
+    TAILQ_HEAD_INITIALIZER(touched_playlists);
+
+// Forgets playlists that have synced. Returns how many were forgotten.
+static int touched_playlists_prune(void) {
+  int num_synced = 0;
+  struct touched_playlist *touched = TAILQ_FIRST(&touched_playlists);
+
+  while (touched != NULL) {
+    struct touched_playlist *next = TAILQ_NEXT(touched, entries);
+
+    if (!sp_playlist_has_pending_changes(touched->playlist)) {
+      TAILQ_REMOVE(&touched_playlists, touched, entries);
+      sp_playlist_release(touched->playlist);
+      free(touched);
+      num_synced++;
+    }
+
+    touched = next;
+  }
+
+  return num_synced;
+}
+
+static int touched_playlists_count(void) {
+  int count = 0;
+  struct touched_playlist *touched;
+
+  TAILQ_FOREACH(touched, &touched_playlists, entries)
+    count++;
+
+  return count;
+}
+
+static void touch_playlist(sp_playlist *playlist) {
+  touched_playlists_prune();
+  struct touched_playlist *touched;
+
+  TAILQ_FOREACH(touched, &touched_playlists, entries) {
+    if (touched->playlist == playlist)
+      return;
+  }
+
+  touched = malloc(sizeof(struct touched_playlist));
+
+  if (touched == NULL)
+    return;
+
+  touched->playlist = playlist;
+  sp_playlist_add_ref(playlist);
+  TAILQ_INSERT_TAIL(&touched_playlists, touched, entries);
+}
+
+static void put_playlist(sp_playlist *playlist,
+                         struct evhttp_request *request,
+                         void *userdata) {
+  // TODO(liesen): playlist there so that signatures of all handler methods are
+  // the same, but do they have to be?
+  assert(playlist == NULL);
+
+  struct state *state = userdata;
+  json_error_t loads_error;
+  json_t *playlist_json = read_request_body_json(request, &loads_error);
+
+  if (playlist_json == NULL) {
+    send_error(request, HTTP_BADREQUEST,
+               loads_error.text ? loads_error.text : "Unable to parse JSON");
+    return;
+  }
+
+  // Parse playlist
+  if (!json_is_object(playlist_json)) {
+    send_error(request, HTTP_BADREQUEST, "Invalid playlist object");
+    return;
+  }
+
+  // Get title
+  json_t *title_json = json_object_get(playlist_json, "title");
+
+  if (title_json == NULL) {
+    json_decref(playlist_json);
+    send_error(request, HTTP_BADREQUEST,
+               "Invalid playlist: title is missing");
+    return;
+  }
+
+  if (!json_is_string(title_json)) {
+    json_decref(playlist_json);
+    send_error(request, HTTP_BADREQUEST,
+               "Invalid playlist: title is not a string");
+    return;
+  }
+
+  char title[kMaxPlaylistTitleLength];
+  strncpy(title, json_string_value(title_json), kMaxPlaylistTitleLength);
+  json_decref(playlist_json);
+
+  // Add new playlist
+  sp_playlistcontainer *pc = sp_session_playlistcontainer(state->session);
+  playlist = sp_playlistcontainer_add_new_playlist(pc, title);
+
+  if (playlist == NULL) {
+    send_error(request, HTTP_ERROR, "Unable to create playlist");
+  } else {
+    touch_playlist(playlist);
+    register_playlist_callbacks(playlist, request, &get_playlist,
+                                &playlist_state_changed_callbacks, state);
+  }
+}
+
+// A change to a playlist that is applied in chunks on behalf of a request
+struct playlist_change {
+  sp_playlist *playlist;
+  struct evhttp_request *request;
+  struct state *state;
+  struct track_batch batch;  // Holds the added tracks until they're applied
+  struct playlist_ops ops;
+  unsigned long journal_id;  // 0 if the change isn't journaled
+};
+
+static void playlist_change_progress(long done, long total, void *userdata) {
+  struct playlist_change *change = userdata;
+  struct request_context *context = request_context_get(change->request);
+
+  if (context != NULL && context->job != NULL) {
+    context->job->progress = done;
+    context->job->total = total;
+  }
+}
+
+static void playlist_change_end(struct playlist_change *change) {
+  if (change->journal_id != 0)
+    journal_end(change->state->journal, change->journal_id);
+
+  change->journal_id = 0;
+}
+
+static void playlist_change_synced(sp_playlist *playlist,
+                                   struct evhttp_request *request,
+                                   void *userdata) {
+  struct playlist_change *change = userdata;
+  playlist_change_end(change);
+  get_playlist(playlist, request, change->state);
+}
+
+static void playlist_change_done(sp_error error, void *userdata) {
+  struct playlist_change *change = userdata;
+  track_batch_release(&change->batch);
+
+  if (error != SP_ERROR_OK) {
+    playlist_change_end(change);
+    send_error_sp(change->request, HTTP_BADREQUEST, error);
+    return;
+  }
+
+  // Reply with the playlist once the last chunk has been synced
+  if (!sp_playlist_has_pending_changes(change->playlist)) {
+    playlist_change_synced(change->playlist, change->request, change);
+    return;
+  }
+
+  struct playlist_handler *handler = register_playlist_callbacks(
+      change->playlist, change->request, &playlist_change_synced,
+      &playlist_update_in_progress_callbacks, change);
+
+  if (handler == NULL) {
+    playlist_change_end(change);
+    send_error(change->request, HTTP_ERROR, "Out of memory");
+  }
+}
+
+static void playlist_change_apply(struct playlist_change *change) {
+  struct state *state = change->state;
+
+  if (!playlist_apply(state->event_base, state->session, change->playlist,
+                      &change->ops, state->chunk_size, kChunkSyncTimeout,
+                      &playlist_change_progress, &playlist_change_done,
+                      change)) {
+    playlist_ops_free(&change->ops);
+    track_batch_release(&change->batch);
+    playlist_change_end(change);
+    send_error(change->request, HTTP_ERROR, "Out of memory");
+  }
+}
+
+static void playlist_change_committed(bool ok, void *userdata) {
+  struct playlist_change *change = userdata;
+
+  if (ok) {
+    playlist_change_apply(change);
+    return;
+  }
+
+  playlist_ops_free(&change->ops);
+  track_batch_release(&change->batch);
+  playlist_change_end(change);
+  send_error(change->request, HTTP_ERROR, "Could not write journal");
+}
+
+static json_t *track_ids_to_json(const unsigned char *track_ids,
+                                 int num_tracks) {
+  json_t *json = json_array();
+
+  for (int i = 0; i < num_tracks; i++) {
+    char uri[TRACK_URI_LENGTH + 1];
+    track_id_to_uri(track_ids + i * TRACK_ID_SIZE, uri);
+    json_array_append_new(json, json_string(uri));
+  }
+
+  return json;
+}
+
+// Describes a change well enough to finish it after a restart. Adds and
+// removes are one operation; a patch is recorded as the tracks it ends with.
+static json_t *playlist_change_record(struct playlist_change *change,
+                                      const char *action) {
+  char playlist_uri[kMaxPlaylistLinkLength];
+
+  if (!get_playlist_uri(change->playlist, playlist_uri))
+    return NULL;
+
+  int before = sp_playlist_num_tracks(change->playlist);
+  int after = before;
+
+  for (int i = 0; i < change->ops.num_ops; i++) {
+    struct playlist_op *op = &change->ops.ops[i];
+    after += op->type == PLAYLIST_OP_ADD ? op->count : -op->count;
+  }
+
+  json_t *record = json_object();
+  json_object_set_new(record, "playlist", json_string(playlist_uri));
+  json_object_set_new(record, "action", json_string(action));
+  json_object_set_new(record, "before", json_integer(before));
+  json_object_set_new(record, "after", json_integer(after));
+
+  if (strcmp(action, "patch") == 0) {
+    json_object_set_new(record, "tracks",
+                        track_ids_to_json(change->batch.track_ids,
+                                          change->batch.num_tracks));
+  } else if (change->ops.num_ops > 0) {
+    struct playlist_op *op = &change->ops.ops[0];
+    json_object_set_new(record, "position", json_integer(op->position));
+    json_object_set_new(record, "count", json_integer(op->count));
+
+    if (op->type == PLAYLIST_OP_ADD) {
+      long offset = op->tracks - change->batch.tracks;
+      json_object_set_new(record, "tracks",
+                          track_ids_to_json(change->batch.track_ids +
+                                            offset * TRACK_ID_SIZE,
+                                            op->count));
+    }
+  }
+
+  return record;
+}
+
+// Applies `ops` to a playlist and replies with the playlist when done. Takes
+// over the batch and the operations. With a journal, the change is recorded
+// before it's made.
+static void start_playlist_change(sp_playlist *playlist,
+                                  struct evhttp_request *request,
+                                  struct state *state,
+                                  const char *action,
+                                  struct track_batch *batch,
+                                  struct playlist_ops *ops) {
+  struct playlist_change *change = request_alloc(
+      request, sizeof(struct playlist_change));
+
+  if (change == NULL) {
+    playlist_ops_free(ops);
+    track_batch_release(batch);
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  change->playlist = playlist;
+  change->request = request;
+  change->state = state;
+  change->batch = *batch;
+  change->ops = *ops;
+  change->journal_id = 0;
+  touch_playlist(playlist);
+
+  if (state->journal == NULL) {
+    playlist_change_apply(change);
+    return;
+  }
+
+  json_t *record = playlist_change_record(change, action);
+
+  if (record != NULL) {
+    change->journal_id = journal_begin(state->journal, record,
+                                       &playlist_change_committed, change);
+    json_decref(record);
+  }
+
+  if (change->journal_id == 0) {
+    playlist_ops_free(&change->ops);
+    track_batch_release(&change->batch);
+    send_error(request, HTTP_ERROR, "Out of memory");
+  }
+}
+
+static void put_playlist_add_tracks(sp_playlist *playlist,
+                                    struct evhttp_request *request,
+                                    void *userdata) {
+  struct state *state = userdata;
+  const char *query = evhttp_uri_get_query(request_uri(request));
+  struct evkeyvalq query_fields;
+  evhttp_parse_query_str(query != NULL ? query : "", &query_fields);
+
+  // Parse index
+  const char *index_field = evhttp_find_header(&query_fields, "index");
+  int index;
+
+  if (index_field == NULL || sscanf(index_field, "%d", &index) <= 0) {
+    send_error(request, HTTP_BADREQUEST,
+               "Bad parameter: index must be numeric");
+    return;
+  }
+
+  // Checked here because a large add is applied in chunks, and a bad index
+  // would only fail the first one
+  if (index < 0 || index > sp_playlist_num_tracks(playlist)) {
+    send_error(request, HTTP_BADREQUEST, "Bad parameter: index out of range");
+    return;
+  }
+
+  // Read tracks
+  json_error_t read_error;
+  struct track_batch batch;
+
+  if (!read_request_body_tracks(request, &batch, &read_error)) {
+    send_error(request, HTTP_BADREQUEST, read_error.text);
+    return;
+  }
+
+  // Handle empty array
+  if (batch.num_tracks == 0 && batch.num_rejected == 0) {
+    send_reply(request, HTTP_OK, "OK", NULL);
+    return;
+  }
+
+  // Bail if no tracks could be read from input
+  if (batch.num_tracks == 0) {
+    send_error(request, HTTP_BADREQUEST, "No valid tracks");
+    return;
+  }
+
+  struct playlist_ops ops;
+  playlist_ops_init(&ops);
+
+  if (!playlist_ops_append(&ops, PLAYLIST_OP_ADD, index, batch.num_tracks,
+                           batch.tracks)) {
+    track_batch_release(&batch);
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  start_playlist_change(playlist, request, state, "add", &batch, &ops);
+}
+
+static void put_playlist_remove_tracks(sp_playlist *playlist,
+                                       struct evhttp_request *request,
+                                       void *userdata) {
+  struct state *state = userdata;
+  const char *query = evhttp_uri_get_query(request_uri(request));
+  struct evkeyvalq query_fields;
+  evhttp_parse_query_str(query != NULL ? query : "", &query_fields);
+
+  // Parse index
+  const char *index_field = evhttp_find_header(&query_fields, "index");
+  int index;
+
+  if (index_field == NULL ||
+      sscanf(index_field, "%d", &index) <= 0 ||
+      index < 0) {
+    send_error(request, HTTP_BADREQUEST,
+               "Bad parameter: index must be numeric");
+    return;
+  }
+
+  const char *count_field = evhttp_find_header(&query_fields, "count");
+  int count;
+
+  if (count_field == NULL ||
+      sscanf(count_field, "%d", &count) <= 0 ||
+      count < 1) {
+    send_error(request, HTTP_BADREQUEST,
+               "Bad parameter: count must be numeric and positive");
+    return;
+  }
+
+  // A large remove is applied in chunks. Left to libspotify, a range past
+  // the end would fail only once the first chunks were gone.
+  int num_tracks = sp_playlist_num_tracks(playlist);
+
+  if (index >= num_tracks || count > num_tracks - index) {
+    send_error(request, HTTP_BADREQUEST,
+               "Bad parameter: index and count out of range");
+    return;
+  }
+
+  struct track_batch batch = { NULL, NULL, 0, NULL, 0 };
+  struct playlist_ops ops;
+  playlist_ops_init(&ops);
+
+  if (!playlist_ops_append(&ops, PLAYLIST_OP_REMOVE, index, count, NULL)) {
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  start_playlist_change(playlist, request, state, "remove", &batch, &ops);
+}
+
+static void put_playlist_patch(sp_playlist *playlist,
+                               struct evhttp_request *request,
+                               void *userdata) {
+  struct state *state = userdata;
+  json_error_t read_error;
+  struct track_batch batch;
+
+  if (!read_request_body_tracks(request, &batch, &read_error)) {
+    send_error(request, HTTP_BADREQUEST, read_error.text);
+    return;
+  }
+
+  // Handle empty array
+  if (batch.num_tracks == 0 && batch.num_rejected == 0) {
+    send_reply(request, HTTP_OK, "OK", NULL);
+    return;
+  }
+
+  // Bail if no tracks could be read from input
+  if (batch.num_tracks == 0) {
+    send_error(request, HTTP_BADREQUEST, "No valid tracks");
+    return;
+  }
+
+  // Apply diff
+  apr_pool_t *pool = svn_pool_create(state->pool);
+  svn_diff_t *diff;
+  svn_error_t *diff_error = diff_playlist_tracks(&diff, playlist,
+                                                 batch.tracks, batch.track_ids,
+                                                 batch.num_tracks, pool);
+
+  if (diff_error != SVN_NO_ERROR) {
+    svn_handle_error2(diff_error, stderr, false, "Diff");
+    svn_pool_destroy(pool);
+    track_batch_release(&batch);
+    send_error(request, HTTP_BADREQUEST, "Search failed");
+    return;
+  }
+
+  struct playlist_ops ops;
+  playlist_ops_init(&ops);
+  svn_error_t *ops_error = diff_playlist_tracks_ops(diff, batch.tracks,
+                                                    batch.num_tracks, &ops);
+  svn_pool_destroy(pool);
+
+  if (ops_error != SVN_NO_ERROR) {
+    svn_handle_error2(ops_error, stderr, false, "Updating playlist");
+    playlist_ops_free(&ops);
+    track_batch_release(&batch);
+    send_error(request, HTTP_BADREQUEST, "Could not apply diff");
+    return;
+  }
+
+  start_playlist_change(playlist, request, state, "patch", &batch, &ops);
+}
+
+static void handle_user_request(struct evhttp_request *request,
+                                char *action,
+                                const char *canonical_username,
+                                struct state *state) {
+  if (action == NULL) {
+    send_error(request, HTTP_BADREQUEST, "Bad Request");
+    return;
+  }
+
+  int http_method = request_method(request);
+
+  switch (http_method) {
+    case EVHTTP_REQ_GET:
+      if (strncmp(action, "playlists", 9) == 0) {
+        sp_playlistcontainer *pc = sp_session_publishedcontainer_for_user_create(
+            state->session, canonical_username);
+
+        if (sp_playlistcontainer_is_loaded(pc)) {
+          get_user_playlists(pc, request, state);
+        } else {
+          register_playlistcontainer_callbacks(pc, request,
+              &get_user_playlists,
+              &playlistcontainer_loaded_callbacks,
+              state);
+        }
+      } else if (strncmp(action, "starred", 7) == 0) {
+        sp_playlist *playlist = sp_session_starred_for_user_create(
+            state->session, canonical_username);
+
+        if (sp_playlist_is_loaded(playlist)) {
+          get_playlist(playlist, request, state);
+        } else {
+          register_playlist_callbacks(playlist, request, &get_playlist,
+              &playlist_state_changed_callbacks,
+              state);
+        }
+      } else {
+        send_error(request, HTTP_NOTFOUND, "Not Found");
+      }
+      break;
+
+    case EVHTTP_REQ_PUT:
     case EVHTTP_REQ_POST:
       if (strncmp(action, "inbox", 5) == 0) {
-        put_user_inbox(canonical_username, request, session);
+        put_user_inbox(canonical_username, request, state);
+      } else {
+        send_error(request, HTTP_NOTIMPL, "Not Implemented");
       }
       break;
 
-    default:
-      evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
-      break;
+    default:
+      send_error(request, HTTP_BADREQUEST, "Bad Request");
+      break;
+  }
+}
+
+// Responds with a background job's state and progress, and its reply once
+// it's done
+static void get_job(struct evhttp_request *request,
+                    const char *id,
+                    struct state *state) {
+  char *end;
+  unsigned long job_id = id != NULL ? strtoul(id, &end, 10) : 0;
+  struct job *job = id != NULL && *end == '\0' && state->jobs != NULL
+      ? jobs_get(state->jobs, job_id)
+      : NULL;
+
+  if (job == NULL) {
+    send_error(request, HTTP_NOTFOUND, "Job not found");
+    return;
+  }
+
+  json_t *json = json_object();
+  json_object_set_new(json, "id", json_integer(job->id));
+  json_object_set_new(json, "state", json_string(job_state_name(job->state)));
+
+  if (job->total > 0) {
+    json_t *progress = json_object();
+    json_object_set_new(progress, "done", json_integer(job->progress));
+    json_object_set_new(progress, "total", json_integer(job->total));
+    json_object_set_new(json, "progress", progress);
+  }
+
+  if (job->state == JOB_DONE) {
+    json_t *result = json_object();
+    json_object_set_new(result, "status", json_integer(job->code));
+    json_object_set_new(result, "message", json_string(job->message));
+    json_t *body = job->body_len > 0
+        ? json_loadb(job->body, job->body_len, 0, NULL)
+        : NULL;
+
+    if (body != NULL)
+      json_object_set_new(result, "body", body);
+
+    json_object_set_new(json, "result", result);
+  }
+
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+static double seconds_between(const struct timeval *from,
+                              const struct timeval *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+// Seconds spent offline so far, including the current outage
+static double seconds_offline(struct state *state) {
+  double seconds = state->offline_seconds;
+
+  if (state->ready && !state->online) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    seconds += seconds_between(&state->offline_since, &now);
+  }
+
+  return seconds;
+}
+
+// Responds with counters useful for tuning
+static void get_stats(struct evhttp_request *request, struct state *state) {
+  json_t *json = json_object();
+
+  json_t *requests = json_object();
+  json_object_set_new(requests, "active", json_integer(num_active_requests));
+  json_object_set_new(json, "requests", requests);
+
+  json_t *connection = json_object();
+  json_object_set_new(connection, "online", json_boolean(state->online));
+  json_object_set_new(connection, "outages", json_integer(state->outages));
+  json_object_set_new(connection, "offlineSeconds",
+                      json_real(seconds_offline(state)));
+  json_object_set_new(connection, "held", json_integer(num_held_requests));
+  json_object_set_new(connection, "maxHeld", json_integer(max_held_requests));
+  json_object_set_new(connection, "served", json_integer(num_held_served));
+  json_object_set_new(connection, "rejected",
+                      json_integer(num_held_rejected));
+  json_object_set_new(json, "connection", connection);
+
+  struct arena_stats arena_stats;
+  arena_get_stats(&arena_stats);
+  unsigned long mallocs = arena_stats.block_mallocs + arena_stats.large_mallocs;
+  json_t *arena = json_object();
+  json_object_set_new(arena, "arenas", json_integer(arena_stats.arenas));
+  json_object_set_new(arena, "allocations",
+                      json_integer(arena_stats.allocations));
+  json_object_set_new(arena, "blockMallocs",
+                      json_integer(arena_stats.block_mallocs));
+  json_object_set_new(arena, "blockReuses",
+                      json_integer(arena_stats.block_reuses));
+  json_object_set_new(arena, "largeMallocs",
+                      json_integer(arena_stats.large_mallocs));
+  json_object_set_new(arena, "mallocsPerRequest",
+                      json_real(arena_stats.arenas > 0 ?
+                                (double) mallocs / arena_stats.arenas : 0));
+  json_object_set_new(json, "arena", arena);
+
+  if (state->cache != NULL) {
+    json_t *cache = json_object();
+    json_object_set_new(cache, "entries",
+                        json_integer(state->cache->num_entries));
+    json_object_set_new(cache, "hits", json_integer(state->cache->hits));
+    json_object_set_new(cache, "misses", json_integer(state->cache->misses));
+    json_object_set_new(json, "cache", cache);
+  }
+
+  if (state->listing_cache != NULL) {
+    json_t *listings = json_object();
+    json_object_set_new(listings, "entries",
+                        json_integer(state->listing_cache->num_entries));
+    json_object_set_new(listings, "hits",
+                        json_integer(state->listing_cache->hits));
+    json_object_set_new(listings, "misses",
+                        json_integer(state->listing_cache->misses));
+    json_object_set_new(listings, "renders",
+                        json_integer(state->listing_cache->renders));
+    json_object_set_new(json, "listingCache", listings);
+  }
+
+  if (state->availability != NULL) {
+    json_t *availability = json_object();
+    json_object_set_new(availability, "entries",
+                        json_integer(state->availability->num_entries));
+    json_object_set_new(availability, "hits",
+                        json_integer(state->availability->hits));
+    json_object_set_new(availability, "misses",
+                        json_integer(state->availability->misses));
+    json_object_set_new(json, "availability", availability);
+  }
+
+  if (state->track_cache != NULL) {
+    json_t *tracks = json_object();
+    json_object_set_new(tracks, "entries",
+                        json_integer(state->track_cache->num_entries));
+    json_object_set_new(tracks, "hits", json_integer(state->track_cache->hits));
+    json_object_set_new(tracks, "misses",
+                        json_integer(state->track_cache->misses));
+    json_object_set_new(tracks, "coalesced",
+                        json_integer(state->track_cache->coalesced));
+    json_object_set_new(json, "trackCache", tracks);
+  }
+
+  if (state->idempotency != NULL) {
+    json_t *idempotency = json_object();
+    json_object_set_new(idempotency, "entries",
+                        json_integer(state->idempotency->num_entries));
+    json_object_set_new(idempotency, "replays",
+                        json_integer(state->idempotency->replays));
+    json_object_set_new(idempotency, "attached",
+                        json_integer(state->idempotency->attached));
+    json_object_set_new(json, "idempotency", idempotency);
+  }
+
+  if (state->jobs != NULL) {
+    json_t *jobs = json_object();
+    json_object_set_new(jobs, "queued", json_integer(state->jobs->num_queued));
+    json_object_set_new(jobs, "running",
+                        json_integer(state->jobs->num_running));
+    json_object_set_new(jobs, "done", json_integer(state->jobs->num_done));
+    json_object_set_new(json, "jobs", jobs);
+  }
+
+  struct apply_stats apply_stats;
+  apply_get_stats(&apply_stats);
+  json_t *apply = json_object();
+  json_object_set_new(apply, "running", json_integer(apply_stats.running));
+  json_object_set_new(apply, "chunks", json_integer(apply_stats.chunks));
+  json_object_set_new(apply, "tracks", json_integer(apply_stats.tracks));
+  json_object_set_new(apply, "syncTimeouts",
+                      json_integer(apply_stats.sync_timeouts));
+  json_object_set_new(json, "apply", apply);
+
+  if (state->shared_cache != NULL) {
+    struct shared_cache_stats shared_stats;
+    shared_cache_get_stats(state->shared_cache, &shared_stats);
+    json_t *shared = json_object();
+    json_object_set_new(shared, "worker", json_integer(state->worker));
+    json_object_set_new(shared, "hits", json_integer(shared_stats.hits));
+    json_object_set_new(shared, "misses", json_integer(shared_stats.misses));
+    json_object_set_new(shared, "stores", json_integer(shared_stats.stores));
+    json_object_set_new(shared, "busy", json_integer(shared_stats.busy));
+    json_object_set_new(json, "sharedCache", shared);
+  }
+
+  if (state->journal != NULL) {
+    struct journal_stats journal_stats;
+    journal_get_stats(state->journal, &journal_stats);
+    json_t *journal = json_object();
+    json_object_set_new(journal, "records",
+                        json_integer(journal_stats.records));
+    json_object_set_new(journal, "commits",
+                        json_integer(journal_stats.commits));
+    json_object_set_new(journal, "commitMicros",
+                        json_real(journal_stats.commits > 0 ?
+                                  (double) journal_stats.commit_usec /
+                                  journal_stats.commits : 0));
+    json_object_set_new(journal, "open", json_integer(journal_stats.open));
+    json_object_set_new(json, "journal", journal);
+  }
+
+  send_reply_json(request, HTTP_OK, "OK", json);
+}
+
+static int hex_digit_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+// Percent-decodes a URI path into memory from the arena
+static char *decode_path(struct arena *arena, const char *path) {
+  char *decoded = arena_alloc(arena, strlen(path) + 1);
+
+  if (decoded == NULL)
+    return NULL;
+
+  char *out = decoded;
+
+  while (*path != '\0') {
+    int high, low;
+
+    if (path[0] == '%' &&
+        (high = hex_digit_value(path[1])) >= 0 &&
+        (low = hex_digit_value(path[2])) >= 0) {
+      *out++ = (high << 4) | low;
+      path += 3;
+    } else {
+      *out++ = *path++;
+    }
+  }
+
+  *out = '\0';
+  return decoded;
+}
+
+// Answers a retry with the reply to its original request
+static void send_idempotent_reply(struct evhttp_request *request,
+                                  const struct idempotency_reply *reply) {
+  if (reply == NULL) {
+    send_error(request, HTTP_SERVUNAVAIL,
+               "Original request failed; retry with the same key");
+    return;
+  }
+
+  struct evkeyvalq *headers = evhttp_request_get_output_headers(request);
+  struct evbuffer *buf = evhttp_request_get_output_buffer(request);
+
+  if (reply->content_type != NULL)
+    evhttp_add_header(headers, "Content-type", reply->content_type);
+
+  evhttp_add_header(headers, "Idempotent-Replayed", "true");
+  evbuffer_add(buf, reply->body, reply->body_len);
+  send_reply(request, reply->code, reply->message, buf);
+}
+
+static void idempotency_original_replied(
+    const struct idempotency_reply *reply,
+    void *userdata) {
+  struct evhttp_request *request = userdata;
+  struct request_context *context = request_context_get(request);
+
+  if (context != NULL)
+    context->idempotency_waiter = NULL;
+
+  send_idempotent_reply(request, reply);
+}
+
+static void record_idempotent_reply(struct evhttp_request *request,
+                                    int code,
+                                    const char *message,
+                                    struct evbuffer *body,
+                                    void *userdata) {
+  struct request_context *context = userdata;
+  struct idempotency_entry *entry = context->idempotency_entry;
+  context->idempotency_entry = NULL;
+
+  if (entry == NULL || context->state->idempotency == NULL)
+    return;
+
+  const char *content_type = evhttp_find_header(
+      evhttp_request_get_output_headers(request), "Content-type");
+  size_t body_len = body != NULL ? evbuffer_get_length(body) : 0;
+  const char *body_data = body_len > 0
+      ? (const char *) evbuffer_pullup(body, body_len)
+      : "";
+  idempotency_complete(context->state->idempotency, entry, code, message,
+                       content_type, body_data, body_len);
+}
+
+// Replays the reply to an earlier request with the same Idempotency-Key, or
+// attaches to it if it's still in flight. Otherwise records the reply to this
+// request. Returns true if the request has been taken care of.
+static bool handle_idempotency_key(struct evhttp_request *request,
+                                   struct request_context *context,
+                                   int http_method,
+                                   const char *path) {
+  struct idempotency_table *table = context->state->idempotency;
+  const char *key_header = evhttp_find_header(
+      evhttp_request_get_input_headers(request), "Idempotency-Key");
+
+  if (key_header == NULL || table == NULL)
+    return false;
+
+  if (strlen(key_header) > kMaxIdempotencyKeyLength) {
+    send_error(request, HTTP_BADREQUEST, "Idempotency-Key is too long");
+    return true;
+  }
+
+  // Keys are scoped to the method and path they're used with
+  size_t key_size = strlen(path) + strlen(key_header) + 16;
+  char *key = arena_alloc(context->arena, key_size);
+
+  if (key == NULL) {
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return true;
+  }
+
+  snprintf(key, key_size, "%d %s %s", http_method, path, key_header);
+  struct idempotency_entry *entry = idempotency_get(table, key);
+
+  if (entry != NULL && entry->complete) {
+    table->replays++;
+    send_idempotent_reply(request, &entry->reply);
+    return true;
+  }
+
+  if (entry != NULL) {
+    struct idempotency_waiter *waiter = arena_alloc(
+        context->arena, sizeof(struct idempotency_waiter));
+
+    if (waiter == NULL) {
+      send_error(request, HTTP_ERROR, "Out of memory");
+      return true;
+    }
+
+    table->attached++;
+    context->idempotency_waiter = waiter;
+    idempotency_wait(entry, waiter, &idempotency_original_replied, request);
+    return true;
+  }
+
+  entry = idempotency_begin(table, key);
+
+  if (entry != NULL) {
+    context->idempotency_entry = entry;
+    context->reply_hook = &record_idempotent_reply;
+    context->reply_hook_userdata = context;
   }
+
+  return false;
 }
 
 // Request dispatcher
+static void dispatch_request(struct evhttp_request *request,
+                             struct request_context *context);
+
+// True if the client asked for the request to run in the background with
+// ?async=1
+static bool request_is_async(struct evhttp_request *request) {
+  return request_has_flag(request, "async");
+}
+
+// Keeps what handlers read from a request for it to run in the background,
+// along with a new request that isn't tied to a connection. The body is
+// moved rather than copied. Returns NULL if out of memory.
+static struct job_request *job_request_new(struct evhttp_request *request,
+                                           struct state *state) {
+  struct job_request *job_request = calloc(1, sizeof(struct job_request));
+
+  if (job_request == NULL)
+    return NULL;
+
+  job_request->state = state;
+  job_request->method = evhttp_request_get_command(request);
+  job_request->uri = evhttp_uri_parse(evhttp_request_get_uri(request));
+  job_request->body = evbuffer_new();
+  job_request->request = evhttp_request_new(NULL, NULL);
+
+  if (job_request->uri == NULL || job_request->body == NULL ||
+      job_request->request == NULL) {
+    if (job_request->request != NULL)
+      evhttp_request_free(job_request->request);
+
+    job_request_free(job_request);
+    return NULL;
+  }
+
+  // The result is kept as plain JSON; GET /jobs/{id} negotiates its own
+  // format and encoding
+  struct evkeyval *header;
+
+  TAILQ_FOREACH(header, evhttp_request_get_input_headers(request), next) {
+    if (strcasecmp(header->key, "Accept") != 0 &&
+        strcasecmp(header->key, "Accept-Encoding") != 0 &&
+        strcasecmp(header->key, "Idempotency-Key") != 0)
+      evhttp_add_header(evhttp_request_get_input_headers(job_request->request),
+                        header->key, header->value);
+  }
+
+  evbuffer_add_buffer(job_request->body,
+                      evhttp_request_get_input_buffer(request));
+  return job_request;
+}
+
+static void record_job_reply(struct evhttp_request *request,
+                             int code,
+                             const char *message,
+                             struct evbuffer *body,
+                             void *userdata) {
+  struct request_context *context = userdata;
+  struct job *job = context->job;
+  context->job = NULL;
+
+  if (job == NULL || context->state->jobs == NULL)
+    return;
+
+  const char *content_type = evhttp_find_header(
+      evhttp_request_get_output_headers(request), "Content-type");
+  size_t body_len = body != NULL ? evbuffer_get_length(body) : 0;
+  const char *body_data = body_len > 0
+      ? (const char *) evbuffer_pullup(body, body_len)
+      : "";
+  jobs_finish(context->state->jobs, job, code, message, content_type,
+              body_data, body_len);
+}
+
+// Runs a job's request through the normal handlers
+static void start_job(struct job *job, void *userdata) {
+  struct job_request *job_request = userdata;
+  struct evhttp_request *request = job_request->request;
+  struct state *state = job_request->state;
+  struct request_context *context = request_context_new(request, state);
+
+  if (context == NULL) {
+    jobs_finish(state->jobs, job, HTTP_ERROR, "Out of memory", NULL, "", 0);
+    evhttp_request_free(request);
+    job_request_free(job_request);
+    return;
+  }
+
+  context->method = job_request->method;
+  context->uri = job_request->uri;
+  context->body = job_request->body;
+  context->job_request = job_request;
+  context->job = job;
+  context->reply_hook = &record_job_reply;
+  context->reply_hook_userdata = context;
+  dispatch_request(request, context);
+}
+
+// Accepts a write to run in the background and answers 202 with the job's ID.
+// Jobs on the same playlist or user run one at a time.
+static void submit_job(struct evhttp_request *request,
+                       struct request_context *context,
+                       const char *path) {
+  struct state *state = context->state;
+
+  if (state->jobs == NULL) {
+    send_error(request, HTTP_SERVUNAVAIL, "Background jobs are disabled");
+    return;
+  }
+
+  // Queue on the resource: the path without its action
+  char *key = decode_path(context->arena, path);
+
+  if (key == NULL) {
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  char *action = strrchr(key, '/');
+
+  if (action != NULL && action != key)
+    *action = '\0';
+
+  struct job_request *job_request = job_request_new(request, state);
+
+  if (job_request == NULL) {
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  struct job *job = jobs_submit(state->jobs, key, &start_job, job_request);
+
+  if (job == NULL) {
+    evhttp_request_free(job_request->request);
+    job_request_free(job_request);
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  char location[32];
+  snprintf(location, sizeof(location), "/jobs/%u", job->id);
+  evhttp_add_header(evhttp_request_get_output_headers(request), "Location",
+                    location);
+
+  json_t *json = json_object();
+  json_object_set_new(json, "id", json_integer(job->id));
+  json_object_set_new(json, "state", json_string(job_state_name(job->state)));
+  send_reply_json(request, HTTP_ACCEPTED, "Accepted", json);
+}
+
+static void serve_request(struct evhttp_request *request,
+                          struct state *state);
+
+static void send_not_ready(struct evhttp_request *request) {
+  num_held_rejected++;
+  evhttp_add_header(evhttp_request_get_output_headers(request),
+                    "Retry-After", "1");
+  send_error(request, HTTP_SERVUNAVAIL, "Not ready");
+}
+
+static void held_request_free(struct held_request *held) {
+  TAILQ_REMOVE(&held_requests, held, entries);
+  num_held_requests--;
+  event_free(held->deadline);
+  free(held);
+}
+
+static void held_request_expired(evutil_socket_t socket,
+                                 short what,
+                                 void *userdata) {
+  struct held_request *held = userdata;
+  struct evhttp_request *request = held->request;
+  held_request_free(held);
+  send_not_ready(request);
+}
+
+// Holds on to a request until the session is ready and online, or answers
+// it with 503 if that takes too long
+static void wait_until_ready(struct evhttp_request *request,
+                             struct state *state) {
+  int max_length = state->ready ? kOfflineQueueLength : kStartupQueueLength;
+  struct held_request *held = num_held_requests < max_length
+      ? malloc(sizeof(struct held_request))
+      : NULL;
+
+  if (held != NULL) {
+    held->deadline = evtimer_new(state->event_base, &held_request_expired,
+                                 held);
+
+    if (held->deadline == NULL) {
+      free(held);
+      held = NULL;
+    }
+  }
+
+  if (held == NULL) {
+    send_not_ready(request);
+    return;
+  }
+
+  held->request = request;
+  TAILQ_INSERT_TAIL(&held_requests, held, entries);
+  num_held_requests++;
+
+  if (num_held_requests > max_held_requests)
+    max_held_requests = num_held_requests;
+
+  struct timeval timeout = {
+    state->ready ? state->offline_queue_timeout : kStartupQueueTimeout, 0
+  };
+  evtimer_add(held->deadline, &timeout);
+}
+
+// Serves the requests that were held, in the order they came in
+static void serve_held_requests(struct state *state) {
+  while (!TAILQ_EMPTY(&held_requests)) {
+    struct held_request *held = TAILQ_FIRST(&held_requests);
+    struct evhttp_request *request = held->request;
+    held_request_free(held);
+    num_held_served++;
+    serve_request(request, state);
+  }
+}
+
+// Whether a request can be answered from what we have while Spotify is
+// unreachable: stats, jobs and GET /playlist/{uri} of playlists that are
+// already loaded
+static bool can_serve_offline(struct evhttp_request *request,
+                              struct state *state) {
+  if (evhttp_request_get_command(request) != EVHTTP_REQ_GET)
+    return false;
+
+  const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(request));
+
+  if (path == NULL)
+    return false;
+
+  if (strncmp(path, "/stats", 6) == 0 || strncmp(path, "/jobs/", 6) == 0)
+    return true;
+
+  if (strncmp(path, "/playlist/", 10) != 0)
+    return false;
+
+  // Only the playlist itself: subscribers and the like need Spotify
+  if (strchr(path + 10, '/') != NULL)
+    return false;
+
+  char *uri = evhttp_uridecode(path + 10, 0, NULL);
+
+  if (uri == NULL)
+    return false;
+
+  sp_link *link = sp_link_create_from_string(uri);
+  free(uri);
+
+  if (link == NULL)
+    return false;
+
+  sp_playlist *playlist = sp_link_type(link) == SP_LINKTYPE_PLAYLIST
+      ? sp_playlist_create(state->session, link)
+      : NULL;
+  sp_link_release(link);
+
+  if (playlist == NULL)
+    return false;
+
+  bool loaded = sp_playlist_is_loaded(playlist);
+  sp_playlist_release(playlist);
+  return loaded;
+}
+
+static json_t *preload_to_json(struct preload *preload) {
+  struct preload_stats stats;
+  preload_get_stats(preload, &stats);
+  json_t *json = json_object();
+  json_object_set_new(json, "total", json_integer(stats.total));
+  json_object_set_new(json, "loading", json_integer(stats.loading));
+  json_object_set_new(json, "loaded", json_integer(stats.loaded));
+  json_object_set_new(json, "failed", json_integer(stats.failed));
+  json_object_set_new(json, "pending",
+                      json_integer(stats.total - stats.loaded - stats.failed));
+  return json;
+}
+
+static double seconds_since_start(struct state *state) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return seconds_between(&state->start_time, &now);
+}
+
+static const char *startup_phase(struct state *state) {
+  if (state->ready)
+    return state->online ? "ready" : "reconnecting";
+
+  return state->session != NULL ? "loading playlists" : "logging in";
+}
+
+// GET /healthz answers as long as the process is up; GET /readyz only once
+// requests are being served
+static bool handle_probe(struct evhttp_request *request,
+                         const char *path,
+                         struct state *state) {
+  bool health = strcmp(path, "/healthz") == 0;
+
+  if (!health && strcmp(path, "/readyz") != 0)
+    return false;
+
+  json_t *json = json_object();
+  json_object_set_new(json, "phase", json_string(startup_phase(state)));
+  json_object_set_new(json, "uptime", json_real(seconds_since_start(state)));
+
+  if (state->preload != NULL)
+    json_object_set_new(json, "preload", preload_to_json(state->preload));
+
+  if (health || (state->ready && state->online))
+    send_reply_json(request, HTTP_OK, "OK", json);
+  else
+    send_reply_json(request, HTTP_SERVUNAVAIL, "Not ready", json);
+
+  return true;
+}
+
 static void handle_request(struct evhttp_request *request,
                             void *userdata) {
   evhttp_connection_set_timeout(request->evcon, 1);
   evhttp_add_header(evhttp_request_get_output_headers(request),
                     "Server", "johan@liesen.se/spotify-api-server");
 
+  struct state *state = userdata;
+
+  // Clients on kept-alive connections reconnect to our successor
+  if (state->draining)
+    evhttp_add_header(evhttp_request_get_output_headers(request),
+                      "Connection", "close");
+
   // Check request method
   int http_method = evhttp_request_get_command(request);
 
@@ -742,20 +2992,216 @@ static void handle_request(struct evhttp_request *request,
     case EVHTTP_REQ_POST:
       break;
 
-    default:
-      evhttp_send_error(request, HTTP_NOTIMPL, "Not Implemented");
-      return;
+    default:
+      evhttp_send_error(request, HTTP_NOTIMPL, "Not Implemented");
+      return;
+  }
+
+  const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(request));
+
+  if (path == NULL)
+    path = "";
+
+  if (http_method == EVHTTP_REQ_GET && handle_probe(request, path, state))
+    return;
+
+  // Without a connection to Spotify, only what's loaded can be served
+  if (state->ready &&
+      (state->online || can_serve_offline(request, state)))
+    serve_request(request, state);
+  else
+    wait_until_ready(request, state);
+}
+
+static void serve_request(struct evhttp_request *request,
+                          struct state *state) {
+  int http_method = evhttp_request_get_command(request);
+  const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(request));
+
+  if (path == NULL)
+    path = "";
+
+  struct request_context *context = request_context_new(request, state);
+
+  if (context == NULL) {
+    evhttp_send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  if (http_method != EVHTTP_REQ_GET) {
+    // Retries of writes are answered without touching libspotify
+    if (handle_idempotency_key(request, context, http_method, path))
+      return;
+
+    if (request_is_async(request)) {
+      submit_job(request, context, path);
+      return;
+    }
+  }
+
+  dispatch_request(request, context);
+}
+
+// A request that changes a playlist. Changes to a playlist are made one at
+// a time, each from the start of its handler to its reply, so that each
+// works out its positions from the playlist as the last one left it.
+struct playlist_write {
+  struct playlist_writes *writes;
+  struct evhttp_request *request;
+  handle_playlist_fn callback;
+  void *userdata;
+  TAILQ_ENTRY(playlist_write) entries;
+};
+
+TAILQ_HEAD(playlist_write_list, playlist_write);
+
+// The writes to one playlist: the one in progress first, then those waiting
+struct playlist_writes {
+  sp_playlist *playlist;
+  struct playlist_write_list queue;
+};
+
+// sp_playlist * -> struct playlist_writes *, for playlists being written to
+static apr_hash_t *playlist_writes = NULL;
+
+// Runs a handler now if the playlist is loaded, or else once it is
+static void handle_playlist_request(sp_playlist *playlist,
+                                    struct evhttp_request *request,
+                                    handle_playlist_fn callback,
+                                    void *userdata) {
+  if (sp_playlist_is_loaded(playlist)) {
+    callback(playlist, request, userdata);
+  } else {
+    // Wait for playlist to load
+    register_playlist_callbacks(playlist, request, callback,
+                                &playlist_state_changed_callbacks, userdata);
+  }
+}
+
+static void playlist_write_start(struct playlist_write *write) {
+  handle_playlist_request(write->writes->playlist, write->request,
+                          write->callback, write->userdata);
+}
+
+// Runs a write to a playlist once the writes before it are done
+static void queue_playlist_write(struct request_context *context,
+                                 sp_playlist *playlist,
+                                 handle_playlist_fn callback,
+                                 void *userdata) {
+  struct evhttp_request *request = context->request;
+  struct playlist_write *write = arena_alloc(context->arena,
+                                             sizeof(struct playlist_write));
+
+  if (playlist_writes == NULL)
+    playlist_writes = apr_hash_make(context->state->pool);
+
+  struct playlist_writes *writes = apr_hash_get(playlist_writes, &playlist,
+                                                sizeof(playlist));
+
+  if (writes == NULL && write != NULL) {
+    writes = malloc(sizeof(struct playlist_writes));
+
+    if (writes != NULL) {
+      writes->playlist = playlist;
+      TAILQ_INIT(&writes->queue);
+      apr_hash_set(playlist_writes, &writes->playlist,
+                   sizeof(writes->playlist), writes);
+    }
+  }
+
+  if (write == NULL || writes == NULL) {
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  write->writes = writes;
+  write->request = request;
+  write->callback = callback;
+  write->userdata = userdata;
+  bool idle = TAILQ_EMPTY(&writes->queue);
+  TAILQ_INSERT_TAIL(&writes->queue, write, entries);
+  context->write = write;
+
+  if (idle)
+    playlist_write_start(write);
+}
+
+// Called when a write's request completes: starts the next write to the
+// playlist, if any
+static void playlist_write_done(struct playlist_write *write) {
+  struct playlist_writes *writes = write->writes;
+  bool current = write == TAILQ_FIRST(&writes->queue);
+  TAILQ_REMOVE(&writes->queue, write, entries);
+
+  if (TAILQ_EMPTY(&writes->queue)) {
+    apr_hash_set(playlist_writes, &writes->playlist, sizeof(writes->playlist),
+                 NULL);
+    free(writes);
+  } else if (current) {
+    playlist_write_start(TAILQ_FIRST(&writes->queue));
+  }
+}
+
+// Routes a request to its handler
+static void dispatch_request(struct evhttp_request *request,
+                             struct request_context *context) {
+  struct state *state = context->state;
+  sp_session *session = state->session;
+  int http_method = request_method(request);
+
+  // Route on the path alone; handlers read the query string themselves
+  const char *path = evhttp_uri_get_path(request_uri(request));
+  char *uri = decode_path(context->arena, path != NULL ? path : "");
+
+  if (uri == NULL) {
+    send_error(request, HTTP_ERROR, "Out of memory");
+    return;
+  }
+
+  char *entity = strtok(uri, "/");
+
+  if (entity == NULL) {
+    send_error(request, HTTP_BADREQUEST, "Bad Request");
+    return;
+  }
+
+  if (strncmp(entity, "stats", 5) == 0 && http_method == EVHTTP_REQ_GET) {
+    get_stats(request, state);
+    return;
+  }
+
+  if (strncmp(entity, "jobs", 4) == 0 && http_method == EVHTTP_REQ_GET) {
+    get_job(request, strtok(NULL, "/"), state);
+    return;
+  }
+
+  if (strncmp(entity, "tracks", 6) == 0) {
+    char *action = strtok(NULL, "/");
+
+    if (http_method != EVHTTP_REQ_POST) {
+      send_error(request, HTTP_NOTIMPL, "Not Implemented");
+    } else if (action == NULL) {
+      post_tracks(request, state);
+    } else if (strcmp(action, "availability") == 0) {
+      post_tracks_availability(request, state);
+    } else {
+      send_error(request, HTTP_BADREQUEST, "Bad Request");
+    }
+
+    return;
   }
 
-  struct state *state = userdata;
-  sp_session *session = state->session;
-  char *uri = evhttp_decode_uri(evhttp_request_get_uri(request));
+  if (strncmp(entity, "track", 5) == 0) {
+    char *track_uri = strtok(NULL, "/");
 
-  char *entity = strtok(uri, "/");
+    if (http_method != EVHTTP_REQ_GET) {
+      send_error(request, HTTP_NOTIMPL, "Not Implemented");
+    } else if (track_uri == NULL) {
+      send_error(request, HTTP_BADREQUEST, "Bad Request");
+    } else {
+      get_track(request, track_uri, state);
+    }
 
-  if (entity == NULL) {
-    evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
-    free(uri);
     return;
   }
 
@@ -764,21 +3210,18 @@ static void handle_request(struct evhttp_request *request,
     char *username = strtok(NULL, "/");
 
     if (username == NULL) {
-      evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
-      free(uri);
+      send_error(request, HTTP_BADREQUEST, "Bad Request");
       return;
     }
 
     char *action = strtok(NULL, "/");
-    handle_user_request(request, action, username, session);
-    free(uri);
+    handle_user_request(request, action, username, state);
     return;
   }
 
   // Handle requests to /playlist/<playlist_uri>/<action>
   if (strncmp(entity, "playlist", 8) != 0) {
-    evhttp_send_error(request, HTTP_BADREQUEST, "Bad Request");
-    free(uri);
+    send_error(request, HTTP_BADREQUEST, "Bad Request");
     return;
   }
 
@@ -789,7 +3232,7 @@ static void handle_request(struct evhttp_request *request,
       case EVHTTP_REQ_PUT:
       case EVHTTP_REQ_POST:
         // TODO(liesen): Add code to create playlists
-        put_playlist(NULL, request, session);
+        put_playlist(NULL, request, state);
         break;
 
       default:
@@ -797,7 +3240,6 @@ static void handle_request(struct evhttp_request *request,
         break;
     }
 
-    free(uri);
     return;
   }
 
@@ -805,14 +3247,12 @@ static void handle_request(struct evhttp_request *request,
 
   if (playlist_link == NULL) {
     send_error(request, HTTP_NOTFOUND, "Playlist link not found");
-    free(uri);
     return;
   }
 
   if (sp_link_type(playlist_link) != SP_LINKTYPE_PLAYLIST) {
     sp_link_release(playlist_link);
     send_error(request, HTTP_BADREQUEST, "Not a playlist link");
-    free(uri);
     return;
   }
 
@@ -821,19 +3261,20 @@ static void handle_request(struct evhttp_request *request,
 
   if (playlist == NULL) {
     send_error(request, HTTP_NOTFOUND, "Playlist not found");
-    free(uri);
     return;
   }
 
   sp_playlist_add_ref(playlist);
 
+  if (state->traffic != NULL)
+    playlist_traffic_hit(state->traffic, playlist_uri);
+
   // Dispatch request
   char *action = strtok(NULL, "/");
-  free(uri);
 
   // Default request handler
   handle_playlist_fn request_callback = &not_implemented;
-  void *callback_userdata = session;
+  void *callback_userdata = state;
 
   switch (http_method) {
   case EVHTTP_REQ_GET:
@@ -852,26 +3293,375 @@ static void handle_request(struct evhttp_request *request,
   case EVHTTP_REQ_PUT:
   case EVHTTP_REQ_POST:
     {
+      if (action == NULL)
+        break;
+
       if (strncmp(action, "add", 3) == 0) {
         request_callback = &put_playlist_add_tracks;
       } else if (strncmp(action, "remove", 6) == 0) {
         request_callback = &put_playlist_remove_tracks;
       } else if (strncmp(action, "patch", 5) == 0) {
-        callback_userdata = state;
         request_callback = &put_playlist_patch;
       }
     }
     break;
   }
 
-  if (sp_playlist_is_loaded(playlist)) {
-    request_callback(playlist, request, callback_userdata);
-  } else {
-    // Wait for playlist to load
-    register_playlist_callbacks(playlist, request, request_callback,
-                                &playlist_state_changed_callbacks,
-                                callback_userdata);
+  if (http_method != EVHTTP_REQ_GET && request_callback != &not_implemented)
+    queue_playlist_write(context, playlist, request_callback,
+                         callback_userdata);
+  else
+    handle_playlist_request(playlist, request, request_callback,
+                            callback_userdata);
+}
+
+// A change from the journal that didn't finish before the last exit
+struct journal_replay {
+  struct state *state;
+  json_t *record;
+  unsigned long id;
+  sp_playlist *playlist;
+  struct arena *arena;
+  struct track_batch batch;
+};
+
+static void journal_replay_free(struct journal_replay *replay) {
+  journal_end(replay->state->journal, replay->id);
+  track_batch_release(&replay->batch);
+
+  if (replay->playlist != NULL)
+    sp_playlist_release(replay->playlist);
+
+  arena_free(replay->arena);
+  json_decref(replay->record);
+  free(replay);
+}
+
+static void journal_replay_synced(sp_playlist *playlist,
+                                  bool done,
+                                  void *userdata);
+
+static sp_playlist_callbacks journal_replay_synced_callbacks = {
+  .playlist_update_in_progress = &journal_replay_synced
+};
+
+static void journal_replay_synced(sp_playlist *playlist,
+                                  bool done,
+                                  void *userdata) {
+  if (!done)
+    return;
+
+  sp_playlist_remove_callbacks(playlist, &journal_replay_synced_callbacks,
+                               userdata);
+  journal_replay_free(userdata);
+}
+
+static void journal_replay_done(sp_error error, void *userdata) {
+  struct journal_replay *replay = userdata;
+  track_batch_release(&replay->batch);
+
+  if (error != SP_ERROR_OK) {
+    syslog(LOG_WARNING, "Could not finish journaled change %lu: %s",
+           replay->id, sp_error_message(error));
+  } else if (sp_playlist_has_pending_changes(replay->playlist)) {
+    sp_playlist_add_callbacks(replay->playlist,
+                              &journal_replay_synced_callbacks, replay);
+    return;
+  }
+
+  journal_replay_free(replay);
+}
+
+// Works out what's left of an add or remove from how many tracks the
+// playlist has. This assumes nothing else changed the playlist meanwhile.
+static bool journal_replay_remaining(struct journal_replay *replay,
+                                     struct playlist_ops *ops) {
+  json_t *record = replay->record;
+  const char *action = json_string_value(json_object_get(record, "action"));
+  int before = json_integer_value(json_object_get(record, "before"));
+  int after = json_integer_value(json_object_get(record, "after"));
+  int position = json_integer_value(json_object_get(record, "position"));
+  int count = json_integer_value(json_object_get(record, "count"));
+  int num_tracks = sp_playlist_num_tracks(replay->playlist);
+
+  if (num_tracks == after)
+    return true;
+
+  if (action == NULL)
+    return false;
+
+  if (strcmp(action, "remove") == 0) {
+    int removed = before - num_tracks;
+
+    if (removed < 0 || removed >= count)
+      return false;
+
+    return playlist_ops_append(ops, PLAYLIST_OP_REMOVE, position,
+                               count - removed, NULL);
+  }
+
+  int added = num_tracks - before;
+
+  if (added < 0 || added >= count)
+    return false;
+
+  json_t *tracks = json_object_get(record, "tracks");
+  json_t *remaining = json_array();
+
+  for (size_t i = added; i < json_array_size(tracks); i++)
+    json_array_append(remaining, json_array_get(tracks, i));
+
+  bool ok = track_batch_from_json(&replay->batch, remaining, replay->arena);
+  json_decref(remaining);
+  return ok && playlist_ops_append(ops, PLAYLIST_OP_ADD, position + added,
+                                   replay->batch.num_tracks,
+                                   replay->batch.tracks);
+}
+
+// Diffs the playlist against the tracks a patch was meant to leave it with
+static bool journal_replay_patch(struct journal_replay *replay,
+                                 struct playlist_ops *ops) {
+  json_t *tracks = json_object_get(replay->record, "tracks");
+
+  if (!track_batch_from_json(&replay->batch, tracks, replay->arena))
+    return false;
+
+  apr_pool_t *pool = svn_pool_create(replay->state->pool);
+  svn_diff_t *diff;
+  svn_error_t *error = diff_playlist_tracks(&diff, replay->playlist,
+                                            replay->batch.tracks,
+                                            replay->batch.track_ids,
+                                            replay->batch.num_tracks, pool);
+
+  if (error == SVN_NO_ERROR)
+    error = diff_playlist_tracks_ops(diff, replay->batch.tracks,
+                                     replay->batch.num_tracks, ops);
+
+  svn_pool_destroy(pool);
+
+  if (error != SVN_NO_ERROR) {
+    svn_handle_error2(error, stderr, false, "Replaying journal");
+    svn_error_clear(error);
+    return false;
+  }
+
+  return true;
+}
+
+static void journal_replay_loaded(sp_playlist *playlist, void *userdata);
+
+static sp_playlist_callbacks journal_replay_loaded_callbacks = {
+  .playlist_state_changed = &journal_replay_loaded
+};
+
+static void journal_replay_loaded(sp_playlist *playlist, void *userdata) {
+  struct journal_replay *replay = userdata;
+
+  if (!sp_playlist_is_loaded(playlist))
+    return;
+
+  sp_playlist_remove_callbacks(playlist, &journal_replay_loaded_callbacks,
+                               replay);
+  const char *action = json_string_value(json_object_get(replay->record,
+                                                         "action"));
+  struct playlist_ops ops;
+  playlist_ops_init(&ops);
+  bool ok = action != NULL && strcmp(action, "patch") == 0 ?
+      journal_replay_patch(replay, &ops) :
+      journal_replay_remaining(replay, &ops);
+
+  if (!ok) {
+    syslog(LOG_WARNING, "Could not finish journaled change %lu: playlist "
+                        "changed since", replay->id);
+    playlist_ops_free(&ops);
+    journal_replay_free(replay);
+    return;
+  }
+
+  if (ops.num_ops == 0) {
+    playlist_ops_free(&ops);
+    journal_replay_free(replay);
+    return;
+  }
+
+  syslog(LOG_INFO, "Finishing journaled change %lu", replay->id);
+  struct state *state = replay->state;
+
+  if (!playlist_apply(state->event_base, state->session, playlist, &ops,
+                      state->chunk_size, kChunkSyncTimeout, NULL,
+                      &journal_replay_done, replay)) {
+    playlist_ops_free(&ops);
+    journal_replay_free(replay);
+  }
+}
+
+// Checks that a record has everything replaying its action reads. Adds and
+// removes recorded without an operation fail too, having nothing to finish.
+static bool journal_record_is_valid(json_t *record) {
+  const char *action = json_string_value(json_object_get(record, "action"));
+
+  if (action == NULL ||
+      !json_is_integer(json_object_get(record, "before")) ||
+      !json_is_integer(json_object_get(record, "after")))
+    return false;
+
+  if (strcmp(action, "patch") == 0)
+    return json_is_array(json_object_get(record, "tracks"));
+
+  if (strcmp(action, "add") != 0 && strcmp(action, "remove") != 0)
+    return false;
+
+  if (!json_is_integer(json_object_get(record, "position")) ||
+      !json_is_integer(json_object_get(record, "count")))
+    return false;
+
+  return strcmp(action, "remove") == 0 ||
+         json_is_array(json_object_get(record, "tracks"));
+}
+
+// Finishes the changes the journal has as begun but not ended
+static void journal_replay_all(struct state *state) {
+  json_t *incomplete = journal_take_incomplete(state->journal);
+
+  for (size_t i = 0; i < json_array_size(incomplete); i++) {
+    json_t *record = json_array_get(incomplete, i);
+
+    if (!journal_record_is_valid(record)) {
+      unsigned long id = json_integer_value(json_object_get(record, "id"));
+      syslog(LOG_WARNING, "Dropping journaled change %lu: malformed record",
+             id);
+      journal_end(state->journal, id);
+      continue;
+    }
+
+    struct journal_replay *replay = calloc(1, sizeof(struct journal_replay));
+
+    if (replay == NULL || (replay->arena = arena_new()) == NULL) {
+      free(replay);
+      break;
+    }
+
+    replay->state = state;
+    replay->record = json_incref(record);
+    replay->id = json_integer_value(json_object_get(record, "id"));
+    const char *uri = json_string_value(json_object_get(record, "playlist"));
+    sp_link *link = uri != NULL ? sp_link_create_from_string(uri) : NULL;
+
+    if (link != NULL) {
+      replay->playlist = sp_playlist_create(state->session, link);
+      sp_link_release(link);
+    }
+
+    if (replay->playlist == NULL) {
+      syslog(LOG_WARNING, "Could not finish journaled change %lu: no such "
+                          "playlist", replay->id);
+      journal_replay_free(replay);
+    } else if (sp_playlist_is_loaded(replay->playlist)) {
+      journal_replay_loaded(replay->playlist, replay);
+    } else {
+      sp_playlist_add_callbacks(replay->playlist,
+                                &journal_replay_loaded_callbacks, replay);
+    }
+  }
+
+  json_decref(incomplete);
+}
+
+static void shared_cache_playlist_changed(sp_playlist *playlist,
+                                          void *userdata) {
+  struct state *state = userdata;
+  char uri[kMaxPlaylistLinkLength];
+
+  if (get_playlist_uri(playlist, uri))
+    shared_cache_invalidate(state->shared_cache, uri);
+}
+
+static unsigned long jobs_pending(struct state *state) {
+  return state->jobs != NULL
+      ? state->jobs->num_queued + state->jobs->num_running : 0;
+}
+
+static bool is_drained(struct state *state) {
+  return num_active_requests == 0 && jobs_pending(state) == 0 &&
+         TAILQ_EMPTY(&touched_playlists);
+}
+
+// Writes what Spotify hasn't been told yet to the cache and logs out
+static void finish_drain(struct state *state, bool drained) {
+  unsigned long jobs_left = jobs_pending(state);
+  int playlists_left = touched_playlists_count();
+  int level = drained ? LOG_INFO : LOG_WARNING;
+  syslog(level, "Drained %d requests, %lu jobs and %d playlists; abandoned %d "
+         "requests, %lu jobs and %d playlists with unsynced changes",
+         num_drained_requests,
+         drain_jobs > jobs_left ? drain_jobs - jobs_left : 0,
+         num_drained_playlists, num_active_requests, jobs_left,
+         playlists_left);
+
+  if (state->drain != NULL)
+    event_free(state->drain);
+
+  state->drain = NULL;
+  sp_session_flush_caches(state->session);
+  sp_session_logout(state->session);
+}
+
+static void check_drained(evutil_socket_t socket, short what, void *userdata) {
+  struct state *state = userdata;
+  num_drained_playlists += touched_playlists_prune();
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  bool drained = is_drained(state);
+  bool expired = now.tv_sec > state->drain_deadline.tv_sec ||
+                 (now.tv_sec == state->drain_deadline.tv_sec &&
+                  now.tv_usec >= state->drain_deadline.tv_usec);
+
+  if (drained || expired)
+    finish_drain(state, drained);
+}
+
+// Stops accepting connections and logs out once the requests in flight and
+// background jobs are done and Spotify has synced every playlist we changed,
+// or after state->drain_timeout seconds
+static void start_drain(struct state *state) {
+  if (state->draining)
+    return;
+
+  state->draining = true;
+  num_drained_requests = 0;
+  num_drained_playlists = 0;
+  drain_jobs = jobs_pending(state);
+
+  if (state->listener != NULL)
+    evconnlistener_disable(state->listener);
+
+  for (int i = 0; i < state->num_listen_addresses; i++) {
+    if (state->listen_addresses[i].listener != NULL)
+      evconnlistener_disable(state->listen_addresses[i].listener);
+  }
+
+  syslog(LOG_INFO, "Draining %d requests, %lu jobs and %d playlists",
+         num_active_requests, drain_jobs, touched_playlists_count());
+  gettimeofday(&state->drain_deadline, NULL);
+  state->drain_deadline.tv_sec += state->drain_timeout;
+  state->drain = event_new(state->event_base, -1, EV_PERSIST, &check_drained,
+                           state);
+
+  if (state->drain == NULL) {
+    finish_drain(state, false);
+    return;
   }
+
+  struct timeval interval = {0, kDrainCheckInterval * 1000};
+  event_add(state->drain, &interval);
+}
+
+static void successor_ready(void *userdata) {
+  struct state *state = userdata;
+  syslog(LOG_INFO, "Successor is ready; draining");
+  handoff_free(state->handoff);
+  state->handoff = NULL;
+  start_drain(state);
 }
 
 static void playlistcontainer_loaded(sp_playlistcontainer *pc, void *userdata);
@@ -887,23 +3677,131 @@ static void playlistcontainer_loaded(sp_playlistcontainer *pc, void *userdata) {
 
   sp_playlistcontainer_remove_callbacks(pc, &playlistcontainer_callbacks, session);
 
+  if (state->journal != NULL)
+    journal_replay_all(state);
+
+  if (state->shared_cache != NULL && state->cache != NULL) {
+    state->cache->changed = &shared_cache_playlist_changed;
+    state->cache->changed_userdata = state;
+  }
+
+  if (state->listing_cache != NULL) {
+    state->listing_cache->render = &render_listing_playlist;
+    state->listing_cache->userdata = state;
+  }
+
+  state->ready = true;
+  syslog(LOG_INFO, "Ready after %.3f s", seconds_since_start(state));
+
+  // Serve what came in while logging in
+  if (state->online)
+    serve_held_requests(state);
+
+  // Start serving the socket we were handed and let the old server go
+  if (state->handoff_control != -1 && !state->draining) {
+    evconnlistener_enable(state->listener);
+    handoff_send_ready(state->handoff_control);
+    state->handoff_control = -1;
+  }
+
+  // Hand it on in turn to whoever replaces us
+  if (state->handoff_path != NULL && !state->draining) {
+    state->handoff = handoff_serve(state->event_base, state->handoff_path,
+                                   evconnlistener_get_fd(state->listener),
+                                   &successor_ready, state);
+
+    if (state->handoff == NULL)
+      syslog(LOG_WARNING, "Could not listen for a successor on %s: %m",
+             state->handoff_path);
+  }
+}
+
+// Serves an address given with --listen as well
+static bool listen_on(struct state *state,
+                      struct listen_address *listen_address) {
+  struct evconnlistener *listener = listen_address->path != NULL
+      ? listener_from_fd(state->event_base, listen_address->fd, true)
+      : listener_bind_tcp(state->event_base, listen_address->host,
+                          listen_address->port, state->workers > 1);
+
+  if (listener == NULL ||
+      evhttp_bind_listener(state->http, listener) == NULL) {
+    if (listener != NULL)
+      evconnlistener_free(listener);
+
+    if (listen_address->path != NULL)
+      syslog(LOG_WARNING, "Could not listen on unix:%s",
+             listen_address->path);
+    else
+      syslog(LOG_WARNING, "Could not bind HTTP server socket to %s:%d",
+             listen_address->host, listen_address->port);
+
+    return false;
+  }
+
+  listen_address->listener = listener;
+
+  if (listen_address->path != NULL)
+    syslog(LOG_DEBUG, "HTTP server listening on unix:%s",
+           listen_address->path);
+  else
+    syslog(LOG_DEBUG, "HTTP server listening on %s:%d", listen_address->host,
+           listen_address->port);
+
+  return true;
+}
+
+bool http_listen(struct state *state) {
+  compression_level = state->compression_level;
   state->http = evhttp_new(state->event_base);
   evhttp_set_timeout(state->http, 60);
   evhttp_set_gencb(state->http, &handle_request, state);
 
-  // Bind HTTP server
-  int bind = evhttp_bind_socket(state->http, state->http_host,
-                                state->http_port);
+  // Take the socket from systemd or from the server we're replacing, or
+  // bind it. Workers share the port and the kernel spreads connections over
+  // them.
+  int fd = listener_inherited_fd();
+  bool handed_over = false;
+
+  if (fd == -1 && state->handoff_path != NULL) {
+    fd = handoff_receive(state->handoff_path, &state->handoff_control);
+    handed_over = fd != -1;
+  }
+
+  // A socket that was handed over is served by the old server until we're
+  // ready
+  struct evconnlistener *listener = fd != -1
+      ? listener_from_fd(state->event_base, fd, !handed_over)
+      : listener_bind_tcp(state->event_base, state->http_host,
+                          state->http_port, state->workers > 1);
+
+  if (listener == NULL ||
+      evhttp_bind_listener(state->http, listener) == NULL) {
+    if (listener != NULL)
+      evconnlistener_free(listener);
 
-  if (bind == -1) {
     syslog(LOG_WARNING, "Could not bind HTTP server socket to %s:%d",
            state->http_host, state->http_port);
-    sp_session_logout(session);
-    return;
+    return false;
+  }
+
+  state->listener = listener;
+
+  if (handed_over)
+    syslog(LOG_INFO, "Took over the listening socket from %s",
+           state->handoff_path);
+  else if (fd != -1)
+    syslog(LOG_INFO, "Listening on an inherited socket");
+
+  syslog(LOG_DEBUG, "HTTP server listening on %s:%d after %.3f s",
+         state->http_host, state->http_port, seconds_since_start(state));
+
+  for (int i = 0; i < state->num_listen_addresses; i++) {
+    if (!listen_on(state, &state->listen_addresses[i]))
+      return false;
   }
 
-  syslog(LOG_DEBUG, "HTTP server listening on %s:%d", state->http_host,
-         state->http_port);
+  return true;
 }
 
 void credentials_blob_updated(sp_session *session, const char *blob) {
@@ -929,11 +3827,81 @@ void credentials_blob_updated(sp_session *session, const char *blob) {
          state->credentials_blob_filename);
 }
 
-// Catches SIGINT and exits gracefully
+// Catches SIGINT and SIGTERM and exits gracefully, or right away when caught
+// again while draining
 void sigint_handler(evutil_socket_t socket, short what, void *userdata) {
   syslog(LOG_DEBUG, "signal_handler\n");
   struct state *state = userdata;
-  sp_session_logout(state->session);
+
+  if (state->draining)
+    finish_drain(state, false);
+  else
+    start_drain(state);
+}
+
+void apply_config(struct state *state, const struct config *config) {
+  if (config->cache_entries >= 0) {
+    state->cache_entries = config->cache_entries;
+    cache_resize(state->cache, config->cache_entries);
+  }
+
+  if (config->compression_level >= 0 && config->compression_level <= 9) {
+    state->compression_level = config->compression_level;
+    compression_level = config->compression_level;
+  }
+
+  if (config->idempotency_keys >= 0) {
+    state->idempotency_keys = config->idempotency_keys;
+    idempotency_table_resize(state->idempotency, config->idempotency_keys);
+  }
+
+  if (config->chunk_size > 0)
+    state->chunk_size = config->chunk_size;
+
+  if (config->jobs_per_playlist > 0 && state->jobs != NULL)
+    state->jobs->max_running_per_queue = config->jobs_per_playlist;
+
+  if (config->finished_jobs >= 0 && state->jobs != NULL)
+    state->jobs->max_done = config->finished_jobs;
+
+  if (config->spotify_cache_size >= 0) {
+    state->spotify_cache_size = config->spotify_cache_size;
+
+    if (state->session != NULL)
+      sp_session_set_cache_size(state->session, config->spotify_cache_size);
+  }
+
+  if (config->log_level >= 0)
+    setlogmask(LOG_UPTO(config->log_level));
+
+  if (config->drain_timeout >= 0)
+    state->drain_timeout = config->drain_timeout;
+
+  if (config->offline_queue_timeout >= 0)
+    state->offline_queue_timeout = config->offline_queue_timeout;
+}
+
+// Reloads the configuration file, keeping the current settings if it can't
+// be read
+void sighup_handler(evutil_socket_t socket, short what, void *userdata) {
+  struct state *state = userdata;
+  struct config config;
+
+  if (!config_read(state->config_path, &config)) {
+    syslog(LOG_WARNING, "Keeping the current settings");
+    return;
+  }
+
+  apply_config(state, &config);
+
+  if ((config.host != NULL && strcmp(config.host, state->http_host) != 0) ||
+      (config.port >= 0 && config.port != state->http_port) ||
+      (config.workers >= 0 && config.workers != state->workers))
+    syslog(LOG_WARNING, "%s: host, port and workers change on restart",
+           state->config_path);
+
+  config_free(&config);
+  syslog(LOG_INFO, "Reloaded %s", state->config_path);
 }
 
 void logged_out(sp_session *session) {
@@ -942,14 +3910,121 @@ void logged_out(sp_session *session) {
   event_del(state->async);
   event_del(state->timer);
   event_del(state->sigint);
+  event_del(state->sigterm);
+  event_del(state->sighup);
   event_base_loopbreak(state->event_base);
+
+  while (!TAILQ_EMPTY(&held_requests)) {
+    struct held_request *held = TAILQ_FIRST(&held_requests);
+    struct evhttp_request *request = held->request;
+    held_request_free(held);
+    send_not_ready(request);
+  }
+
+  // With workers, the first process owns the Unix domain sockets
+  if (state->workers <= 1) {
+    for (int i = 0; i < state->num_listen_addresses; i++) {
+      if (state->listen_addresses[i].path != NULL)
+        listener_unlink_unix(&state->listen_addresses[i]);
+    }
+  }
+
+  if (state->handoff != NULL)
+    handoff_free(state->handoff);
+
+  state->handoff = NULL;
+
+  if (state->drain != NULL)
+    event_free(state->drain);
+
+  state->drain = NULL;
+
+  if (state->reconnect != NULL)
+    event_free(state->reconnect);
+
+  state->reconnect = NULL;
+
+  while (!TAILQ_EMPTY(&touched_playlists)) {
+    struct touched_playlist *touched = TAILQ_FIRST(&touched_playlists);
+    TAILQ_REMOVE(&touched_playlists, touched, entries);
+    sp_playlist_release(touched->playlist);
+    free(touched);
+  }
+
+  if (state->preload != NULL)
+    preload_free(state->preload);
+
+  state->preload = NULL;
+
+  if (state->traffic != NULL) {
+    if (!playlist_traffic_write(state->traffic, state->hot_playlists_path,
+                                kHotPlaylists))
+      syslog(LOG_WARNING, "Could not write %s: %m",
+             state->hot_playlists_path);
+
+    playlist_traffic_free(state->traffic);
+  }
+
+  state->traffic = NULL;
+  cache_free(state->cache);
+  state->cache = NULL;
+  listing_cache_free(state->listing_cache);
+  state->listing_cache = NULL;
+  availability_cache_free(state->availability);
+  state->availability = NULL;
+  metadata_waits_free(state->metadata_waits);
+  state->metadata_waits = NULL;
+  track_cache_free(state->track_cache);
+  state->track_cache = NULL;
+  idempotency_table_free(state->idempotency);
+  state->idempotency = NULL;
+  jobs_free(state->jobs);
+  state->jobs = NULL;
+
+  if (state->journal != NULL)
+    journal_close(state->journal);
+
+  state->journal = NULL;
   apr_pool_destroy(state->pool);
   closelog();
 }
 
+// Loads the preload list and last run's most requested playlists. Neither
+// holds up serving requests.
+static void start_preload(struct state *state) {
+  if (state->preload_path == NULL && state->hot_playlists_path == NULL)
+    return;
+
+  state->preload = preload_new(state->event_base, state->session,
+                               kPreloadConcurrency, kPreloadTimeout);
+
+  if (state->preload == NULL)
+    return;
+
+  if (state->preload_path != NULL &&
+      !preload_read(state->preload, state->preload_path))
+    syslog(LOG_WARNING, "Could not read preload list %s: %m",
+           state->preload_path);
+
+  // Not there before the first shutdown
+  if (state->hot_playlists_path != NULL)
+    preload_read(state->preload, state->hot_playlists_path);
+
+  preload_start(state->preload);
+}
+
 void logged_in(sp_session *session, sp_error error) {
   struct state *state = sp_session_userdata(session);
 
+  // Logging in again to reconnect; connectionstate_updated takes it from here
+  if (state->ready) {
+    if (error != SP_ERROR_OK)
+      syslog(LOG_WARNING, "Could not log in again: %s",
+             sp_error_message(error));
+
+    return;
+  }
+
   if (error != SP_ERROR_OK) {
     syslog(LOG_CRIT, "Error logging in to Spotify: %s",
            sp_error_message(error));
@@ -959,13 +4034,105 @@ void logged_in(sp_session *session, sp_error error) {
   }
 
   state->session = session;
+  state->online = true;
+
+  if (state->spotify_cache_size >= 0)
+    sp_session_set_cache_size(session, state->spotify_cache_size);
+
   evsignal_add(state->sigint, NULL);
+  evsignal_add(state->sigterm, NULL);
+  start_preload(state);
+  syslog(LOG_INFO, "Logged in after %.3f s", seconds_since_start(state));
 
   sp_playlistcontainer *pc = sp_session_playlistcontainer(session);
   sp_playlistcontainer_add_callbacks(pc, &playlistcontainer_callbacks,
                                      session);
 }
 
+static void reconnect(evutil_socket_t socket, short what, void *userdata) {
+  struct state *state = userdata;
+
+  if (state->online || state->draining)
+    return;
+
+  // libspotify retries by itself too; this makes sure we're not waiting on
+  // a session that gave up
+  sp_error error = sp_session_relogin(state->session);
+
+  if (error != SP_ERROR_OK)
+    syslog(LOG_WARNING, "Could not reconnect: %s", sp_error_message(error));
+
+  struct timeval delay = {state->reconnect_delay, 0};
+  evtimer_add(state->reconnect, &delay);
+  state->reconnect_delay *= 2;
+
+  if (state->reconnect_delay > kReconnectMaxDelay)
+    state->reconnect_delay = kReconnectMaxDelay;
+}
+
+static void went_offline(struct state *state) {
+  state->online = false;
+  gettimeofday(&state->offline_since, NULL);
+  state->outages++;
+  syslog(LOG_WARNING, "Lost the connection to Spotify; holding requests");
+
+  if (state->reconnect == NULL)
+    state->reconnect = evtimer_new(state->event_base, &reconnect, state);
+
+  if (state->reconnect == NULL)
+    return;
+
+  state->reconnect_delay = kReconnectMinDelay;
+  struct timeval delay = {state->reconnect_delay, 0};
+  evtimer_add(state->reconnect, &delay);
+}
+
+static void went_online(struct state *state) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  double seconds = seconds_between(&state->offline_since, &now);
+  state->offline_seconds += seconds;
+  state->online = true;
+
+  if (state->reconnect != NULL)
+    evtimer_del(state->reconnect);
+
+  syslog(LOG_INFO, "Reconnected to Spotify after %.3f s; serving %d held "
+         "requests", seconds, num_held_requests);
+  serve_held_requests(state);
+}
+
+void connection_error(sp_session *session, sp_error error) {
+  syslog(LOG_WARNING, "Connection error: %s", sp_error_message(error));
+}
+
+// Outages only count once we're serving: before then, logging in is still
+// in progress
+void connectionstate_updated(sp_session *session) {
+  struct state *state = sp_session_userdata(session);
+
+  switch (sp_session_connectionstate(session)) {
+    case SP_CONNECTION_STATE_LOGGED_IN:
+      if (state->ready && !state->online)
+        went_online(state);
+
+      state->online = true;
+      break;
+
+    case SP_CONNECTION_STATE_DISCONNECTED:
+    case SP_CONNECTION_STATE_OFFLINE:
+      if (state->ready && state->online)
+        went_offline(state);
+      else
+        state->online = false;
+
+      break;
+
+    default:
+      break;
+  }
+}
+
 void process_events(evutil_socket_t socket, short what, void *userdata) {
   struct state *state = userdata;
   event_del(state->timer);
@@ -980,6 +4147,11 @@ void process_events(evutil_socket_t socket, short what, void *userdata) {
   evtimer_add(state->timer, &state->next_timeout);
 }
 
+void metadata_updated(sp_session *session) {
+  struct state *state = sp_session_userdata(session);
+  metadata_waits_updated(state->metadata_waits);
+}
+
 void notify_main_thread(sp_session *session) {
   syslog(LOG_DEBUG, "notify_main_thread\n");
   struct state *state = sp_session_userdata(session);
@@ -1,6 +1,8 @@
 #include <apr.h>
 #include <event2/event.h>
 #include <libspotify/api.h>
+#include <stdbool.h>
+#include <sys/time.h>
 
 // Application state
 struct state {
@@ -12,25 +14,130 @@ struct state {
   struct event *async;
   struct event *timer;
   struct event *sigint;
+  struct event *sigterm;
+  struct event *sighup;
   struct timeval next_timeout;
 
   struct evhttp *http;
+  struct evconnlistener *listener;
   char *http_host;
   int http_port;
 
+  // More addresses to listen on (--listen)
+  struct listen_address *listen_addresses;
+  int num_listen_addresses;
+  int compression_level;
+
+  // When the process started, and whether requests are served yet (the
+  // session is logged in and has loaded its playlists)
+  struct timeval start_time;
+  bool ready;
+
+  // Whether the connection to Spotify is up, when it last went down, and
+  // outages so far. Requests that need Spotify are held while it's down.
+  bool online;
+  struct timeval offline_since;
+  unsigned long outages;
+  double offline_seconds;
+  struct event *reconnect;
+  int reconnect_delay;
+
   apr_pool_t *pool;
 
+  // Rendered playlist bodies
+  struct cache *cache;
+  int cache_entries;
+
+  // Rendered shallow playlist container listings
+  struct listing_cache *listing_cache;
+
+  // Track availability by track ID
+  struct availability_cache *availability;
+
+  // Requests waiting for track metadata
+  struct metadata_waits *metadata_waits;
+
+  // Rendered tracks, and waits for track metadata shared by requests
+  struct track_cache *track_cache;
+
+  // Replies to requests with an Idempotency-Key
+  struct idempotency_table *idempotency;
+  int idempotency_keys;
+
+  // Writes running in the background
+  struct jobs *jobs;
+
+  // Most tracks to add or remove in one go
+  int chunk_size;
+
+  // Playlists to load right after logging in (--preload), and the file the
+  // most requested ones are written to on shutdown and preloaded from
+  // (--hot-playlists)
+  char *preload_path;
+  char *hot_playlists_path;
+  struct preload *preload;
+  struct playlist_traffic *traffic;
+
+  // Configuration file reloaded on SIGHUP (--config), and settings only it
+  // can change. The libspotify cache size is -1 until set.
+  char *config_path;
+  int spotify_cache_size;
+  int drain_timeout;
+  int offline_queue_timeout;
+
+  // Playlist changes not yet synced, kept across restarts
+  char *journal_path;
+  struct journal *journal;
+
+  // Processes serving the same port (--workers), which one this is and the
+  // playlist bodies they share
+  int workers;
+  int worker;
+  struct shared_cache *shared_cache;
+
+  // Where the listening socket is handed from one server to the next
+  // (--handoff), the connection to the server handing it to us, and the
+  // socket our successor connects to
+  char *handoff_path;
+  int handoff_control;
+  struct handoff *handoff;
+
+  // Whether we've stopped accepting connections and are waiting for the
+  // requests in flight, background jobs and playlist syncs before logging out
+  bool draining;
+  struct event *drain;
+  struct timeval drain_deadline;
+
   int exit_status;
 };
 
+struct config;
+
+// Applies the settings of a configuration file that can change while
+// running. Settings the file doesn't give are left alone.
+void apply_config(struct state *state, const struct config *config);
+
+// Starts listening for HTTP requests. Until the session is ready, requests
+// wait for it (or are answered 503) and only /healthz and /readyz are
+// served. Returns false if the socket can't be bound.
+bool http_listen(struct state *state);
+
 void credentials_blob_updated(sp_session *session, const char *blob);
 
 void logged_in(sp_session *session, sp_error error);
 
+void connection_error(sp_session *session, sp_error error);
+
+void connectionstate_updated(sp_session *session);
+
 void logged_out(sp_session *session);
 
+void metadata_updated(sp_session *session);
+
 void notify_main_thread(sp_session *session);
 
 void process_events(evutil_socket_t socket, short what, void *userdata);
 
 void sigint_handler(evutil_socket_t socket, short what, void *userdata);
+
+void sighup_handler(evutil_socket_t socket, short what, void *userdata);
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE  // MAP_ANONYMOUS
+
+#include <event2/buffer.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "constants.h"
+#include "shared_cache.h"
+
+// Playlists map onto this many generation counters; playlists sharing a
+// counter only invalidate each other a little more often
+#define NUM_GENERATIONS 4096
+
+// Longest playlist URI plus variant key stored
+#define MAX_KEY_LENGTH 320
+
+// Start of each slot. The body follows.
+struct slot {
+  uint32_t sequence;  // Odd while being written
+  uint32_t generation;
+  uint64_t key_hash;
+  int64_t stored_at;
+  uint32_t body_len;
+  char key[MAX_KEY_LENGTH];
+};
+
+struct shared_region {
+  uint32_t generations[NUM_GENERATIONS];
+};
+
+struct shared_cache {
+  struct shared_region *region;
+  char *slots;
+  int num_slots;
+  size_t slot_size;
+  size_t mapped_size;
+  struct shared_cache_stats stats;
+};
+
+static uint64_t hash_string(const char *s, uint64_t hash) {
+  for (; *s != '\0'; s++) {
+    hash ^= (unsigned char) *s;
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static uint64_t hash_key(const char *playlist_uri, const char *key) {
+  uint64_t hash = hash_string(playlist_uri, 0xcbf29ce484222325ULL);
+  hash = hash_string(" ", hash);
+  return hash_string(key, hash);
+}
+
+static uint32_t *generation_of(struct shared_cache *cache,
+                               const char *playlist_uri) {
+  uint64_t hash = hash_string(playlist_uri, 0xcbf29ce484222325ULL);
+  return &cache->region->generations[hash % NUM_GENERATIONS];
+}
+
+static struct slot *slot_at(struct shared_cache *cache, uint64_t index) {
+  return (struct slot *) (cache->slots + (index % cache->num_slots) *
+                                         cache->slot_size);
+}
+
+static int64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+struct shared_cache *shared_cache_new(int num_slots, size_t slot_size) {
+  struct shared_cache *cache = calloc(1, sizeof(struct shared_cache));
+
+  if (cache == NULL)
+    return NULL;
+
+  // Pages are only backed by memory once they're written to
+  cache->num_slots = num_slots;
+  cache->slot_size = slot_size;
+  cache->mapped_size = sizeof(struct shared_region) + num_slots * slot_size;
+  void *mapped = mmap(NULL, cache->mapped_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (mapped == MAP_FAILED) {
+    free(cache);
+    return NULL;
+  }
+
+  cache->region = mapped;
+  cache->slots = (char *) mapped + sizeof(struct shared_region);
+  return cache;
+}
+
+void shared_cache_free(struct shared_cache *cache) {
+  munmap(cache->region, cache->mapped_size);
+  free(cache);
+}
+
+uint32_t shared_cache_generation(struct shared_cache *cache,
+                                 const char *playlist_uri) {
+  return __atomic_load_n(generation_of(cache, playlist_uri), __ATOMIC_ACQUIRE);
+}
+
+// Copies a slot's body out if it holds `key`, then checks that no writer
+// touched the slot meanwhile
+static bool read_slot(struct shared_cache *cache,
+                      struct slot *slot,
+                      uint64_t key_hash,
+                      const char *full_key,
+                      uint32_t generation,
+                      struct evbuffer *out) {
+  uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+  if ((sequence & 1) != 0 || sequence == 0 ||
+      __atomic_load_n(&slot->key_hash, __ATOMIC_RELAXED) != key_hash)
+    return false;
+
+  size_t capacity = cache->slot_size - sizeof(struct slot);
+  uint32_t body_len = __atomic_load_n(&slot->body_len, __ATOMIC_RELAXED);
+  bool valid = body_len <= capacity &&
+      __atomic_load_n(&slot->generation, __ATOMIC_RELAXED) == generation &&
+      now() - __atomic_load_n(&slot->stored_at, __ATOMIC_RELAXED) <=
+          kSharedCacheMaxAge &&
+      strncmp(slot->key, full_key, MAX_KEY_LENGTH) == 0;
+
+  if (!valid)
+    return false;
+
+  struct evbuffer *body = evbuffer_new();
+
+  if (body == NULL)
+    return false;
+
+  evbuffer_add(body, (const char *) (slot + 1), body_len);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence) {
+    evbuffer_free(body);
+    return false;
+  }
+
+  evbuffer_add_buffer(out, body);
+  evbuffer_free(body);
+  return true;
+}
+
+bool shared_cache_get(struct shared_cache *cache,
+                      const char *playlist_uri,
+                      const char *key,
+                      struct evbuffer *out) {
+  char full_key[MAX_KEY_LENGTH];
+  int len = snprintf(full_key, sizeof(full_key), "%s %s", playlist_uri, key);
+  uint64_t key_hash = hash_key(playlist_uri, key);
+  uint32_t generation = shared_cache_generation(cache, playlist_uri);
+
+  // Each key can live in one of two slots
+  bool hit = len < MAX_KEY_LENGTH &&
+      (read_slot(cache, slot_at(cache, key_hash), key_hash, full_key,
+                 generation, out) ||
+       read_slot(cache, slot_at(cache, key_hash >> 32), key_hash, full_key,
+                 generation, out));
+
+  if (hit)
+    cache->stats.hits++;
+  else
+    cache->stats.misses++;
+
+  return hit;
+}
+
+void shared_cache_put(struct shared_cache *cache,
+                      const char *playlist_uri,
+                      const char *key,
+                      uint32_t generation,
+                      const char *body,
+                      size_t body_len) {
+  char full_key[MAX_KEY_LENGTH];
+  int len = snprintf(full_key, sizeof(full_key), "%s %s", playlist_uri, key);
+
+  if (len >= MAX_KEY_LENGTH ||
+      body_len > cache->slot_size - sizeof(struct slot))
+    return;
+
+  // Take the slot that has the key already, else the older one
+  uint64_t key_hash = hash_key(playlist_uri, key);
+  struct slot *first = slot_at(cache, key_hash);
+  struct slot *second = slot_at(cache, key_hash >> 32);
+  struct slot *slot;
+
+  if (__atomic_load_n(&first->key_hash, __ATOMIC_RELAXED) == key_hash)
+    slot = first;
+  else if (__atomic_load_n(&second->key_hash, __ATOMIC_RELAXED) == key_hash)
+    slot = second;
+  else if (__atomic_load_n(&first->stored_at, __ATOMIC_RELAXED) <=
+           __atomic_load_n(&second->stored_at, __ATOMIC_RELAXED))
+    slot = first;
+  else
+    slot = second;
+
+  uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+
+  if ((sequence & 1) != 0 ||
+      !__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence + 1,
+                                   false, __ATOMIC_ACQUIRE,
+                                   __ATOMIC_RELAXED)) {
+    cache->stats.busy++;
+    return;
+  }
+
+  __atomic_store_n(&slot->key_hash, key_hash, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->generation, generation, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->stored_at, now(), __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->body_len, body_len, __ATOMIC_RELAXED);
+  memcpy(slot->key, full_key, len + 1);
+  memcpy(slot + 1, body, body_len);
+  __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+  cache->stats.stores++;
+}
+
+void shared_cache_invalidate(struct shared_cache *cache,
+                             const char *playlist_uri) {
+  __atomic_add_fetch(generation_of(cache, playlist_uri), 1, __ATOMIC_RELEASE);
+}
+
+void shared_cache_get_stats(struct shared_cache *cache,
+                            struct shared_cache_stats *stats) {
+  *stats = cache->stats;
+}
@@ -0,0 +1,57 @@
+#ifndef SHARED_CACHE_H_
+#define SHARED_CACHE_H_
+
+#include <event2/buffer.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Rendered playlist bodies shared by worker processes through anonymous
+// shared memory. Create it before forking. Slots have a fixed size and are
+// guarded by sequence locks: readers never block or write, and a writer
+// that finds a slot busy just doesn't store.
+//
+// Every playlist has a generation that is bumped when a worker sees it
+// change; bodies stored under an older generation are misses. Bodies also
+// expire after kSharedCacheMaxAge seconds, which bounds how stale a body
+// rendered from a session that hadn't seen the latest change can get.
+struct shared_cache;
+
+struct shared_cache_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long stores;
+  unsigned long busy;  // Stores skipped because another writer had the slot
+};
+
+struct shared_cache *shared_cache_new(int num_slots, size_t slot_size);
+
+void shared_cache_free(struct shared_cache *cache);
+
+// Current generation of a playlist. Read it before rendering a body and
+// store the body under it.
+uint32_t shared_cache_generation(struct shared_cache *cache,
+                                 const char *playlist_uri);
+
+// Appends a stored body to `out`. Returns false on a miss.
+bool shared_cache_get(struct shared_cache *cache,
+                      const char *playlist_uri,
+                      const char *key,
+                      struct evbuffer *out);
+
+void shared_cache_put(struct shared_cache *cache,
+                      const char *playlist_uri,
+                      const char *key,
+                      uint32_t generation,
+                      const char *body,
+                      size_t body_len);
+
+// Makes every stored body of a playlist a miss, in all workers
+void shared_cache_invalidate(struct shared_cache *cache,
+                             const char *playlist_uri);
+
+// Counters of this process
+void shared_cache_get_stats(struct shared_cache *cache,
+                            struct shared_cache_stats *stats);
+
+#endif
@@ -0,0 +1,161 @@
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "arena.h"
+#include "track_batch.h"
+#include "track_id.h"
+
+static bool track_batch_init(struct track_batch *batch,
+                             int capacity,
+                             struct arena *arena) {
+  memset(batch, 0, sizeof(*batch));
+
+  if (capacity == 0)
+    return true;
+
+  batch->tracks = arena_alloc(arena, capacity * sizeof(sp_track *));
+  batch->track_ids = arena_alloc(arena, capacity * TRACK_ID_SIZE);
+  batch->rejected = arena_alloc(arena, capacity * sizeof(int));
+  return batch->tracks != NULL &&
+         batch->track_ids != NULL &&
+         batch->rejected != NULL;
+}
+
+// Looks up the track of a validated URI, which is TRACK_URI_LENGTH bytes
+// but not necessarily NUL terminated
+static sp_track *track_from_uri(const char *uri) {
+  char terminated_uri[TRACK_URI_LENGTH + 1];
+  memcpy(terminated_uri, uri, TRACK_URI_LENGTH);
+  terminated_uri[TRACK_URI_LENGTH] = '\0';
+  sp_link *link = sp_link_create_from_string(terminated_uri);
+
+  if (link == NULL)
+    return NULL;
+
+  sp_track *track = NULL;
+
+  if (sp_link_type(link) == SP_LINKTYPE_TRACK) {
+    track = sp_link_as_track(link);
+
+    if (track != NULL)
+      sp_track_add_ref(track);
+  }
+
+  sp_link_release(link);
+  return track;
+}
+
+// Adds input entry `index`. `uri` is NULL for entries that failed validation;
+// otherwise the ID is already in place at the end of `batch->track_ids`.
+static void track_batch_add(struct track_batch *batch,
+                            int index,
+                            const char *uri) {
+  sp_track *track = uri != NULL ? track_from_uri(uri) : NULL;
+
+  if (track == NULL)
+    batch->rejected[batch->num_rejected++] = index;
+  else
+    batch->tracks[batch->num_tracks++] = track;
+}
+
+bool track_batch_from_json(struct track_batch *batch,
+                           json_t *json,
+                           struct arena *arena) {
+  if (!json_is_array(json))
+    return false;
+
+  int num_uris = json_array_size(json);
+
+  if (!track_batch_init(batch, num_uris, arena))
+    return false;
+
+  if (num_uris == 0)
+    return true;
+
+  // Validate and decode all URIs in one pass before asking libspotify
+  const char **uris = arena_alloc(arena, num_uris * sizeof(const char *));
+  unsigned char *ids = arena_alloc(arena, num_uris * TRACK_ID_SIZE);
+  bool *valid = arena_alloc(arena, num_uris * sizeof(bool));
+
+  if (uris == NULL || ids == NULL || valid == NULL)
+    return false;
+
+  for (int i = 0; i < num_uris; i++) {
+    json_t *item = json_array_get(json, i);
+    uris[i] = json_is_string(item) ? json_string_value(item) : NULL;
+  }
+
+  track_ids_from_uris(uris, num_uris, ids, valid);
+
+  for (int i = 0; i < num_uris; i++) {
+    if (valid[i])
+      memcpy(batch->track_ids + batch->num_tracks * TRACK_ID_SIZE,
+             ids + i * TRACK_ID_SIZE, TRACK_ID_SIZE);
+
+    track_batch_add(batch, i, valid[i] ? uris[i] : NULL);
+  }
+
+  return true;
+}
+
+bool track_batch_from_evbuffer(struct track_batch *batch,
+                               struct evbuffer *buf,
+                               struct arena *arena) {
+  size_t len = evbuffer_get_length(buf);
+
+  if (len == 0)
+    return track_batch_init(batch, 0, arena);
+
+  const char *body = (const char *) evbuffer_pullup(buf, len);
+
+  if (body == NULL)
+    return false;
+
+  const char *end = body + len;
+  int capacity = 1;
+
+  for (const char *eol = body; (eol = memchr(eol, '\n', end - eol)) != NULL;
+       eol++)
+    capacity++;
+
+  if (!track_batch_init(batch, capacity, arena)) {
+    evbuffer_drain(buf, len);
+    return false;
+  }
+
+  int index = 0;
+
+  for (const char *line = body; line < end; ) {
+    const char *eol = memchr(line, '\n', end - line);
+    const char *next = eol != NULL ? eol + 1 : end;
+
+    if (eol == NULL)
+      eol = end;
+
+    while (eol > line && (eol[-1] == '\r' || eol[-1] == ' ' ||
+                          eol[-1] == '\t'))
+      eol--;
+
+    if (eol > line && line[0] != '#') {
+      unsigned char *id = batch->track_ids + batch->num_tracks * TRACK_ID_SIZE;
+      bool valid = track_uri_is_valid(line, eol - line) &&
+                   track_id_from_base62(line + TRACK_URI_PREFIX_LENGTH, id);
+      track_batch_add(batch, index++, valid ? line : NULL);
+    }
+
+    line = next;
+  }
+
+  evbuffer_drain(buf, len);
+  return true;
+}
+
+void track_batch_release(struct track_batch *batch) {
+  for (int i = 0; i < batch->num_tracks; i++)
+    sp_track_release(batch->tracks[i]);
+
+  batch->num_tracks = 0;
+}
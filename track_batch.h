@@ -0,0 +1,37 @@
+#ifndef TRACK_BATCH_H_
+#define TRACK_BATCH_H_
+
+#include <event2/buffer.h>
+#include <jansson.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+
+#include "arena.h"
+
+// Tracks resolved from a list of track URIs in a request body. All arrays
+// are allocated from the request's arena.
+struct track_batch {
+  sp_track **tracks;         // Resolved tracks; the batch holds a reference
+  unsigned char *track_ids;  // TRACK_ID_SIZE bytes per resolved track
+  int num_tracks;
+  int *rejected;             // Input positions of entries that weren't tracks
+  int num_rejected;
+};
+
+// Resolves a JSON array of track URIs. Returns false if `json` isn't an array
+// or if out of memory.
+bool track_batch_from_json(struct track_batch *batch,
+                           json_t *json,
+                           struct arena *arena);
+
+// Resolves a text/uri-list body: one URI per line, with blank lines and
+// lines starting with # skipped. Drains the buffer. Returns false if out of
+// memory.
+bool track_batch_from_evbuffer(struct track_batch *batch,
+                               struct evbuffer *buf,
+                               struct arena *arena);
+
+// Releases the references held on the tracks
+void track_batch_release(struct track_batch *batch);
+
+#endif
@@ -0,0 +1,176 @@
+#include <apr.h>
+#include <apr_hash.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include "metadata.h"
+#include "track_cache.h"
+#include "track_id.h"
+
+// The one metadata wait for a track, shared by everyone waiting for it
+struct track_lookup {
+  struct track_cache *cache;
+  unsigned char track_id[TRACK_ID_SIZE];
+  struct track_waiter_list waiters;
+};
+
+static void make_key(unsigned char *key,
+                     const unsigned char *track_id,
+                     int variant) {
+  memcpy(key, track_id, TRACK_ID_SIZE);
+  key[TRACK_ID_SIZE] = (unsigned char) variant;
+}
+
+static void entry_free(struct track_cache *cache,
+                       struct track_cache_entry *entry) {
+  apr_hash_set(cache->entries, entry->key, sizeof(entry->key), NULL);
+  TAILQ_REMOVE(&cache->lru, entry, lru_entries);
+  cache->num_entries--;
+  free(entry->body);
+  free(entry);
+}
+
+struct track_cache *track_cache_new(apr_pool_t *pool,
+                                    int max_entries,
+                                    struct metadata_waits *metadata_waits) {
+  struct track_cache *cache = malloc(sizeof(struct track_cache));
+
+  if (cache == NULL)
+    return NULL;
+
+  cache->entries = apr_hash_make(pool);
+  TAILQ_INIT(&cache->lru);
+  cache->num_entries = 0;
+  cache->max_entries = max_entries;
+  cache->lookups = apr_hash_make(pool);
+  cache->metadata_waits = metadata_waits;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->coalesced = 0;
+  return cache;
+}
+
+void track_cache_free(struct track_cache *cache) {
+  while (!TAILQ_EMPTY(&cache->lru))
+    entry_free(cache, TAILQ_FIRST(&cache->lru));
+
+  free(cache);
+}
+
+static struct track_cache_entry *entry_get(struct track_cache *cache,
+                                           const unsigned char *track_id,
+                                           int variant) {
+  unsigned char key[TRACK_ID_SIZE + 1];
+  make_key(key, track_id, variant);
+  return apr_hash_get(cache->entries, key, sizeof(key));
+}
+
+bool track_cache_contains(struct track_cache *cache,
+                          const unsigned char *track_id,
+                          int variant) {
+  return entry_get(cache, track_id, variant) != NULL;
+}
+
+const struct track_cache_entry *track_cache_get(struct track_cache *cache,
+                                                const unsigned char *track_id,
+                                                int variant) {
+  struct track_cache_entry *entry = entry_get(cache, track_id, variant);
+
+  if (entry == NULL) {
+    cache->misses++;
+    return NULL;
+  }
+
+  // Most recently used entries live at the tail
+  TAILQ_REMOVE(&cache->lru, entry, lru_entries);
+  TAILQ_INSERT_TAIL(&cache->lru, entry, lru_entries);
+  cache->hits++;
+  return entry;
+}
+
+void track_cache_put(struct track_cache *cache,
+                     const unsigned char *track_id,
+                     int variant,
+                     const char *body,
+                     size_t body_len) {
+  if (cache->max_entries <= 0)
+    return;
+
+  struct track_cache_entry *entry = entry_get(cache, track_id, variant);
+
+  if (entry != NULL)
+    entry_free(cache, entry);
+
+  while (cache->num_entries >= cache->max_entries)
+    entry_free(cache, TAILQ_FIRST(&cache->lru));
+
+  entry = malloc(sizeof(struct track_cache_entry));
+
+  if (entry == NULL)
+    return;
+
+  entry->body = malloc(body_len > 0 ? body_len : 1);
+
+  if (entry->body == NULL) {
+    free(entry);
+    return;
+  }
+
+  make_key(entry->key, track_id, variant);
+  memcpy(entry->body, body, body_len);
+  entry->body_len = body_len;
+  apr_hash_set(cache->entries, entry->key, sizeof(entry->key), entry);
+  TAILQ_INSERT_TAIL(&cache->lru, entry, lru_entries);
+  cache->num_entries++;
+}
+
+static void lookup_finished(bool complete, void *userdata) {
+  struct track_lookup *lookup = userdata;
+  apr_hash_set(lookup->cache->lookups, lookup->track_id, TRACK_ID_SIZE, NULL);
+
+  while (!TAILQ_EMPTY(&lookup->waiters)) {
+    struct track_waiter *waiter = TAILQ_FIRST(&lookup->waiters);
+    TAILQ_REMOVE(&lookup->waiters, waiter, entries);
+    waiter->callback(complete, waiter->userdata);
+  }
+
+  free(lookup);
+}
+
+void track_cache_wait(struct track_cache *cache,
+                      sp_track *track,
+                      const unsigned char *track_id,
+                      const struct timeval *timeout,
+                      struct track_waiter *waiter,
+                      metadata_loaded_fn callback,
+                      void *userdata) {
+  waiter->callback = callback;
+  waiter->userdata = userdata;
+  struct track_lookup *lookup = apr_hash_get(cache->lookups, track_id,
+                                             TRACK_ID_SIZE);
+
+  if (lookup != NULL) {
+    TAILQ_INSERT_TAIL(&lookup->waiters, waiter, entries);
+    cache->coalesced++;
+    return;
+  }
+
+  lookup = malloc(sizeof(struct track_lookup));
+
+  if (lookup == NULL) {
+    callback(false, userdata);
+    return;
+  }
+
+  lookup->cache = cache;
+  memcpy(lookup->track_id, track_id, TRACK_ID_SIZE);
+  TAILQ_INIT(&lookup->waiters);
+  TAILQ_INSERT_TAIL(&lookup->waiters, waiter, entries);
+  apr_hash_set(cache->lookups, lookup->track_id, TRACK_ID_SIZE, lookup);
+  metadata_wait_tracks(cache->metadata_waits, &track, 1, timeout,
+                       &lookup_finished, lookup);
+}
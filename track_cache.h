@@ -0,0 +1,87 @@
+#ifndef TRACK_CACHE_H_
+#define TRACK_CACHE_H_
+
+#include <apr.h>
+#include <apr_hash.h>
+#include <libspotify/api.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include "metadata.h"
+#include "track_id.h"
+
+// A track rendered in one variant of the caller's choosing, e.g. a reply
+// format
+struct track_cache_entry {
+  unsigned char key[TRACK_ID_SIZE + 1];  // Track ID and variant
+  char *body;
+  size_t body_len;
+  TAILQ_ENTRY(track_cache_entry) lru_entries;
+};
+
+TAILQ_HEAD(track_cache_entry_list, track_cache_entry);
+
+// A request waiting for a track's metadata. Owned by the caller.
+struct track_waiter {
+  metadata_loaded_fn callback;
+  void *userdata;
+  TAILQ_ENTRY(track_waiter) entries;
+};
+
+TAILQ_HEAD(track_waiter_list, track_waiter);
+
+// Bounded LRU cache of rendered tracks, keyed by track ID and variant. Only
+// tracks with all their metadata are meant to be cached; that doesn't
+// change, so entries don't expire.
+//
+// Also coalesces waiting for metadata: requests for a track that is already
+// being waited for join that wait instead of starting their own.
+struct track_cache {
+  apr_hash_t *entries;  // key -> struct track_cache_entry *
+  struct track_cache_entry_list lru;
+  int num_entries;
+  int max_entries;
+  apr_hash_t *lookups;  // track ID -> struct track_lookup *
+  struct metadata_waits *metadata_waits;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long coalesced;  // Waits joined rather than started
+};
+
+struct track_cache *track_cache_new(apr_pool_t *pool,
+                                    int max_entries,
+                                    struct metadata_waits *metadata_waits);
+
+// Waits still in flight must have been called back, i.e. the metadata waits
+// freed, before the cache is freed
+void track_cache_free(struct track_cache *cache);
+
+// True if the track is cached in the variant. Doesn't count as a hit.
+bool track_cache_contains(struct track_cache *cache,
+                          const unsigned char *track_id,
+                          int variant);
+
+// Returns the cached rendering of a track, or NULL
+const struct track_cache_entry *track_cache_get(struct track_cache *cache,
+                                                const unsigned char *track_id,
+                                                int variant);
+
+void track_cache_put(struct track_cache *cache,
+                     const unsigned char *track_id,
+                     int variant,
+                     const char *body,
+                     size_t body_len);
+
+// Waits for a track's metadata, joining a wait for the same track if there
+// is one. The callback may be called right away.
+void track_cache_wait(struct track_cache *cache,
+                      sp_track *track,
+                      const unsigned char *track_id,
+                      const struct timeval *timeout,
+                      struct track_waiter *waiter,
+                      metadata_loaded_fn callback,
+                      void *userdata);
+
+#endif
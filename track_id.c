@@ -0,0 +1,243 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "track_id.h"
+#include "track_id_impl.h"
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static const char kBase62Digits[] =
+    "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+// Digit values by character; -1 for characters that aren't base62 digits
+static signed char base62_values[256];
+static bool base62_values_ready = false;
+
+static void base62_values_init(void) {
+  memset(base62_values, -1, sizeof(base62_values));
+
+  for (int i = 0; i < 62; i++)
+    base62_values[(unsigned char) kBase62Digits[i]] = i;
+
+  base62_values_ready = true;
+}
+
+bool track_id_from_base62(const char *base62, unsigned char *id) {
+  if (!base62_values_ready)
+    base62_values_init();
+
+#ifdef __SIZEOF_INT128__
+  unsigned __int128 value = 0;
+  const unsigned __int128 max = ~(unsigned __int128) 0;
+
+  // 62^21 < 2^128, so only the last digit can overflow
+  for (int i = 0; i < TRACK_ID_BASE62_LENGTH; i++) {
+    int digit = base62_values[(unsigned char) base62[i]];
+
+    if (digit < 0)
+      return false;
+
+    if (i == TRACK_ID_BASE62_LENGTH - 1 &&
+        (value > max / 62 || value * 62 > max - digit))
+      return false;
+
+    value = value * 62 + digit;
+  }
+
+  for (int i = TRACK_ID_SIZE - 1; i >= 0; i--) {
+    id[i] = value & 0xff;
+    value >>= 8;
+  }
+
+  return true;
+#else
+  memset(id, 0, TRACK_ID_SIZE);
+
+  // Big-endian multiply-accumulate: id = id * 62 + digit
+  for (int i = 0; i < TRACK_ID_BASE62_LENGTH; i++) {
+    int digit = base62_values[(unsigned char) base62[i]];
+
+    if (digit < 0)
+      return false;
+
+    unsigned int carry = digit;
+
+    for (int j = TRACK_ID_SIZE - 1; j >= 0; j--) {
+      carry += id[j] * 62u;
+      id[j] = carry & 0xff;
+      carry >>= 8;
+    }
+
+    // 62^22 > 2^128: some 22 digit strings don't fit
+    if (carry != 0)
+      return false;
+  }
+
+  return true;
+#endif
+}
+
+void track_id_to_base62(const unsigned char *id, char *base62) {
+  unsigned char n[TRACK_ID_SIZE];
+  memcpy(n, id, TRACK_ID_SIZE);
+
+  // Long division by 62, least significant digit first
+  for (int i = TRACK_ID_BASE62_LENGTH - 1; i >= 0; i--) {
+    unsigned int remainder = 0;
+
+    for (int j = 0; j < TRACK_ID_SIZE; j++) {
+      unsigned int value = (remainder << 8) | n[j];
+      n[j] = value / 62;
+      remainder = value % 62;
+    }
+
+    base62[i] = kBase62Digits[remainder];
+  }
+}
+
+bool track_id_from_uri(const char *uri, unsigned char *id) {
+  if (!track_uri_is_valid(uri, strlen(uri)))
+    return false;
+
+  return track_id_from_base62(uri + TRACK_URI_PREFIX_LENGTH, id);
+}
+
+void track_id_to_uri(const unsigned char *id, char *uri) {
+  memcpy(uri, TRACK_URI_PREFIX, TRACK_URI_PREFIX_LENGTH);
+  track_id_to_base62(id, uri + TRACK_URI_PREFIX_LENGTH);
+  uri[TRACK_URI_LENGTH] = '\0';
+}
+
+bool track_uri_is_valid_scalar(const char *uri) {
+  if (memcmp(uri, TRACK_URI_PREFIX, TRACK_URI_PREFIX_LENGTH) != 0)
+    return false;
+
+  for (size_t i = TRACK_URI_PREFIX_LENGTH; i < TRACK_URI_LENGTH; i++) {
+    char c = uri[i];
+
+    if (!((c >= '0' && c <= '9') ||
+          (c >= 'a' && c <= 'z') ||
+          (c >= 'A' && c <= 'Z')))
+      return false;
+  }
+
+  return true;
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Lanes holding base62 digits. Bytes >= 0x80 are negative as signed chars
+// and fail every range check.
+__attribute__((target("sse2")))
+static inline __m128i base62_mask_sse2(__m128i c) {
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+  __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)),
+                                _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)),
+                                _mm_cmplt_epi8(c, _mm_set1_epi8('Z' + 1)));
+  return _mm_or_si128(digit, _mm_or_si128(lower, upper));
+}
+
+// Bytes 0-13 are the prefix, 14-35 the digits. Three overlapping loads
+// cover all 36.
+__attribute__((target("sse2")))
+bool track_uri_is_valid_sse2(const char *uri) {
+  __m128i head = _mm_loadu_si128((const __m128i *) uri);
+  __m128i middle = _mm_loadu_si128((const __m128i *) (uri + 16));
+  __m128i tail = _mm_loadu_si128((const __m128i *) (uri + 20));
+  __m128i prefix = _mm_loadu_si128((const __m128i *) "spotify:track:\0\0");
+
+  unsigned int prefix_ok = _mm_movemask_epi8(_mm_cmpeq_epi8(head, prefix));
+  unsigned int head_ok = _mm_movemask_epi8(base62_mask_sse2(head));
+  unsigned int middle_ok = _mm_movemask_epi8(base62_mask_sse2(middle));
+  unsigned int tail_ok = _mm_movemask_epi8(base62_mask_sse2(tail));
+
+  return (prefix_ok & 0x3fff) == 0x3fff &&
+         (head_ok & 0xc000) == 0xc000 &&
+         middle_ok == 0xffff &&
+         tail_ok == 0xffff;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i base62_mask_avx2(__m256i c) {
+  __m256i digit = _mm256_and_si256(
+      _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+  __m256i lower = _mm256_and_si256(
+      _mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c));
+  __m256i upper = _mm256_and_si256(
+      _mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)),
+      _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), c));
+  return _mm256_or_si256(digit, _mm256_or_si256(lower, upper));
+}
+
+// One load for the prefix (bytes 0-31) and one for the digits (4-35)
+__attribute__((target("avx2")))
+bool track_uri_is_valid_avx2(const char *uri) {
+  static const char prefix_bytes[32] = TRACK_URI_PREFIX;
+  __m256i head = _mm256_loadu_si256((const __m256i *) uri);
+  __m256i tail = _mm256_loadu_si256((const __m256i *) (uri + 4));
+  __m256i prefix = _mm256_loadu_si256((const __m256i *) prefix_bytes);
+
+  unsigned int prefix_ok = _mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(head, prefix));
+  unsigned int digits_ok = _mm256_movemask_epi8(base62_mask_avx2(tail));
+
+  // Digits start at byte 14, which is lane 10 of the second load
+  return (prefix_ok & 0x3fff) == 0x3fff &&
+         (digits_ok & 0xfffffc00u) == 0xfffffc00u;
+}
+
+static bool (*track_uri_is_valid_impl)(const char *) = NULL;
+
+static void select_impl(void) {
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+    track_uri_is_valid_impl = &track_uri_is_valid_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    track_uri_is_valid_impl = &track_uri_is_valid_sse2;
+  else
+    track_uri_is_valid_impl = &track_uri_is_valid_scalar;
+}
+
+#endif
+
+bool track_uri_is_valid(const char *uri, size_t len) {
+  if (len != TRACK_URI_LENGTH)
+    return false;
+
+#ifdef HAVE_X86_SIMD
+  if (track_uri_is_valid_impl == NULL)
+    select_impl();
+
+  return track_uri_is_valid_impl(uri);
+#else
+  return track_uri_is_valid_scalar(uri);
+#endif
+}
+
+int track_ids_from_uris(const char *const *uris,
+                        int num_uris,
+                        unsigned char *ids,
+                        bool *valid) {
+  int num_valid = 0;
+
+  for (int i = 0; i < num_uris; i++) {
+    const char *uri = uris[i];
+    valid[i] = uri != NULL &&
+               track_uri_is_valid(uri, strlen(uri)) &&
+               track_id_from_base62(uri + TRACK_URI_PREFIX_LENGTH,
+                                    ids + i * TRACK_ID_SIZE);
+
+    if (valid[i])
+      num_valid++;
+  }
+
+  return num_valid;
+}
@@ -0,0 +1,39 @@
+#ifndef TRACK_ID_H_
+#define TRACK_ID_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Spotify IDs are 128 bit numbers. URIs spell them out as 22 base62 digits,
+// e.g. spotify:track:58PipbkYEkKFzOowRPHF3m.
+#define TRACK_ID_SIZE 16
+#define TRACK_ID_BASE62_LENGTH 22
+#define TRACK_URI_PREFIX "spotify:track:"
+#define TRACK_URI_PREFIX_LENGTH (sizeof(TRACK_URI_PREFIX) - 1)
+#define TRACK_URI_LENGTH (TRACK_URI_PREFIX_LENGTH + TRACK_ID_BASE62_LENGTH)
+
+// Decodes 22 base62 digits. Returns false on bad digits or overflow.
+bool track_id_from_base62(const char *base62, unsigned char *id);
+
+// Encodes an ID as 22 base62 digits (not NUL terminated)
+void track_id_to_base62(const unsigned char *id, char *base62);
+
+// Decodes a NUL terminated spotify:track:<id> URI
+bool track_id_from_uri(const char *uri, unsigned char *id);
+
+// Writes a NUL terminated track URI; `uri` holds TRACK_URI_LENGTH + 1 bytes
+void track_id_to_uri(const unsigned char *id, char *uri);
+
+// Cheap check that a string is spotify:track: followed by 22 base62 digits.
+// Uses SSE2 or AVX2 where the CPU has them.
+bool track_uri_is_valid(const char *uri, size_t len);
+
+// Validates and decodes a batch of NUL terminated URIs. For each URI,
+// `valid[i]` tells whether it is a well-formed track URI, in which case its
+// ID is at `ids + i * TRACK_ID_SIZE`. Returns the number of valid URIs.
+int track_ids_from_uris(const char *const *uris,
+                        int num_uris,
+                        unsigned char *ids,
+                        bool *valid);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef TRACK_ID_IMPL_H_
+#define TRACK_ID_IMPL_H_
+
+#include <stdbool.h>
+
+// The validators track_uri_is_valid() picks from, exposed so that the checks
+// can hold them against each other. Each takes a URI of TRACK_URI_LENGTH
+// bytes. Only call the SIMD ones if the CPU has the instructions.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#endif
+
+bool track_uri_is_valid_scalar(const char *uri);
+
+#ifdef HAVE_X86_SIMD
+bool track_uri_is_valid_sse2(const char *uri);
+bool track_uri_is_valid_avx2(const char *uri);
+#endif
+
+#endif